@@ -1,306 +1,1450 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <sys/wait.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <signal.h>
-#include <dirent.h>
-
-#define MAX_INPUT_LENGTH 1024
-#define MAX_ARGS 64
-#define MAX_COMMANDS 10
-#define MAX_HISTORY 100
-
-char history[MAX_HISTORY][MAX_INPUT_LENGTH];
-int history_count = 0;
-
-void add_to_history(const char *cmd) {
-    if (cmd[0] == '\0') return;
-    if (history_count < MAX_HISTORY) {
-        strncpy(history[history_count], cmd, MAX_INPUT_LENGTH - 1);
-        history[history_count][MAX_INPUT_LENGTH - 1] = '\0';
-        history_count++;
-    } else {
-        for (int i = 0; i < MAX_HISTORY - 1; i++) {
-            strcpy(history[i], history[i + 1]);
-        }
-        strncpy(history[MAX_HISTORY - 1], cmd, MAX_INPUT_LENGTH - 1);
-        history[MAX_HISTORY - 1][MAX_INPUT_LENGTH - 1] = '\0';
-    }
-}
-
-void print_history() {
-    for (int i = 0; i < history_count; i++) {
-        printf("%d: %s\n", i + 1, history[i]);
-    }
-}
-
-int parse_command(char *cmd, char **args, char **input_file, char **output_file, int *append) {
-    *input_file = NULL;
-    *output_file = NULL;
-    *append = 0;
-
-    char *token = strtok(cmd, " \t");
-    int i = 0;
-    while (token != NULL) {
-        if (strcmp(token, "<") == 0) {
-            token = strtok(NULL, " \t");
-            if (!token) {
-                fprintf(stderr, "Syntax error: expected input file after <\n");
-                return -1;
-            }
-            *input_file = token;
-        } else if (strcmp(token, ">") == 0) {
-            token = strtok(NULL, " \t");
-            if (!token) {
-                fprintf(stderr, "Syntax error: expected output file after >\n");
-                return -1;
-            }
-            *output_file = token;
-            *append = 0;
-        } else if (strcmp(token, ">>") == 0) {
-            token = strtok(NULL, " \t");
-            if (!token) {
-                fprintf(stderr, "Syntax error: expected output file after >>\n");
-                return -1;
-            }
-            *output_file = token;
-            *append = 1;
-        } else {
-            args[i++] = token;
-        }
-        token = strtok(NULL, " \t");
-    }
-    args[i] = NULL;
-    return 0;
-}
-
-int execute_single_command(char **args, char *input_file, char *output_file, int append) {
-    pid_t pid = fork();
-    if (pid < 0) {
-        perror("fork");
-        return -1;
-    } else if (pid == 0) {
-        struct sigaction sa;
-        sa.sa_handler = SIG_DFL;
-        sigemptyset(&sa.sa_mask);
-        sa.sa_flags = 0;
-        sigaction(SIGINT, &sa, NULL);
-
-        if (input_file) {
-            int fd = open(input_file, O_RDONLY);
-            if (fd < 0) {
-                perror("open input file");
-                exit(EXIT_FAILURE);
-            }
-            dup2(fd, STDIN_FILENO);
-            close(fd);
-        }
-
-        if (output_file) {
-            int flags = O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC);
-            int fd = open(output_file, flags, 0644);
-            if (fd < 0) {
-                perror("open output file");
-                exit(EXIT_FAILURE);
-            }
-            dup2(fd, STDOUT_FILENO);
-            close(fd);
-        }
-
-        execvp(args[0], args);
-        perror("execvp");
-        exit(EXIT_FAILURE);
-    } else {
-        int status;
-        waitpid(pid, &status, 0);
-        return WEXITSTATUS(status);
-    }
-}
-
-int execute_pipeline(char **commands[], int num_commands) {
-    int prev_pipe = -1;
-    int status = 0;
-    pid_t pids[MAX_COMMANDS];
-
-    for (int i = 0; i < num_commands; i++) {
-        int pipefd[2];
-        if (i < num_commands - 1 && pipe(pipefd) == -1) {
-            perror("pipe");
-            return -1;
-        }
-
-        pid_t pid = fork();
-        if (pid < 0) {
-            perror("fork");
-            return -1;
-        } else if (pid == 0) {
-            struct sigaction sa;
-            sa.sa_handler = SIG_DFL;
-            sigemptyset(&sa.sa_mask);
-            sa.sa_flags = 0;
-            sigaction(SIGINT, &sa, NULL);
-
-            if (i > 0) {
-                dup2(prev_pipe, STDIN_FILENO);
-                close(prev_pipe);
-            }
-
-            if (i < num_commands - 1) {
-                close(pipefd[0]);
-                dup2(pipefd[1], STDOUT_FILENO);
-                close(pipefd[1]);
-            }
-
-            char *args[MAX_ARGS];
-            char *input_file = NULL, *output_file = NULL;
-            int append = 0;
-            char cmd_copy[MAX_INPUT_LENGTH];
-            strncpy(cmd_copy, *commands[i], MAX_INPUT_LENGTH);
-            cmd_copy[MAX_INPUT_LENGTH - 1] = '\0';
-
-            if (parse_command(cmd_copy, args, &input_file, &output_file, &append) < 0)
-                exit(EXIT_FAILURE);
-
-            if (input_file) {
-                int fd = open(input_file, O_RDONLY);
-                if (fd < 0) {
-                    perror("open input file");
-                    exit(EXIT_FAILURE);
-                }
-                dup2(fd, STDIN_FILENO);
-                close(fd);
-            }
-
-            if (output_file) {
-                int flags = O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC);
-                int fd = open(output_file, flags, 0644);
-                if (fd < 0) {
-                    perror("open output file");
-                    exit(EXIT_FAILURE);
-                }
-                dup2(fd, STDOUT_FILENO);
-                close(fd);
-            }
-
-            execvp(args[0], args);
-            perror("execvp");
-            exit(EXIT_FAILURE);
-        } else {
-            pids[i] = pid;
-            if (i > 0) close(prev_pipe);
-            if (i < num_commands - 1) {
-                prev_pipe = pipefd[0];
-                close(pipefd[1]);
-            }
-        }
-    }
-
-    for (int i = 0; i < num_commands; i++) {
-        waitpid(pids[i], &status, 0);
-    }
-    return WEXITSTATUS(status);
-}
-
-void trim_whitespace(char **str) {
-    while (**str == ' ' || **str == '\t') (*str)++;
-    char *end = *str + strlen(*str) - 1;
-    while (end > *str && (*end == ' ' || *end == '\t' || *end == '\n')) end--;
-    *(end + 1) = '\0';
-}
-
-int split_commands(char *input, char *delim, char **commands, int max_cmds) {
-    int count = 0;
-    char *token = strtok(input, delim);
-    while (token && count < max_cmds) {
-        trim_whitespace(&token);
-        if (*token != '\0') commands[count++] = token;
-        token = strtok(NULL, delim);
-    }
-    return count;
-}
-
-int main() {
-    struct sigaction sa;
-    sa.sa_handler = SIG_IGN;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
-    sigaction(SIGINT, &sa, NULL);
-
-    char input[MAX_INPUT_LENGTH];
-
-    while (1) {
-        printf("sh> ");
-        fflush(stdout);
-
-        if (!fgets(input, MAX_INPUT_LENGTH, stdin)) break;
-        input[strcspn(input, "\n")] = '\0';
-        add_to_history(input);
-
-        char *groups[MAX_COMMANDS];
-        int num_groups = split_commands(input, ";", groups, MAX_COMMANDS);
-
-        for (int i = 0; i < num_groups; i++) {
-            char *group = groups[i];
-            if (strlen(group) == 0) continue;
-
-            if (strcmp(group, "exit") == 0) exit(0);
-            else if (strcmp(group, "history") == 0) {
-                print_history();
-                continue;
-            } else if (strncmp(group, "cd ", 3) == 0) {
-                char *dir = group + 3;
-                trim_whitespace(&dir);
-                if (chdir(dir) == -1){
-                    perror("cd");
-                }
-                continue;
-            }
-
-            char *sub_commands[MAX_COMMANDS];
-            int num_sub = split_commands(group, "&&", sub_commands, MAX_COMMANDS);
-            int last_status = 0;
-
-            for (int j = 0; j < num_sub; j++) {
-                if (last_status != 0) break;
-
-                char *pipeline[MAX_COMMANDS];
-                int num_pipes = split_commands(sub_commands[j], "|", pipeline, MAX_COMMANDS);
-                if (num_pipes == 0) continue;
-
-                char *commands[MAX_COMMANDS][MAX_ARGS];
-                for (int k = 0; k < num_pipes; k++) {
-                    char *args[MAX_ARGS];
-                    char *input_file = NULL, *output_file = NULL;
-                    int append = 0;
-                    char cmd_copy[MAX_INPUT_LENGTH];
-                    strncpy(cmd_copy, pipeline[k], MAX_INPUT_LENGTH);
-                    cmd_copy[MAX_INPUT_LENGTH - 1] = '\0';
-
-                    if (parse_command(cmd_copy, args, &input_file, &output_file, &append) < 0) {
-                        last_status = 1;
-                        break;
-                    }
-
-                    commands[k][0] = cmd_copy;
-                }
-
-                if (num_pipes == 1) {
-                    char *args[MAX_ARGS];
-                    char *input_file = NULL, *output_file = NULL;
-                    int append = 0;
-                    char cmd_copy[MAX_INPUT_LENGTH];
-                    strncpy(cmd_copy, pipeline[0], MAX_INPUT_LENGTH);
-                    parse_command(cmd_copy, args, &input_file, &output_file, &append);
-                    last_status = execute_single_command(args, input_file, output_file, append);
-                } else {
-                    last_status = execute_pipeline((char ***)pipeline, num_pipes);
-                }
-            }
-        }
-    }
-    return 0;
-}
\ No newline at end of file
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <dirent.h>
+#include <errno.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+extern char **environ;
+
+#define MAX_INPUT_LENGTH 1024
+#define MAX_HISTORY 100
+#define MAX_HISTORY_FILE 10000
+#define HASH_BUCKETS 256
+#define TRIGRAM_BUCKETS 65536
+#define ARENA_BLOCK_SIZE 4096
+#define PLAN_CACHE_SIZE 64
+#define HISTORY_READ_SIZE 65536
+
+// History is an append-only log of lines. With a history file the lines are
+// read straight from a shared read-only mapping of it; without one they are
+// kept in a heap buffer. Entries only record where each line starts, so
+// adding one never moves the others. The log keeps at most a quarter more
+// than history_file_size lines; past that the oldest are dropped, from the
+// file and the entries alike.
+typedef struct {
+    size_t offset;
+    uint32_t len;
+} HistoryEntry;
+
+// Entries containing a trigram, oldest first; trigrams share buckets and
+// candidates are checked against the text
+typedef struct {
+    uint32_t *entries;
+    uint32_t count;
+    uint32_t capacity;
+} Posting;
+
+HistoryEntry *history = NULL;
+uint32_t history_count = 0;
+uint32_t history_capacity = 0;
+uint32_t history_size = MAX_HISTORY;
+uint32_t history_file_size = MAX_HISTORY_FILE;
+uint32_t history_dropped = 0;
+char *history_text = NULL;
+size_t history_text_len = 0;
+size_t history_map_len = 0;
+int history_fd = -1;
+char *history_path = NULL;
+Posting *trigram_index = NULL;
+uint32_t indexed_count = 0;
+char *entry_copy = NULL;
+size_t entry_copy_size = 0;
+uint32_t *history_matches = NULL;
+uint32_t history_match_capacity = 0;
+
+// Another process can cut the history file short between the size check
+// and a read of its mapping, which then faults with SIGBUS. Readers of the
+// log guard themselves so the fault lands back in the reader.
+sigjmp_buf history_fault;
+volatile sig_atomic_t history_guarded = 0;
+
+// Command name to absolute path, filled as commands are first run and
+// dropped whenever PATH changes
+typedef struct HashEntry {
+    char *name;
+    char *path;
+    int hits;
+    struct HashEntry *next;
+} HashEntry;
+
+HashEntry *command_hash[HASH_BUCKETS];
+char *hashed_path_env = NULL;
+
+typedef enum {
+    TOKEN_WORD,
+    TOKEN_IN,
+    TOKEN_OUT,
+    TOKEN_APPEND,
+    TOKEN_PIPE,
+    TOKEN_AND,
+    TOKEN_SEMI,
+    TOKEN_END
+} TokenType;
+
+typedef struct {
+    TokenType type;
+    char *text;
+} Token;
+
+// A parsed line, executed as is: lists separated by ;, each a chain of
+// pipelines joined by &&, each a chain of commands joined by |
+typedef struct {
+    char **args;
+    char *input_file;
+    char *output_file;
+    int append;
+} Command;
+
+typedef struct {
+    Command *stages;
+    int count;
+} Pipeline;
+
+typedef struct {
+    Pipeline *pipelines;
+    int count;
+} AndList;
+
+typedef struct {
+    AndList *lists;
+    int count;
+} Plan;
+
+// Everything a plan points to is carved out of the blocks of one arena and
+// freed with it
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used;
+    size_t size;
+} ArenaBlock;
+
+#define ARENA_HEADER ((sizeof(ArenaBlock) + 15) & ~(size_t)15)
+
+typedef struct {
+    ArenaBlock *blocks;
+} Arena;
+
+typedef struct {
+    char *line;
+    Plan *plan;
+    Arena arena;
+} CachedPlan;
+
+CachedPlan plan_cache[PLAN_CACHE_SIZE];
+
+int append_entry(size_t offset, uint32_t len) {
+    if (history_count == history_capacity) {
+        uint32_t capacity = history_capacity ? history_capacity * 2 : 1024;
+        HistoryEntry *entries = realloc(history, capacity * sizeof(HistoryEntry));
+        if (!entries) return -1;
+        history = entries;
+        history_capacity = capacity;
+    }
+    history[history_count].offset = offset;
+    history[history_count].len = len;
+    history_count++;
+    return 0;
+}
+
+// Drop the trigram index; it is rebuilt on the next search
+void reset_index() {
+    if (trigram_index) {
+        for (uint32_t bucket = 0; bucket < TRIGRAM_BUCKETS; bucket++) free(trigram_index[bucket].entries);
+        free(trigram_index);
+        trigram_index = NULL;
+    }
+    indexed_count = 0;
+}
+
+// Drop every entry of a history file and the index built over them
+void reset_history() {
+    if (history_map_len) munmap(history_text, history_map_len);
+    history_text = NULL;
+    history_text_len = history_map_len = 0;
+    history_count = 0;
+    history_dropped = 0;
+    reset_index();
+}
+
+// Once the log holds a quarter more than history_file_size lines, forget
+// all but the newest history_file_size. A mapped file keeps its text;
+// a heap log moves what is left to the front of its buffer.
+void trim_history() {
+    if (history_count <= history_file_size + history_file_size / 4) return;
+    uint32_t first = history_count - history_file_size;
+    size_t base = history[first].offset;
+    memmove(history, history + first, history_file_size * sizeof(HistoryEntry));
+    history_count = history_file_size;
+    history_dropped += first;
+    if (!history_map_len) {
+        memmove(history_text, history_text + base, history_text_len - base);
+        history_text_len -= base;
+        for (uint32_t i = 0; i < history_count; i++) history[i].offset -= base;
+    }
+    reset_index();
+}
+
+// Whether the history path now names another file than the one open
+int history_file_replaced() {
+    struct stat st, named;
+    if (fstat(history_fd, &st) < 0 || stat(history_path, &named) < 0) return 0;
+    return named.st_ino != st.st_ino || named.st_dev != st.st_dev;
+}
+
+// Switch to the file now at the history path if it was replaced; the log
+// is rebuilt from the new file
+void follow_history_file() {
+    if (!history_file_replaced()) return;
+    int fd = open(history_path, O_RDWR | O_APPEND | O_CLOEXEC);
+    if (fd < 0) return;
+    close(history_fd);
+    history_fd = fd;
+    reset_history();
+}
+
+// Map what the history file has grown to, this shell's and other shells'
+// lines alike, and add its complete lines to the log. A file cut short no
+// longer matches the entries, and reading past its end would fault, so the
+// log is then rebuilt from the start. The new lines are found with pread
+// rather than through the mapping: the file can still shrink while they
+// are scanned, and pread then comes back short where the mapping would
+// fault.
+void load_history_file() {
+    struct stat st;
+    if (fstat(history_fd, &st) < 0) return;
+    if ((size_t)st.st_size < history_text_len) reset_history();
+    if ((size_t)st.st_size <= history_map_len) return;
+    char *map = history_map_len ? mremap(history_text, history_map_len, st.st_size, MREMAP_MAYMOVE)
+                                : mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, history_fd, 0);
+    if (map == MAP_FAILED) return;
+    history_text = map;
+    history_map_len = st.st_size;
+
+    // A line another shell is still writing has no newline yet
+    char buffer[HISTORY_READ_SIZE];
+    size_t offset = history_text_len, line = history_text_len;
+    int full = 0;
+    while (!full && offset < history_map_len) {
+        size_t want = history_map_len - offset < sizeof(buffer) ? history_map_len - offset : sizeof(buffer);
+        ssize_t n = pread(history_fd, buffer, want, offset);
+        if (n <= 0) break;
+        char *p = buffer, *newline;
+        while ((newline = memchr(p, '\n', buffer + n - p))) {
+            size_t end = offset + (newline - buffer);
+            if (end > line && append_entry(line, end - line) < 0) {
+                full = 1;
+                break;
+            }
+            line = end + 1;
+            p = newline + 1;
+        }
+        offset += n;
+    }
+    history_text_len = line;
+    trim_history();
+}
+
+// Bring the log up to date with the history file before reading it
+void refresh_history() {
+    if (history_fd < 0) return;
+    follow_history_file();
+    load_history_file();
+}
+
+// A SIGBUS outside a guarded reader is a real fault and kills the shell
+void history_fault_handler(int sig) {
+    if (history_guarded) siglongjmp(history_fault, 1);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+// The file shrank under a guarded reader: rebuild the log from what is left
+void history_faulted(const char *who) {
+    history_guarded = 0;
+    reset_history();
+    load_history_file();
+    fprintf(stderr, "%s: history file changed while reading it\n", who);
+}
+
+// HISTSIZE sets how many entries history lists; HISTFILE (default
+// ~/.cshell_history, empty for none) keeps them across shells, and
+// HISTFILESIZE how many lines it is cut back to (default MAX_HISTORY_FILE,
+// never fewer than HISTSIZE)
+void init_history() {
+    const char *size = getenv("HISTSIZE");
+    if (size && atoi(size) > 0) history_size = atoi(size);
+    const char *file_size = getenv("HISTFILESIZE");
+    if (file_size && atoi(file_size) > 0) history_file_size = atoi(file_size);
+    if (history_file_size < history_size) history_file_size = history_size;
+
+    char path[MAX_INPUT_LENGTH];
+    const char *file = getenv("HISTFILE");
+    if (!file) {
+        const char *home = getenv("HOME");
+        if (!home) return;
+        snprintf(path, sizeof(path), "%s/.cshell_history", home);
+        file = path;
+    }
+    if (*file == '\0') return;
+    history_fd = open(file, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (history_fd >= 0 && (history_path = strdup(file)) == NULL) {
+        close(history_fd);
+        history_fd = -1;
+    }
+    if (history_fd < 0) return;
+    struct sigaction sa;
+    sa.sa_handler = history_fault_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGBUS, &sa, NULL);
+    load_history_file();
+}
+
+// Lock the history file. Another shell may have replaced it while this one
+// waited for the lock, and what is written then goes to the new file.
+void lock_history_file() {
+    for (int tries = 0;; tries++) {
+        follow_history_file();
+        flock(history_fd, LOCK_EX);
+        if (tries == 3 || !history_file_replaced()) return;
+        flock(history_fd, LOCK_UN);
+    }
+}
+
+// With the file locked and loaded, replace it by a copy of its newest
+// history_file_size lines once it holds a quarter more. The copy is renamed
+// over it, so other shells see a new file and reload; their mappings of
+// the old one stay valid.
+void compact_history_file() {
+    uint64_t lines = (uint64_t)history_count + history_dropped;
+    if (lines <= history_file_size + history_file_size / 4 || history_count < history_file_size) return;
+    char temp[MAX_INPUT_LENGTH + 16];
+    if (snprintf(temp, sizeof(temp), "%s.XXXXXX", history_path) >= (int)sizeof(temp)) return;
+    int fd = mkstemp(temp);
+    if (fd < 0) return;
+
+    char buffer[HISTORY_READ_SIZE];
+    size_t offset = history[history_count - history_file_size].offset;
+    int ok = 1;
+    while (ok && offset < history_text_len) {
+        size_t want = history_text_len - offset < sizeof(buffer) ? history_text_len - offset : sizeof(buffer);
+        ssize_t n = pread(history_fd, buffer, want, offset);
+        ok = n > 0 && write(fd, buffer, n) == n;
+        offset += n > 0 ? n : 0;
+    }
+    if (close(fd) < 0 || !ok || rename(temp, history_path) < 0) {
+        unlink(temp);
+        return;
+    }
+    follow_history_file();
+    load_history_file();
+}
+
+// Lines go to the file in one locked append, so concurrent shells never
+// interleave them
+void add_to_history(const char *cmd) {
+    if (cmd[0] == '\0') return;
+    size_t len = strlen(cmd);
+    if (history_fd >= 0) {
+        char line[MAX_INPUT_LENGTH + 1];
+        memcpy(line, cmd, len);
+        line[len] = '\n';
+        lock_history_file();
+        ssize_t written = write(history_fd, line, len + 1);
+        if (written == (ssize_t)len + 1) {
+            load_history_file();
+            compact_history_file();
+            flock(history_fd, LOCK_UN);
+            return;
+        }
+        flock(history_fd, LOCK_UN);
+        // Keep going in memory if the file cannot take it
+        close(history_fd);
+        history_fd = -1;
+        if (history_map_len) {
+            char *copy = malloc(history_text_len);
+            if (copy) memcpy(copy, history_text, history_text_len);
+            munmap(history_text, history_map_len);
+            history_text = copy;
+            history_map_len = 0;
+            if (!copy) history_count = history_text_len = 0;
+        }
+    }
+
+    char *text = realloc(history_text, history_text_len + len + 1);
+    if (!text) return;
+    history_text = text;
+    memcpy(history_text + history_text_len, cmd, len);
+    history_text[history_text_len + len] = '\n';
+    if (append_entry(history_text_len, len) == 0) history_text_len += len + 1;
+    trim_history();
+}
+
+const char *history_line(uint32_t entry) {
+    return history_text + history[entry].offset;
+}
+
+// The line is copied out of the mapping before printing, so a fault never
+// leaves stdout locked in the middle of printf
+void print_entry(uint32_t entry) {
+    uint32_t len = history[entry].len;
+    if (len >= entry_copy_size) {
+        char *copy = realloc(entry_copy, len + 1);
+        if (!copy) return;
+        entry_copy = copy;
+        entry_copy_size = len + 1;
+    }
+    memcpy(entry_copy, history_line(entry), len);
+    printf("%u: %.*s\n", entry + 1, (int)len, entry_copy);
+}
+
+void print_history() {
+    uint32_t first = history_count > history_size ? history_count - history_size : 0;
+    for (uint32_t i = first; i < history_count; i++) print_entry(i);
+}
+
+uint32_t trigram_bucket(const char *p) {
+    uint32_t h = ((uint8_t)p[0] << 16 | (uint8_t)p[1] << 8 | (uint8_t)p[2]) * 2654435761u;
+    return h >> 16;
+}
+
+// Bring the trigram index up to date with the log, building it on first use
+int index_history() {
+    if (!trigram_index) {
+        trigram_index = calloc(TRIGRAM_BUCKETS, sizeof(Posting));
+        if (!trigram_index) return -1;
+    }
+    for (; indexed_count < history_count; indexed_count++) {
+        const char *line = history_line(indexed_count);
+        for (uint32_t k = 0; k + 3 <= history[indexed_count].len; k++) {
+            Posting *posting = &trigram_index[trigram_bucket(line + k)];
+            if (posting->count && posting->entries[posting->count - 1] == indexed_count) continue;
+            if (posting->count == posting->capacity) {
+                uint32_t capacity = posting->capacity ? posting->capacity * 2 : 4;
+                uint32_t *entries = realloc(posting->entries, capacity * sizeof(uint32_t));
+                if (!entries) return -1;
+                posting->entries = entries;
+                posting->capacity = capacity;
+            }
+            posting->entries[posting->count++] = indexed_count;
+        }
+    }
+    return 0;
+}
+
+int entry_matches(uint32_t entry, const char *text, size_t len, int prefix) {
+    if (history[entry].len < len) return 0;
+    if (prefix) return memcmp(history_line(entry), text, len) == 0;
+    return memmem(history_line(entry), history[entry].len, text, len) != NULL;
+}
+
+// Newest entry before entry number before that starts with (prefix) or
+// contains text, or -1. Only entries listed under the text's rarest
+// trigram are looked at; text shorter than a trigram is searched for in
+// every entry.
+long find_history(const char *text, uint32_t before, int prefix) {
+    size_t len = strlen(text);
+    if (len < 3 || index_history() < 0) {
+        while (before-- > 0) {
+            if (entry_matches(before, text, len, prefix)) return before;
+        }
+        return -1;
+    }
+
+    Posting *rarest = &trigram_index[trigram_bucket(text)];
+    for (size_t k = 1; k + 3 <= len; k++) {
+        Posting *posting = &trigram_index[trigram_bucket(text + k)];
+        if (posting->count < rarest->count) rarest = posting;
+    }
+    uint32_t low = 0, high = rarest->count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (rarest->entries[mid] < before) low = mid + 1;
+        else high = mid;
+    }
+    while (low-- > 0) {
+        if (entry_matches(rarest->entries[low], text, len, prefix)) return rarest->entries[low];
+    }
+    return -1;
+}
+
+// history: the newest HISTSIZE entries; history -s TEXT: every entry
+// containing TEXT, oldest first
+int list_history(char **args) {
+    if (!args[1]) {
+        print_history();
+        return 0;
+    }
+    if (strcmp(args[1], "-s") != 0 || !args[2]) {
+        fprintf(stderr, "history: usage: history [-s TEXT]\n");
+        return 1;
+    }
+    // The words after -s, as one text
+    char arg[MAX_INPUT_LENGTH] = "";
+    for (int i = 2; args[i]; i++) {
+        if (i > 2) strncat(arg, " ", sizeof(arg) - strlen(arg) - 1);
+        strncat(arg, args[i], sizeof(arg) - strlen(arg) - 1);
+    }
+
+    // Matches are kept in a buffer reused across calls, which a fault
+    // cannot leak
+    uint32_t count = 0;
+    for (long entry = find_history(arg, history_count, 0); entry >= 0; entry = find_history(arg, entry, 0)) {
+        if (count == history_match_capacity) {
+            uint32_t capacity = history_match_capacity ? history_match_capacity * 2 : 64;
+            uint32_t *grown = realloc(history_matches, capacity * sizeof(uint32_t));
+            if (!grown) break;
+            history_matches = grown;
+            history_match_capacity = capacity;
+        }
+        history_matches[count++] = entry;
+    }
+    while (count-- > 0) print_entry(history_matches[count]);
+    return 0;
+}
+
+int history_builtin(char **args) {
+    refresh_history();
+    if (sigsetjmp(history_fault, 1)) {
+        history_faulted("history");
+        return 1;
+    }
+    history_guarded = 1;
+    int status = list_history(args);
+    history_guarded = 0;
+    return status;
+}
+
+// Replace a line starting with !! (the last entry), !N (entry N) or
+// !PREFIX (the newest entry starting with PREFIX) by that entry followed
+// by the rest of the line
+int expand_entry(char *input) {
+    char *word = input + 1;
+    size_t word_len = strcspn(word, " \t");
+    char *rest = word + word_len;
+    char prefix[MAX_INPUT_LENGTH];
+    memcpy(prefix, word, word_len);
+    prefix[word_len] = '\0';
+
+    long entry = -1;
+    char *end;
+    if (strcmp(prefix, "!") == 0) {
+        entry = (long)history_count - 1;
+    } else if (word_len > 0 && strtoul(prefix, &end, 10) > 0 && *end == '\0') {
+        unsigned long n = strtoul(prefix, NULL, 10);
+        if (n <= history_count) entry = n - 1;
+    } else if (word_len > 0) {
+        entry = find_history(prefix, history_count, 1);
+    }
+    if (entry < 0) {
+        fprintf(stderr, "!%s: event not found\n", prefix);
+        return -1;
+    }
+
+    char expanded[MAX_INPUT_LENGTH];
+    int len = snprintf(expanded, sizeof(expanded), "%.*s%s", (int)history[entry].len, history_line(entry), rest);
+    if (len >= MAX_INPUT_LENGTH) {
+        fprintf(stderr, "!%s: expanded line too long\n", prefix);
+        return -1;
+    }
+    memcpy(input, expanded, len + 1);
+    printf("%s\n", input);
+    fflush(stdout);
+    return 0;
+}
+
+int expand_history(char *input) {
+    // The line is not logged yet, so bring the log up to date with the file
+    refresh_history();
+    if (sigsetjmp(history_fault, 1)) {
+        history_faulted("!");
+        return -1;
+    }
+    history_guarded = 1;
+    int status = expand_entry(input);
+    history_guarded = 0;
+    return status;
+}
+
+unsigned int fnv_hash(const char *s) {
+    unsigned int h = 2166136261u;
+    while (*s) h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+unsigned int hash_name(const char *name) {
+    return fnv_hash(name) % HASH_BUCKETS;
+}
+
+void reset_command_hash() {
+    for (int i = 0; i < HASH_BUCKETS; i++) {
+        while (command_hash[i]) {
+            HashEntry *entry = command_hash[i];
+            command_hash[i] = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+        }
+    }
+}
+
+// Forget the table when PATH is not the one it was filled under. Without
+// PATH the system default is searched, as execvp does.
+void check_path_env() {
+    static char default_path[256];
+    const char *path_env = getenv("PATH");
+    if (!path_env) {
+        if (!default_path[0] && (confstr(_CS_PATH, default_path, sizeof(default_path)) == 0 ||
+                                 confstr(_CS_PATH, NULL, 0) > sizeof(default_path))) {
+            snprintf(default_path, sizeof(default_path), "/bin:/usr/bin");
+        }
+        path_env = default_path;
+    }
+    if (hashed_path_env && strcmp(hashed_path_env, path_env) == 0) return;
+    reset_command_hash();
+    free(hashed_path_env);
+    hashed_path_env = strdup(path_env);
+}
+
+// Search PATH the way execvp would, with one stat per directory
+char *find_in_path(const char *name) {
+    const char *dir = hashed_path_env;
+    char path[MAX_INPUT_LENGTH];
+    while (dir) {
+        const char *end = strchr(dir, ':');
+        int len = end ? (int)(end - dir) : (int)strlen(dir);
+        // An empty entry is the current directory
+        if (len == 0) snprintf(path, sizeof(path), "%s", name);
+        else snprintf(path, sizeof(path), "%.*s/%s", len, dir, name);
+
+        struct stat st;
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0) return strdup(path);
+        dir = end ? end + 1 : NULL;
+    }
+    return NULL;
+}
+
+HashEntry *find_hashed(const char *name) {
+    for (HashEntry *entry = command_hash[hash_name(name)]; entry; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0) return entry;
+    }
+    return NULL;
+}
+
+// Look a command up, searching PATH only on the first use
+HashEntry *hash_command(const char *name) {
+    check_path_env();
+    HashEntry *entry = find_hashed(name);
+    if (entry) return entry;
+
+    char *path = find_in_path(name);
+    if (!path) return NULL;
+    entry = malloc(sizeof(HashEntry));
+    if (!entry) {
+        free(path);
+        return NULL;
+    }
+    entry->name = strdup(name);
+    entry->path = path;
+    entry->hits = 0;
+    unsigned int bucket = hash_name(name);
+    entry->next = command_hash[bucket];
+    command_hash[bucket] = entry;
+    return entry;
+}
+
+void forget_command(const char *name) {
+    for (HashEntry **link = &command_hash[hash_name(name)]; *link; link = &(*link)->next) {
+        if (strcmp((*link)->name, name) == 0) {
+            HashEntry *entry = *link;
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            return;
+        }
+    }
+}
+
+// hash: list the table; hash -r: empty it; hash NAME...: add commands to it
+int hash_builtin(char **args) {
+    check_path_env();
+    if (!args[1]) {
+        int empty = 1;
+        for (int i = 0; i < HASH_BUCKETS; i++) {
+            for (HashEntry *entry = command_hash[i]; entry; entry = entry->next) {
+                if (empty) printf("hits\tcommand\n");
+                printf("%4d\t%s\n", entry->hits, entry->path);
+                empty = 0;
+            }
+        }
+        if (empty) printf("hash: hash table empty\n");
+        return 0;
+    }
+
+    int status = 0;
+    for (int i = 1; args[i]; i++) {
+        if (strcmp(args[i], "-r") == 0) {
+            reset_command_hash();
+        } else if (strchr(args[i], '/') || !hash_command(args[i])) {
+            fprintf(stderr, "hash: %s: not found\n", args[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+void *arena_alloc(Arena *arena, size_t len) {
+    len = (len + 15) & ~(size_t)15;
+    ArenaBlock *block = arena->blocks;
+    if (!block || block->used + len > block->size) {
+        size_t size = len > ARENA_BLOCK_SIZE ? len : ARENA_BLOCK_SIZE;
+        block = malloc(ARENA_HEADER + size);
+        if (!block) {
+            perror("malloc");
+            return NULL;
+        }
+        block->next = arena->blocks;
+        block->used = 0;
+        block->size = size;
+        arena->blocks = block;
+    }
+    void *p = (char *)block + ARENA_HEADER + block->used;
+    block->used += len;
+    return p;
+}
+
+char *arena_strndup(Arena *arena, const char *s, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+    if (!copy) return NULL;
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+void arena_free(Arena *arena) {
+    while (arena->blocks) {
+        ArenaBlock *block = arena->blocks;
+        arena->blocks = block->next;
+        free(block);
+    }
+}
+
+// Split a line into words and operators in one pass. Quotes and
+// backslashes are resolved here, so an operator character inside a
+// quoted word is just text.
+int lex_line(const char *line, Arena *arena, Token *tokens, int max_tokens) {
+    int count = 0;
+    const char *p = line;
+    while (count < max_tokens - 1) {
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '\0') break;
+
+        Token *token = &tokens[count++];
+        token->text = NULL;
+        if (*p == ';') {
+            token->type = TOKEN_SEMI;
+            p++;
+        } else if (p[0] == '&' && p[1] == '&') {
+            token->type = TOKEN_AND;
+            p += 2;
+        } else if (*p == '&') {
+            fprintf(stderr, "Syntax error: unexpected &\n");
+            return -1;
+        } else if (*p == '|') {
+            token->type = TOKEN_PIPE;
+            p++;
+        } else if (*p == '<') {
+            token->type = TOKEN_IN;
+            p++;
+        } else if (p[0] == '>' && p[1] == '>') {
+            token->type = TOKEN_APPEND;
+            p += 2;
+        } else if (*p == '>') {
+            token->type = TOKEN_OUT;
+            p++;
+        } else {
+            char word[MAX_INPUT_LENGTH];
+            size_t len = 0;
+            while (*p && !strchr(" \t;&|<>", *p)) {
+                if (*p == '\'' || *p == '"') {
+                    char quote = *p++;
+                    while (*p && *p != quote) {
+                        if (quote == '"' && *p == '\\' && p[1] && strchr("\"\\$`", p[1])) p++;
+                        word[len++] = *p++;
+                    }
+                    if (*p != quote) {
+                        fprintf(stderr, "Syntax error: unterminated %c\n", quote);
+                        return -1;
+                    }
+                    p++;
+                } else if (*p == '\\' && p[1]) {
+                    word[len++] = p[1];
+                    p += 2;
+                } else {
+                    word[len++] = *p++;
+                }
+            }
+            token->type = TOKEN_WORD;
+            token->text = arena_strndup(arena, word, len);
+            if (!token->text) return -1;
+        }
+    }
+    tokens[count].type = TOKEN_END;
+    return count;
+}
+
+const char *token_name(TokenType type) {
+    switch (type) {
+    case TOKEN_IN: return "<";
+    case TOKEN_OUT: return ">";
+    case TOKEN_APPEND: return ">>";
+    case TOKEN_PIPE: return "|";
+    case TOKEN_AND: return "&&";
+    case TOKEN_SEMI: return ";";
+    default: return "end of line";
+    }
+}
+
+// One pipeline stage: its words and redirections up to the next operator
+int parse_command(Token **pos, Arena *arena, Command *cmd) {
+    int words = 0;
+    for (Token *t = *pos; t->type <= TOKEN_APPEND; t++) words++;
+    cmd->args = arena_alloc(arena, (words + 1) * sizeof(char *));
+    if (!cmd->args) return -1;
+    cmd->input_file = NULL;
+    cmd->output_file = NULL;
+    cmd->append = 0;
+
+    int count = 0;
+    Token *t = *pos;
+    while (t->type <= TOKEN_APPEND) {
+        if (t->type == TOKEN_WORD) {
+            cmd->args[count++] = t->text;
+            t++;
+            continue;
+        }
+        if (t[1].type != TOKEN_WORD) {
+            fprintf(stderr, "Syntax error: expected %s file after %s\n", t->type == TOKEN_IN ? "input" : "output",
+                    token_name(t->type));
+            return -1;
+        }
+        if (t->type == TOKEN_IN) {
+            cmd->input_file = t[1].text;
+        } else {
+            cmd->output_file = t[1].text;
+            cmd->append = t->type == TOKEN_APPEND;
+        }
+        t += 2;
+    }
+    cmd->args[count] = NULL;
+    if (count == 0) {
+        fprintf(stderr, "Syntax error: missing command before %s\n", token_name(t->type));
+        return -1;
+    }
+    *pos = t;
+    return 0;
+}
+
+// Stages joined by |
+int parse_pipeline(Token **pos, Arena *arena, Pipeline *pipeline) {
+    pipeline->count = 1;
+    for (Token *t = *pos; t->type <= TOKEN_PIPE; t++) {
+        if (t->type == TOKEN_PIPE) pipeline->count++;
+    }
+    pipeline->stages = arena_alloc(arena, pipeline->count * sizeof(Command));
+    if (!pipeline->stages) return -1;
+    for (int i = 0; i < pipeline->count; i++) {
+        if (i > 0) (*pos)++;
+        if (parse_command(pos, arena, &pipeline->stages[i]) < 0) return -1;
+    }
+    return 0;
+}
+
+// Pipelines joined by &&
+int parse_and_list(Token **pos, Arena *arena, AndList *list) {
+    list->count = 1;
+    for (Token *t = *pos; t->type <= TOKEN_AND; t++) {
+        if (t->type == TOKEN_AND) list->count++;
+    }
+    list->pipelines = arena_alloc(arena, list->count * sizeof(Pipeline));
+    if (!list->pipelines) return -1;
+    for (int i = 0; i < list->count; i++) {
+        if (i > 0) (*pos)++;
+        if (parse_pipeline(pos, arena, &list->pipelines[i]) < 0) return -1;
+    }
+    return 0;
+}
+
+// Lists separated by ;, empty ones dropped
+Plan *parse_line(const char *line, Arena *arena) {
+    Token tokens[MAX_INPUT_LENGTH];
+    if (lex_line(line, arena, tokens, MAX_INPUT_LENGTH) < 0) return NULL;
+
+    Plan *plan = arena_alloc(arena, sizeof(Plan));
+    if (!plan) return NULL;
+    int lists = 1;
+    for (Token *t = tokens; t->type != TOKEN_END; t++) {
+        if (t->type == TOKEN_SEMI) lists++;
+    }
+    plan->lists = arena_alloc(arena, lists * sizeof(AndList));
+    if (!plan->lists) return NULL;
+    plan->count = 0;
+
+    Token *pos = tokens;
+    while (pos->type != TOKEN_END) {
+        if (pos->type == TOKEN_SEMI) {
+            pos++;
+            continue;
+        }
+        if (parse_and_list(&pos, arena, &plan->lists[plan->count++]) < 0) return NULL;
+    }
+    return plan;
+}
+
+// The plan of a line, parsed once and kept while the line keeps coming back
+Plan *get_plan(const char *line) {
+    CachedPlan *slot = &plan_cache[fnv_hash(line) % PLAN_CACHE_SIZE];
+    if (slot->line && strcmp(slot->line, line) == 0) return slot->plan;
+
+    arena_free(&slot->arena);
+    slot->line = NULL;
+    slot->plan = parse_line(line, &slot->arena);
+    if (slot->plan) slot->line = arena_strndup(&slot->arena, line, strlen(line));
+    if (!slot->line) {
+        arena_free(&slot->arena);
+        return NULL;
+    }
+    return slot->plan;
+}
+
+int open_redirections(Command *cmd, int *in_fd, int *out_fd) {
+    *in_fd = -1;
+    *out_fd = -1;
+    if (cmd->input_file) {
+        *in_fd = open(cmd->input_file, O_RDONLY | O_CLOEXEC);
+        if (*in_fd < 0) {
+            perror("open input file");
+            return -1;
+        }
+    }
+
+    if (cmd->output_file) {
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (cmd->append ? O_APPEND : O_TRUNC);
+        *out_fd = open(cmd->output_file, flags, 0644);
+        if (*out_fd < 0) {
+            perror("open output file");
+            if (*in_fd >= 0) close(*in_fd);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void close_fd(int fd) {
+    if (fd >= 0) close(fd);
+}
+
+// Run an executable file that is not a binary and has no #! line with
+// /bin/sh, as execvp does: /bin/sh PATH ARGS...
+int spawn_script(const char *path, char **args, posix_spawn_file_actions_t *actions, posix_spawnattr_t *attr,
+                 pid_t *pid) {
+    int count = 0;
+    while (args[count]) count++;
+    char *sh_args[count + 2];
+    sh_args[0] = "/bin/sh";
+    sh_args[1] = (char *)path;
+    for (int i = 1; i <= count; i++) sh_args[i + 1] = args[i];
+    return posix_spawn(pid, "/bin/sh", actions, attr, sh_args, environ);
+}
+
+// Launch a command without copying the shell: posix_spawn runs the child on
+// the shell's memory until it execs. in_fd and out_fd become its stdin and
+// stdout and SIGINT and SIGPIPE, ignored by the shell, go back to their
+// defaults.
+// Commands without a slash run from their hashed path; a hashed path that
+// has gone away is searched for once more.
+int spawn_command(char **args, int in_fd, int out_fd, pid_t *pid) {
+    HashEntry *entry = NULL;
+    if (!strchr(args[0], '/')) {
+        entry = hash_command(args[0]);
+        if (!entry) {
+            fprintf(stderr, "%s: command not found\n", args[0]);
+            return -1;
+        }
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (in_fd >= 0 && in_fd != STDIN_FILENO) posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    if (out_fd >= 0 && out_fd != STDOUT_FILENO) posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+
+    posix_spawnattr_t attr;
+    sigset_t defaults;
+    posix_spawnattr_init(&attr);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+    int err = posix_spawn(pid, entry ? entry->path : args[0], &actions, &attr, args, environ);
+    if (err == ENOENT && entry) {
+        forget_command(args[0]);
+        entry = hash_command(args[0]);
+        if (entry) err = posix_spawn(pid, entry->path, &actions, &attr, args, environ);
+    }
+    if (err == ENOEXEC) err = spawn_script(entry ? entry->path : args[0], args, &actions, &attr, pid);
+    if (err == 0 && entry) entry->hits++;
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0) {
+        errno = err;
+        perror(args[0]);
+        return -1;
+    }
+    return 0;
+}
+
+int exit_builtin(char **args) {
+    exit(args[1] ? atoi(args[1]) : 0);
+}
+
+int cd_builtin(char **args) {
+    const char *dir = args[1] ? args[1] : getenv("HOME");
+    if (!dir || chdir(dir) == -1) {
+        perror("cd");
+        return 1;
+    }
+    return 0;
+}
+
+int true_builtin(char **args) {
+    (void)args;
+    return 0;
+}
+
+int false_builtin(char **args) {
+    (void)args;
+    return 1;
+}
+
+int echo_builtin(char **args) {
+    int i = 1, newline = 1;
+    if (args[1] && strcmp(args[1], "-n") == 0) {
+        newline = 0;
+        i++;
+    }
+    for (int first = i; args[i]; i++) {
+        if (i > first) putchar(' ');
+        fputs(args[i], stdout);
+    }
+    if (newline) putchar('\n');
+    return 0;
+}
+
+int pwd_builtin(char **args) {
+    (void)args;
+    char dir[4096];
+    if (!getcwd(dir, sizeof(dir))) {
+        perror("pwd");
+        return 1;
+    }
+    printf("%s\n", dir);
+    return 0;
+}
+
+// Print a backslash escape of a printf format; returns the characters used
+int print_escape(const char *p) {
+    switch (p[1]) {
+    case 'n': putchar('\n'); return 2;
+    case 't': putchar('\t'); return 2;
+    case 'r': putchar('\r'); return 2;
+    case 'a': putchar('\a'); return 2;
+    case '\\': putchar('\\'); return 2;
+    case '\0': putchar('\\'); return 1;
+    default: putchar('\\'); putchar(p[1]); return 2;
+    }
+}
+
+// printf FORMAT [ARG]...: %s %c %d %i %u %x %X %o and %% with flags, width
+// and precision; the format is reused while arguments are left
+int printf_builtin(char **args) {
+    if (!args[1]) {
+        fprintf(stderr, "printf: usage: printf FORMAT [ARG]...\n");
+        return 1;
+    }
+    const char *format = args[1];
+    char **arg = args + 2;
+    int status = 0;
+    do {
+        char **first = arg;
+        for (const char *p = format; *p;) {
+            if (*p == '\\') {
+                p += print_escape(p);
+                continue;
+            }
+            if (*p != '%') {
+                putchar(*p++);
+                continue;
+            }
+            if (p[1] == '%') {
+                putchar('%');
+                p += 2;
+                continue;
+            }
+
+            // Copy the conversion spec so printf can do the formatting
+            char spec[32];
+            size_t len = strspn(p + 1, "-+ #0123456789.") + 1;
+            if (len > sizeof(spec) - 4 || !p[len] || !strchr("scdiuxXo", p[len])) {
+                fprintf(stderr, "printf: invalid format %s\n", p);
+                return 1;
+            }
+            char conversion = p[len];
+            memcpy(spec, p, len);
+            const char *value = *arg ? *arg++ : "";
+            if (conversion == 's') {
+                snprintf(spec + len, sizeof(spec) - len, "s");
+                printf(spec, value);
+            } else if (conversion == 'c') {
+                snprintf(spec + len, sizeof(spec) - len, "c");
+                printf(spec, *value);
+            } else {
+                char *end;
+                errno = 0;
+                long long number = strtoll(value, &end, 0);
+                if (*end != '\0' || errno) {
+                    fprintf(stderr, "printf: %s: invalid number\n", value);
+                    status = 1;
+                }
+                snprintf(spec + len, sizeof(spec) - len, "ll%c", conversion);
+                printf(spec, number);
+            }
+            p += len + 1;
+        }
+        if (arg == first) break;
+    } while (*arg);
+    return status;
+}
+
+// test and [: one-argument, unary file and string tests, and binary string
+// and integer comparisons, each optionally negated with !
+int test_builtin(char **args) {
+    int argc = 0;
+    while (args[argc]) argc++;
+    if (strcmp(args[0], "[") == 0) {
+        if (strcmp(args[argc - 1], "]") != 0) {
+            fprintf(stderr, "[: missing ]\n");
+            return 2;
+        }
+        argc--;
+    }
+
+    char **a = args + 1;
+    int n = argc - 1, negate = 0;
+    if (n > 1 && strcmp(a[0], "!") == 0) {
+        negate = 1;
+        a++;
+        n--;
+    }
+
+    int result;
+    struct stat st;
+    if (n == 0) {
+        result = 0;
+    } else if (n == 1) {
+        result = a[0][0] != '\0';
+    } else if (n == 2 && a[0][0] == '-' && a[0][1] && !a[0][2]) {
+        switch (a[0][1]) {
+        case 'n': result = a[1][0] != '\0'; break;
+        case 'z': result = a[1][0] == '\0'; break;
+        case 'e': result = stat(a[1], &st) == 0; break;
+        case 'f': result = stat(a[1], &st) == 0 && S_ISREG(st.st_mode); break;
+        case 'd': result = stat(a[1], &st) == 0 && S_ISDIR(st.st_mode); break;
+        case 's': result = stat(a[1], &st) == 0 && st.st_size > 0; break;
+        case 'r': result = access(a[1], R_OK) == 0; break;
+        case 'w': result = access(a[1], W_OK) == 0; break;
+        case 'x': result = access(a[1], X_OK) == 0; break;
+        default:
+            fprintf(stderr, "test: %s: unknown operator\n", a[0]);
+            return 2;
+        }
+    } else if (n == 3 && (strcmp(a[1], "=") == 0 || strcmp(a[1], "!=") == 0)) {
+        result = (strcmp(a[0], a[2]) == 0) == (a[1][0] == '=');
+    } else if (n == 3 && a[1][0] == '-') {
+        char *end_left, *end_right;
+        long long left = strtoll(a[0], &end_left, 10), right = strtoll(a[2], &end_right, 10);
+        if (!a[0][0] || !a[2][0] || *end_left || *end_right) {
+            fprintf(stderr, "test: integer expression expected\n");
+            return 2;
+        }
+        const char *op = a[1] + 1;
+        if (strcmp(op, "eq") == 0) result = left == right;
+        else if (strcmp(op, "ne") == 0) result = left != right;
+        else if (strcmp(op, "lt") == 0) result = left < right;
+        else if (strcmp(op, "le") == 0) result = left <= right;
+        else if (strcmp(op, "gt") == 0) result = left > right;
+        else if (strcmp(op, "ge") == 0) result = left >= right;
+        else {
+            fprintf(stderr, "test: %s: unknown operator\n", a[1]);
+            return 2;
+        }
+    } else {
+        fprintf(stderr, "test: too many arguments\n");
+        return 2;
+    }
+    return result != negate ? 0 : 1;
+}
+
+// export NAME=VALUE...; without arguments, list the environment
+int export_builtin(char **args) {
+    if (!args[1]) {
+        for (char **env = environ; *env; env++) {
+            const char *eq = strchr(*env, '=');
+            if (eq) printf("export %.*s=\"%s\"\n", (int)(eq - *env), *env, eq + 1);
+        }
+        return 0;
+    }
+
+    int status = 0;
+    for (int i = 1; args[i]; i++) {
+        char *eq = strchr(args[i], '=');
+        // Without a value there is no shell variable to export
+        if (!eq) continue;
+        *eq = '\0';
+        if (eq == args[i] || setenv(args[i], eq + 1, 1) < 0) {
+            fprintf(stderr, "export: %s: not a valid identifier\n", args[i]);
+            status = 1;
+        }
+        *eq = '=';
+    }
+    return status;
+}
+
+// changes_shell marks builtins that act on the shell itself: its
+// directory, environment, command hash or life
+typedef struct {
+    const char *name;
+    int (*run)(char **args);
+    int changes_shell;
+} Builtin;
+
+Builtin builtins[] = {
+    { "exit", exit_builtin, 1 },
+    { "cd", cd_builtin, 1 },
+    { "history", history_builtin, 0 },
+    { "hash", hash_builtin, 1 },
+    { "echo", echo_builtin, 0 },
+    { "pwd", pwd_builtin, 0 },
+    { "true", true_builtin, 0 },
+    { "false", false_builtin, 0 },
+    { "test", test_builtin, 0 },
+    { "[", test_builtin, 0 },
+    { "printf", printf_builtin, 0 },
+    { "export", export_builtin, 1 },
+};
+
+Builtin *find_builtin(const char *name) {
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (strcmp(builtins[i].name, name) == 0) return &builtins[i];
+    }
+    return NULL;
+}
+
+// Flush what a builtin wrote; output it could not write, now or while it
+// ran, fails it like any other command. A reader that went away is not
+// reported, as a command killed by SIGPIPE would not be.
+int finish_builtin_output(const char *name, int status) {
+    errno = 0;
+    if (fflush(stdout) != 0 || ferror(stdout)) {
+        if (errno != EPIPE) fprintf(stderr, "%s: write error: %s\n", name, errno ? strerror(errno) : "I/O error");
+        status = EXIT_FAILURE;
+    }
+    clearerr(stdout);
+    return status;
+}
+
+// Run a builtin in the shell with its output sent to out_fd. The shell's
+// own stdout is saved first and put back afterwards. Builtins never read
+// stdin, so only stdout is moved.
+int run_builtin(Builtin *builtin, Command *cmd, int out_fd) {
+    int saved = -1;
+    fflush(stdout);
+    if (out_fd >= 0 && out_fd != STDOUT_FILENO) {
+        saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+        if (saved < 0 || dup2(out_fd, STDOUT_FILENO) < 0) {
+            perror("dup");
+            close_fd(saved);
+            return EXIT_FAILURE;
+        }
+    }
+
+    int status = finish_builtin_output(cmd->args[0], builtin->run(cmd->args));
+    if (saved >= 0) {
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+    }
+    return status;
+}
+
+// Run a builtin in a child of its own, so that only the child's copy of
+// the shell's state changes
+int fork_builtin(Builtin *builtin, Command *cmd, int out_fd, pid_t *pid) {
+    fflush(stdout);
+    *pid = fork();
+    if (*pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (*pid == 0) {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        if (out_fd >= 0 && out_fd != STDOUT_FILENO) dup2(out_fd, STDOUT_FILENO);
+        _exit(finish_builtin_output(cmd->args[0], builtin->run(cmd->args)));
+    }
+    return 0;
+}
+
+int execute_single_command(Command *cmd) {
+    int in_fd, out_fd;
+    if (open_redirections(cmd, &in_fd, &out_fd) < 0) return EXIT_FAILURE;
+
+    Builtin *builtin = find_builtin(cmd->args[0]);
+    if (builtin) {
+        close_fd(in_fd);
+        int status = run_builtin(builtin, cmd, out_fd);
+        close_fd(out_fd);
+        return status;
+    }
+
+    pid_t pid;
+    int spawned = spawn_command(cmd->args, in_fd, out_fd, &pid);
+    close_fd(in_fd);
+    close_fd(out_fd);
+    if (spawned < 0) return EXIT_FAILURE;
+
+    int status;
+    waitpid(pid, &status, 0);
+    return WEXITSTATUS(status);
+}
+
+// Every stage of a pipeline runs as if in a subshell: builtins that change
+// the shell (cd, export, hash, exit) only do so when they are the whole
+// pipeline. In a longer pipeline they run in a forked child, like the
+// external stages, which are all spawned first. The other builtins then
+// run in the shell, each writing into a pipe whose reader is already
+// running. Builtins read no input, so the pipe into a builtin is closed at
+// once and its writer sees EPIPE. A stage that cannot be redirected or
+// launched is skipped as if it had failed.
+int execute_pipeline(Pipeline *pipeline) {
+    int num_commands = pipeline->count;
+    int in_fds[num_commands], out_fds[num_commands], statuses[num_commands];
+    pid_t pids[num_commands];
+    Builtin *stage_builtins[num_commands];
+
+    for (int i = 0; i < num_commands; i++) {
+        in_fds[i] = out_fds[i] = pids[i] = -1;
+        statuses[i] = EXIT_FAILURE;
+        stage_builtins[i] = find_builtin(pipeline->stages[i].args[0]);
+    }
+    for (int i = 0; i < num_commands - 1; i++) {
+        int pipefd[2];
+        if (pipe2(pipefd, O_CLOEXEC) == -1) {
+            perror("pipe");
+            for (int k = 0; k < num_commands; k++) {
+                close_fd(in_fds[k]);
+                close_fd(out_fds[k]);
+            }
+            return EXIT_FAILURE;
+        }
+        out_fds[i] = pipefd[1];
+        if (stage_builtins[i + 1]) close(pipefd[0]);
+        else in_fds[i + 1] = pipefd[0];
+    }
+
+    // Redirections take precedence over the pipes
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < num_commands; i++) {
+            Command *cmd = &pipeline->stages[i];
+            Builtin *builtin = stage_builtins[i];
+            int in_shell = builtin && !builtin->changes_shell;
+            if (in_shell != pass) continue;
+            int in_fd, out_fd;
+            if (open_redirections(cmd, &in_fd, &out_fd) == 0) {
+                int stage_out = out_fd >= 0 ? out_fd : out_fds[i];
+                pid_t pid;
+                if (!builtin) {
+                    if (spawn_command(cmd->args, in_fd >= 0 ? in_fd : in_fds[i], stage_out, &pid) == 0) pids[i] = pid;
+                } else if (!in_shell) {
+                    if (fork_builtin(builtin, cmd, stage_out, &pid) == 0) pids[i] = pid;
+                } else {
+                    statuses[i] = run_builtin(stage_builtins[i], cmd, stage_out);
+                }
+                close_fd(in_fd);
+                close_fd(out_fd);
+            }
+            close_fd(in_fds[i]);
+            close_fd(out_fds[i]);
+        }
+    }
+
+    for (int i = 0; i < num_commands; i++) {
+        if (pids[i] < 0) continue;
+        int status;
+        waitpid(pids[i], &status, 0);
+        statuses[i] = WEXITSTATUS(status);
+    }
+    return statuses[num_commands - 1];
+}
+
+void execute_plan(Plan *plan) {
+    for (int i = 0; i < plan->count; i++) {
+        AndList *list = &plan->lists[i];
+        int last_status = 0;
+        for (int j = 0; j < list->count && last_status == 0; j++) {
+            Pipeline *pipeline = &list->pipelines[j];
+            if (pipeline->count == 1) last_status = execute_single_command(&pipeline->stages[0]);
+            else last_status = execute_pipeline(pipeline);
+        }
+    }
+}
+
+int main() {
+    struct sigaction sa;
+    sa.sa_handler = SIG_IGN;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGINT, &sa, NULL);
+    // Builtins writing into a closed pipe get EPIPE instead
+    sigaction(SIGPIPE, &sa, NULL);
+    init_history();
+
+    char input[MAX_INPUT_LENGTH];
+
+    while (1) {
+        printf("sh> ");
+        fflush(stdout);
+
+        if (!fgets(input, MAX_INPUT_LENGTH, stdin)) break;
+        input[strcspn(input, "\n")] = '\0';
+        if (input[0] == '!' && expand_history(input) < 0) continue;
+        add_to_history(input);
+
+        Plan *plan = get_plan(input);
+        if (plan) execute_plan(plan);
+    }
+    return 0;
+}
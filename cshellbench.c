@@ -0,0 +1,171 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define MAX_SHELLS 8
+
+// Cost of feeding one batch of command lines to a shell
+typedef struct {
+    double wall;
+    double user;
+    double sys;
+    long max_rss_kb;
+    int status;
+} RunCost;
+
+const char *command = "/bin/true";
+
+// Seconds on the monotonic clock
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Write all of a buffer to a pipe
+int write_all(int fd, const char *buffer, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buffer, len);
+        if (n <= 0) return -1;
+        buffer += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Start a shell reading lines from a pipe, with its prompts and output
+// discarded and no history file, pipe the lines in and wait for it to
+// run them all and exit
+int run_shell(const char *shell, const char *lines, size_t len, RunCost *cost) {
+    int pipefd[2];
+    memset(cost, 0, sizeof(*cost));
+    if (pipe(pipefd) < 0) {
+        perror("pipe");
+        return -1;
+    }
+    double start = now();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) {
+            dup2(null, STDOUT_FILENO);
+            close(null);
+        }
+        dup2(pipefd[0], STDIN_FILENO);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        setenv("HISTFILE", "", 1);
+        execl(shell, shell, (char *)NULL);
+        perror(shell);
+        _exit(127);
+    }
+    close(pipefd[0]);
+    int written = write_all(pipefd[1], lines, len);
+    close(pipefd[1]);
+
+    struct rusage usage;
+    int status;
+    if (wait4(pid, &status, 0, &usage) < 0) {
+        perror("wait4");
+        return -1;
+    }
+    cost->wall = now() - start;
+    cost->user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    cost->sys = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    cost->max_rss_kb = usage.ru_maxrss;
+    cost->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    if (written < 0) {
+        fprintf(stderr, "%s stopped reading its input\n", shell);
+        return -1;
+    }
+    return 0;
+}
+
+// Print usage
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n LINES] [-r RUNS] [-c COMMAND] [--shell PATH]...\n", prog);
+    fprintf(stderr, "  -n LINES    command lines piped into the shell per run (default 20000)\n");
+    fprintf(stderr, "  -r RUNS     runs per shell; the fastest is reported (default 3)\n");
+    fprintf(stderr, "  -c COMMAND  the line to repeat (default %s)\n", command);
+    fprintf(stderr, "  --shell PATH\n");
+    fprintf(stderr, "              shell binary to measure, repeat to compare builds (default ./cshell)\n");
+    fprintf(stderr, "Build: make cshell cshellbench\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *shells[MAX_SHELLS];
+    int shell_count = 0, runs = 3;
+    unsigned long lines = 20000;
+
+    for (int i = 1; i < argc; i++) {
+        char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!value) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (strcmp(argv[i], "-n") == 0) {
+            lines = strtoul(value, NULL, 0);
+        } else if (strcmp(argv[i], "-r") == 0) {
+            runs = atoi(value);
+        } else if (strcmp(argv[i], "-c") == 0) {
+            command = value;
+        } else if (strcmp(argv[i], "--shell") == 0 && shell_count < MAX_SHELLS) {
+            shells[shell_count++] = value;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+        i++;
+    }
+    if (lines == 0 || runs < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (shell_count == 0) shells[shell_count++] = "./cshell";
+
+    // The shell exits at end of input, after the last line has run
+    size_t line_len = strlen(command) + 1;
+    char *input = malloc(line_len * lines);
+    if (!input) {
+        perror("Failed to allocate input");
+        return 1;
+    }
+    for (unsigned long k = 0; k < lines; k++) {
+        memcpy(input + k * line_len, command, line_len - 1);
+        input[k * line_len + line_len - 1] = '\n';
+    }
+    // A shell that stops reading must not kill the driver
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%-24s %8s %8s %8s %8s %12s %9s %4s\n", "shell", "lines", "wall_s", "user_s", "sys_s", "commands/s",
+           "rss_kb", "exit");
+    int failed = 0;
+    for (int s = 0; s < shell_count; s++) {
+        RunCost best, cost;
+        for (int r = 0; r < runs; r++) {
+            if (run_shell(shells[s], input, line_len * lines, &cost) < 0) {
+                failed = 1;
+                break;
+            }
+            if (r == 0 || cost.wall < best.wall) best = cost;
+        }
+        if (failed) break;
+        if (best.status != 0) failed = 1;
+        printf("%-24s %8lu %8.3f %8.3f %8.3f %12.0f %9ld %4d\n", shells[s], lines, best.wall, best.user, best.sys,
+               lines / best.wall, best.max_rss_kb, best.status);
+    }
+    free(input);
+    return failed;
+}
@@ -0,0 +1,581 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "vsfs_format.h"
+
+#define MAX_CORRUPTIONS 64
+#define S_IFREG_MODE 0100644
+#define S_IFDIR_MODE 0040755
+
+// Where a directory entry was written
+typedef struct {
+    uint32_t dir;
+    uint32_t inode;
+    uint32_t block;
+    uint32_t slot;
+} EntryRecord;
+
+// File size distributions, in data blocks per file
+typedef enum {
+    SIZES_SMALL,
+    SIZES_MIXED,
+    SIZES_LARGE
+} SizeDistribution;
+
+// Kinds of damage that can be injected into a generated image
+typedef enum {
+    CORRUPT_MAGIC,
+    CORRUPT_BITMAP,
+    CORRUPT_DUP,
+    CORRUPT_RANGE,
+    CORRUPT_INDIRECT,
+    CORRUPT_LINKS,
+    CORRUPT_ORPHAN,
+    CORRUPT_CYCLE,
+    CORRUPT_SILENT
+} CorruptionKind;
+
+// One requested corruption and how many times to inject it
+typedef struct {
+    CorruptionKind kind;
+    uint32_t count;
+} Corruption;
+
+const char *corruption_names[] = { "magic", "bitmap", "dup", "range", "indirect", "links", "orphan", "cycle", "silent" };
+
+int fd;
+Superblock superblock;
+Inode *inodes;
+uint8_t *inode_bitmap;
+uint8_t *data_bitmap;
+uint32_t next_block;
+uint32_t *pointer_blocks;
+uint32_t pointer_block_count;
+uint32_t pointer_block_capacity;
+uint64_t rng_state;
+uint32_t directory_count;
+uint32_t *parent_dir;
+uint32_t *dir_slots;
+EntryRecord *entries;
+uint32_t entry_count;
+uint32_t entry_capacity;
+
+// Next value of a xorshift64* generator, so images are reproducible per seed
+uint64_t next_random() {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+// Uniform random number in [0, n)
+uint32_t random_below(uint32_t n) {
+    return n ? (uint32_t)(next_random() % n) : 0;
+}
+
+// Function to write a block to the image
+int write_block(uint32_t block_num, void *buffer) {
+    return pwrite(fd, buffer, BLOCK_SIZE, (off_t)block_num * BLOCK_SIZE) == BLOCK_SIZE ? 0 : -1;
+}
+
+// Function to write consecutive blocks to the image
+int write_blocks(uint32_t block_num, uint32_t count, void *buffer) {
+    size_t len = (size_t)count * BLOCK_SIZE, done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(fd, (uint8_t *)buffer + done, len - done, (off_t)block_num * BLOCK_SIZE + done);
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+// Number of bitmap blocks needed to hold the given number of bits
+uint32_t bitmap_blocks_for(uint32_t bits) {
+    uint32_t blocks = (uint32_t)(((uint64_t)bits + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK);
+    return blocks ? blocks : 1;
+}
+
+// Number of blocks needed for an inode table with the given number of inodes
+uint32_t inode_table_blocks_for(uint32_t count) {
+    return (uint32_t)(((uint64_t)count + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK);
+}
+
+// Lay out bitmaps, inode table and data region back to back after the superblock
+void default_layout(Superblock *sb) {
+    sb->inode_bitmap_block = INODE_BITMAP_BLOCK;
+    sb->data_bitmap_block = sb->inode_bitmap_block + bitmap_blocks_for(sb->inode_count);
+    sb->inode_table_start = sb->data_bitmap_block + bitmap_blocks_for(sb->total_blocks);
+    sb->first_data_block = sb->inode_table_start + inode_table_blocks_for(sb->inode_count);
+}
+
+// Function to set a bit in a bitmap
+void set_bitmap_bit(uint8_t *bitmap, uint32_t bit, int value) {
+    if (value) {
+        bitmap[bit / 8] |= (1 << (bit % 8));
+    } else {
+        bitmap[bit / 8] &= ~(1 << (bit % 8));
+    }
+}
+
+// Hand out the next free data block, or 0 once the image is full
+uint32_t allocate_block() {
+    if (next_block >= superblock.total_blocks) return 0;
+    set_bitmap_bit(data_bitmap, next_block, 1);
+    return next_block++;
+}
+
+// Remember a pointer block so indirect corruptions can find one
+void note_pointer_block(uint32_t block) {
+    if (pointer_block_count == pointer_block_capacity) {
+        uint32_t capacity = pointer_block_capacity ? pointer_block_capacity * 2 : 1024;
+        uint32_t *blocks = realloc(pointer_blocks, (size_t)capacity * sizeof(uint32_t));
+        if (!blocks) return;
+        pointer_blocks = blocks;
+        pointer_block_capacity = capacity;
+    }
+    pointer_blocks[pointer_block_count++] = block;
+}
+
+// Allocate a pointer block of the given depth and the blocks under it, up to
+// *remaining data blocks. Depth 1 blocks point straight at data blocks.
+uint32_t allocate_tree(uint32_t depth, uint32_t *remaining, uint32_t *blocks_count) {
+    uint32_t block = allocate_block();
+    if (!block) return 0;
+    (*blocks_count)++;
+    note_pointer_block(block);
+
+    uint32_t pointers[POINTERS_PER_BLOCK];
+    memset(pointers, 0, sizeof(pointers));
+    for (uint32_t k = 0; k < POINTERS_PER_BLOCK && *remaining > 0; k++) {
+        if (depth == 1) {
+            pointers[k] = allocate_block();
+            if (!pointers[k]) break;
+            (*blocks_count)++;
+            (*remaining)--;
+        } else {
+            pointers[k] = allocate_tree(depth - 1, remaining, blocks_count);
+            if (!pointers[k]) break;
+        }
+    }
+    if (write_block(block, pointers) < 0) {
+        perror("Failed to write pointer block");
+        exit(1);
+    }
+    return block;
+}
+
+// Draw a file size in data blocks from the chosen distribution
+uint32_t file_size(SizeDistribution sizes) {
+    switch (sizes) {
+    case SIZES_SMALL:
+        return 1 + random_below(DIRECT_POINTERS);
+    case SIZES_MIXED:
+        // Mostly small files with the odd one reaching into double indirection
+        if (random_below(50) == 0) return DIRECT_POINTERS + POINTERS_PER_BLOCK + random_below(4 * POINTERS_PER_BLOCK);
+        return 1 + random_below(40);
+    case SIZES_LARGE:
+        return DIRECT_POINTERS + random_below(8 * POINTERS_PER_BLOCK);
+    }
+    return 1;
+}
+
+// Create one regular file of the given number of data blocks in inode i.
+// Returns 0 once the data region is exhausted.
+int create_file(uint32_t i, uint32_t blocks) {
+    Inode *inode = &inodes[i];
+    uint32_t remaining = blocks, used = 0;
+    if (next_block >= superblock.total_blocks) return 0;
+
+    for (int k = 0; k < DIRECT_POINTERS && remaining > 0; k++) {
+        if (!(inode->direct[k] = allocate_block())) break;
+        used++;
+        remaining--;
+    }
+    if (remaining > 0) inode->single_indirect = allocate_tree(1, &remaining, &used);
+    if (remaining > 0) inode->double_indirect = allocate_tree(2, &remaining, &used);
+    if (remaining > 0) inode->triple_indirect = allocate_tree(3, &remaining, &used);
+
+    inode->mode = S_IFREG_MODE;
+    inode->links_count = 1;
+    inode->blocks_count = used;
+    uint64_t size = (uint64_t)(blocks - remaining) * BLOCK_SIZE;
+    inode->size = size > UINT32_MAX ? UINT32_MAX : (uint32_t)size;
+    inode->ctime = inode->mtime = inode->atime = 1700000000;
+    set_bitmap_bit(inode_bitmap, i, 1);
+    return 1;
+}
+
+// Add an entry naming inode to a directory, growing the directory by a
+// block when its last one is full. Returns -1 once the directory has no
+// direct pointer left or the image is full.
+int add_entry(uint32_t dir, uint32_t inode, const char *name) {
+    Inode *d = &inodes[dir];
+    uint32_t slot = dir_slots[dir] % DIRENTS_PER_BLOCK;
+    uint32_t index = dir_slots[dir] / DIRENTS_PER_BLOCK;
+    if (slot == 0) {
+        if (index >= DIRECT_POINTERS || !(d->direct[index] = allocate_block())) return -1;
+        d->blocks_count++;
+        d->size += BLOCK_SIZE;
+    }
+
+    Dirent entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.inode = inode;
+    entry.name_len = snprintf(entry.name, sizeof(entry.name), "%s", name);
+    off_t offset = (off_t)d->direct[index] * BLOCK_SIZE + (off_t)slot * sizeof(Dirent);
+    if (pwrite(fd, &entry, sizeof(entry), offset) != sizeof(entry)) {
+        perror("Failed to write directory entry");
+        exit(1);
+    }
+    dir_slots[dir]++;
+
+    if (entry_count == entry_capacity) {
+        uint32_t capacity = entry_capacity ? entry_capacity * 2 : 4096;
+        EntryRecord *records = realloc(entries, (size_t)capacity * sizeof(EntryRecord));
+        if (!records) return 0;
+        entries = records;
+        entry_capacity = capacity;
+    }
+    entries[entry_count++] = (EntryRecord){ dir, inode, d->direct[index], slot };
+    return 0;
+}
+
+// Create the root and directory_count - 1 more directories in inodes
+// [0, directory_count), each under a random earlier one
+int create_directories() {
+    parent_dir = calloc(directory_count, sizeof(uint32_t));
+    dir_slots = calloc(directory_count, sizeof(uint32_t));
+    if (!parent_dir || !dir_slots) return -1;
+    for (uint32_t i = 0; i < directory_count; i++) {
+        Inode *inode = &inodes[i];
+        inode->mode = S_IFDIR_MODE;
+        inode->links_count = 1;
+        inode->ctime = inode->mtime = inode->atime = 1700000000;
+        set_bitmap_bit(inode_bitmap, i, 1);
+        if (i == ROOT_INODE) continue;
+
+        char name[16];
+        snprintf(name, sizeof(name), "d%u", i);
+        parent_dir[i] = random_below(i);
+        while (add_entry(parent_dir[i], i, name) < 0) {
+            if (parent_dir[i] == ROOT_INODE) return -1;
+            parent_dir[i] = parent_dir[parent_dir[i]];
+        }
+    }
+    return 0;
+}
+
+// Name a new file in a random directory, trying later ones when it is full
+int link_file(uint32_t i) {
+    char name[16];
+    snprintf(name, sizeof(name), "f%u", i);
+    uint32_t dir = random_below(directory_count);
+    for (uint32_t tries = 0; tries < directory_count; tries++, dir = (dir + 1) % directory_count) {
+        if (add_entry(dir, i, name) == 0) return 0;
+    }
+    return -1;
+}
+
+// Pick an inode in use, or return inode_count if there is none
+uint32_t random_used_inode() {
+    for (uint32_t tries = 0; tries < 64; tries++) {
+        uint32_t i = random_below(superblock.inode_count);
+        if (inodes[i].links_count > 0) return i;
+    }
+    for (uint32_t i = 0; i < superblock.inode_count; i++) {
+        if (inodes[i].links_count > 0) return i;
+    }
+    return superblock.inode_count;
+}
+
+// Inject one instance of the given corruption and describe it
+void inject(CorruptionKind kind) {
+    uint32_t data_blocks = superblock.total_blocks - superblock.first_data_block;
+    uint32_t i, j;
+    switch (kind) {
+    case CORRUPT_MAGIC:
+        superblock.magic = 0;
+        printf("Corrupt: superblock magic cleared\n");
+        break;
+    case CORRUPT_BITMAP:
+        if (random_below(2)) {
+            uint32_t block = superblock.first_data_block + random_below(data_blocks);
+            data_bitmap[block / 8] ^= 1 << (block % 8);
+            printf("Corrupt: data bitmap bit %u flipped\n", block);
+        } else {
+            i = random_below(superblock.inode_count);
+            inode_bitmap[i / 8] ^= 1 << (i % 8);
+            printf("Corrupt: inode bitmap bit %u flipped\n", i);
+        }
+        break;
+    case CORRUPT_DUP:
+        i = random_used_inode();
+        j = random_used_inode();
+        if (i == superblock.inode_count || inodes[j].direct[0] == 0) break;
+        inodes[i].direct[random_below(DIRECT_POINTERS)] = inodes[j].direct[0];
+        printf("Corrupt: inode %u shares block %u with inode %u\n", i, inodes[j].direct[0], j);
+        break;
+    case CORRUPT_RANGE:
+        i = random_used_inode();
+        if (i == superblock.inode_count) break;
+        j = random_below(DIRECT_POINTERS);
+        inodes[i].direct[j] = superblock.total_blocks + random_below(1u << 20);
+        printf("Corrupt: inode %u direct pointer %u set to %u\n", i, j, inodes[i].direct[j]);
+        break;
+    case CORRUPT_LINKS:
+        i = random_used_inode();
+        if (i == superblock.inode_count) break;
+        inodes[i].links_count += 1 + random_below(3);
+        printf("Corrupt: inode %u link count set to %u\n", i, inodes[i].links_count);
+        break;
+    case CORRUPT_ORPHAN: {
+        if (entry_count == 0) break;
+        EntryRecord *e = &entries[random_below(entry_count)];
+        Dirent empty;
+        memset(&empty, 0, sizeof(empty));
+        if (pwrite(fd, &empty, sizeof(empty), (off_t)e->block * BLOCK_SIZE + (off_t)e->slot * sizeof(Dirent)) < 0) {
+            perror("Failed to write directory entry");
+            exit(1);
+        }
+        printf("Corrupt: entry for inode %u removed from directory %u\n", e->inode, e->dir);
+        break;
+    }
+    case CORRUPT_CYCLE:
+        if (directory_count < 2) break;
+        i = 1 + random_below(directory_count - 1);
+        j = parent_dir[i];
+        for (uint32_t up = random_below(4); up > 0 && j != ROOT_INODE; up--) j = parent_dir[j];
+        if (add_entry(i, j, "loop") == 0) {
+            inodes[j].links_count++;
+            printf("Corrupt: directory %u links back to ancestor %u\n", i, j);
+        }
+        break;
+    case CORRUPT_SILENT:
+        // Damage nothing but a checksum can catch
+        i = random_used_inode();
+        if (i == superblock.inode_count) break;
+        inodes[i].mtime ^= 1u << random_below(32);
+        printf("Corrupt: inode %u mtime changed to %u\n", i, inodes[i].mtime);
+        break;
+    case CORRUPT_INDIRECT: {
+        if (pointer_block_count == 0) break;
+        uint32_t block = pointer_blocks[random_below(pointer_block_count)];
+        uint32_t pointers[POINTERS_PER_BLOCK];
+        // Garbage pointers: some out of range, some into metadata, some into other files
+        for (uint32_t k = 0; k < POINTERS_PER_BLOCK; k++) {
+            uint32_t r = random_below(4);
+            pointers[k] = r == 0 ? 0 : r == 1 ? (uint32_t)next_random()
+                        : r == 2 ? random_below(superblock.first_data_block)
+                                 : superblock.first_data_block + random_below(data_blocks);
+        }
+        if (write_block(block, pointers) < 0) {
+            perror("Failed to write pointer block");
+            exit(1);
+        }
+        printf("Corrupt: indirect block %u overwritten with garbage\n", block);
+        break;
+    }
+    }
+}
+
+// Set the inode, bitmap group and superblock checksums vsfsck verifies
+void set_checksums(uint32_t inode_bitmap_blocks, uint32_t data_bitmap_blocks) {
+    superblock.features |= FEATURE_CHECKSUMS;
+    for (uint32_t i = 0; i < superblock.inode_count; i++) {
+        inodes[i].checksum = inode_checksum_of(i, &inodes[i]);
+    }
+    uint32_t blocks = inode_bitmap_blocks + data_bitmap_blocks;
+    uint32_t per_group = (blocks + SB_BITMAP_CHECKSUMS - 1) / SB_BITMAP_CHECKSUMS;
+    for (uint32_t group = 0; group * per_group < blocks; group++) {
+        uint32_t crc = crc32c(0, &group, sizeof(group));
+        for (uint32_t k = group * per_group; k < (group + 1) * per_group && k < blocks; k++) {
+            uint8_t *data = k < inode_bitmap_blocks ? inode_bitmap + (size_t)k * BLOCK_SIZE
+                                                    : data_bitmap + (size_t)(k - inode_bitmap_blocks) * BLOCK_SIZE;
+            crc = crc32c(crc, data, BLOCK_SIZE);
+        }
+        superblock.bitmap_checksums[group] = crc;
+    }
+    superblock.checksum = superblock_checksum(&superblock);
+}
+
+// Parse KIND[=COUNT] for -c
+int parse_corruption(const char *arg, Corruption *c) {
+    const char *eq = strchr(arg, '=');
+    size_t len = eq ? (size_t)(eq - arg) : strlen(arg);
+    for (int k = 0; k < (int)(sizeof(corruption_names) / sizeof(corruption_names[0])); k++) {
+        if (strlen(corruption_names[k]) == len && strncmp(arg, corruption_names[k], len) == 0) {
+            char *end;
+            long n = eq ? strtol(eq + 1, &end, 10) : 1;
+            if (eq && (eq[1] == '\0' || *end != '\0' || n < 1)) return -1;
+            c->kind = k;
+            c->count = n;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Parse a non-negative number option
+int parse_number(const char *arg, unsigned long long max, unsigned long long *value) {
+    char *end;
+    if (!arg || *arg == '\0') return -1;
+    *value = strtoull(arg, &end, 0);
+    return *end == '\0' && *value <= max ? 0 : -1;
+}
+
+// Print usage
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-b BLOCKS] [-i INODES] [-f PERCENT] [-d small|mixed|large] [-D DIRS] [-s SEED]\n", prog);
+    fprintf(stderr, "       [-C] [-c KIND[=COUNT]]... <vsfs.img>\n");
+    fprintf(stderr, "  -b BLOCKS   total blocks in the image (default 65536)\n");
+    fprintf(stderr, "  -i INODES   inode count (default one per 16 blocks)\n");
+    fprintf(stderr, "  -f PERCENT  share of the data region to fill with files (default 50)\n");
+    fprintf(stderr, "  -d SIZES    file size distribution (default mixed)\n");
+    fprintf(stderr, "  -D DIRS     build a directory tree of DIRS directories rooted at inode 0 and\n");
+    fprintf(stderr, "              name every file in one of them (default 0: no directories)\n");
+    fprintf(stderr, "  -s SEED     random seed (default 1)\n");
+    fprintf(stderr, "  -C          store CRC32C checksums of the superblock, bitmaps and inodes, taken\n");
+    fprintf(stderr, "              before any corruption is injected\n");
+    fprintf(stderr, "  -c KIND     inject magic, bitmap, dup, range, indirect, links, orphan, cycle or\n");
+    fprintf(stderr, "              silent corruptions; orphan and cycle need -D, silent (an mtime\n");
+    fprintf(stderr, "              change) is only caught with -C\n");
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long long total = 65536, count = 0, fill = 50, seed = 1, dirs = 0;
+    SizeDistribution sizes = SIZES_MIXED;
+    Corruption corruptions[MAX_CORRUPTIONS];
+    int corruption_count = 0, checksums = 0;
+    const char *path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        int ok = 1;
+        if (strcmp(argv[i], "-b") == 0) {
+            ok = parse_number(value, UINT32_MAX, &total) == 0 && total >= MIN_TOTAL_BLOCKS;
+            i++;
+        } else if (strcmp(argv[i], "-i") == 0) {
+            ok = parse_number(value, UINT32_MAX, &count) == 0 && count > 0;
+            i++;
+        } else if (strcmp(argv[i], "-f") == 0) {
+            ok = parse_number(value, 100, &fill) == 0;
+            i++;
+        } else if (strcmp(argv[i], "-D") == 0) {
+            ok = parse_number(value, UINT32_MAX, &dirs) == 0;
+            directory_count = dirs;
+            i++;
+        } else if (strcmp(argv[i], "-s") == 0) {
+            ok = parse_number(value, UINT64_MAX, &seed) == 0;
+            i++;
+        } else if (strcmp(argv[i], "-d") == 0 && value) {
+            if (strcmp(value, "small") == 0) sizes = SIZES_SMALL;
+            else if (strcmp(value, "mixed") == 0) sizes = SIZES_MIXED;
+            else if (strcmp(value, "large") == 0) sizes = SIZES_LARGE;
+            else ok = 0;
+            i++;
+        } else if (strcmp(argv[i], "-C") == 0) {
+            checksums = 1;
+        } else if (strcmp(argv[i], "-c") == 0 && value && corruption_count < MAX_CORRUPTIONS) {
+            ok = parse_corruption(value, &corruptions[corruption_count++]) == 0;
+            i++;
+        } else if (argv[i][0] == '-' || path) {
+            ok = 0;
+        } else {
+            path = argv[i];
+        }
+        if (!ok) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!path) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    superblock.magic = MAGIC_NUMBER;
+    superblock.block_size = BLOCK_SIZE;
+    superblock.total_blocks = (uint32_t)total;
+    superblock.inode_size = INODE_SIZE;
+    superblock.inode_count = count ? (uint32_t)count : (uint32_t)(total / 16 ? total / 16 : 1);
+    default_layout(&superblock);
+    if (superblock.first_data_block >= superblock.total_blocks) {
+        fprintf(stderr, "%u inodes leave no data blocks in %u blocks\n", superblock.inode_count, superblock.total_blocks);
+        return 1;
+    }
+
+    uint32_t inode_bitmap_blocks = superblock.data_bitmap_block - superblock.inode_bitmap_block;
+    uint32_t data_bitmap_blocks = superblock.inode_table_start - superblock.data_bitmap_block;
+    uint32_t inode_table_blocks = superblock.first_data_block - superblock.inode_table_start;
+    inode_bitmap = calloc(inode_bitmap_blocks, BLOCK_SIZE);
+    data_bitmap = calloc(data_bitmap_blocks, BLOCK_SIZE);
+    inodes = calloc(inode_table_blocks, BLOCK_SIZE);
+    if (!inode_bitmap || !data_bitmap || !inodes) {
+        perror("Failed to allocate tables");
+        return 1;
+    }
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("Failed to create image");
+        return 1;
+    }
+    // Data blocks stay holes; only metadata and pointer blocks are written
+    if (ftruncate(fd, (off_t)total * BLOCK_SIZE) < 0) {
+        perror("Failed to size image");
+        close(fd);
+        return 1;
+    }
+
+    rng_state = seed ? seed : 1;
+    next_block = superblock.first_data_block;
+    uint64_t data_blocks = superblock.total_blocks - superblock.first_data_block;
+    uint32_t target = superblock.first_data_block + (uint32_t)(data_blocks * fill / 100);
+    uint32_t files = 0;
+    if (directory_count > superblock.inode_count) directory_count = superblock.inode_count;
+    if (directory_count > 0 && create_directories() < 0) {
+        fprintf(stderr, "No room for %u directories\n", directory_count);
+        close(fd);
+        return 1;
+    }
+    for (uint32_t i = directory_count; i < superblock.inode_count && next_block < target; i++) {
+        uint32_t blocks = file_size(sizes);
+        if (blocks > target - next_block) blocks = target - next_block;
+        if (!create_file(i, blocks)) break;
+        if (directory_count > 0 && link_file(i) < 0) {
+            fprintf(stderr, "Directories are full after %u files\n", files);
+            break;
+        }
+        files++;
+    }
+
+    if (checksums) set_checksums(inode_bitmap_blocks, data_bitmap_blocks);
+    for (int k = 0; k < corruption_count; k++) {
+        for (uint32_t n = 0; n < corruptions[k].count; n++) inject(corruptions[k].kind);
+    }
+
+    if (write_block(0, &superblock) < 0 ||
+        write_blocks(superblock.inode_bitmap_block, inode_bitmap_blocks, inode_bitmap) < 0 ||
+        write_blocks(superblock.data_bitmap_block, data_bitmap_blocks, data_bitmap) < 0 ||
+        write_blocks(superblock.inode_table_start, inode_table_blocks, inodes) < 0 || fsync(fd) < 0) {
+        perror("Failed to write image");
+        close(fd);
+        return 1;
+    }
+    close(fd);
+
+    printf("Created %s: %u blocks, %u inodes, %u files, %u data blocks used\n", path,
+           superblock.total_blocks, superblock.inode_count, files, next_block - superblock.first_data_block);
+    free(inodes);
+    free(inode_bitmap);
+    free(data_bitmap);
+    free(pointer_blocks);
+    free(parent_dir);
+    free(dir_slots);
+    free(entries);
+    return 0;
+}
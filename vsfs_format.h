@@ -0,0 +1,182 @@
+#ifndef VSFS_FORMAT_H
+#define VSFS_FORMAT_H
+
+// On-disk format of VSFS images, shared by vsfsck, mkvsfs and vsfstest: the
+// block layout, the superblock, inode and directory entry structures, and
+// the CRC32C checksums images with FEATURE_CHECKSUMS keep.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#endif
+
+// <linux/fs.h> has a BLOCK_SIZE of its own, the kernel's 1 KiB block; here
+// it means the VSFS block
+#undef BLOCK_SIZE
+
+#define BLOCK_SIZE 4096
+#define INODE_SIZE 256
+#define MAGIC_NUMBER 0xD34D
+#define INODES_PER_BLOCK (BLOCK_SIZE / INODE_SIZE)
+#define BITS_PER_BLOCK (BLOCK_SIZE * 8)
+#define SUPERBLOCK_BLOCK 0
+#define INODE_BITMAP_BLOCK 1
+#define MIN_TOTAL_BLOCKS 5
+#define DIRECT_POINTERS 12
+#define INODE_POINTERS 15
+#define POINTERS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
+#define ROOT_INODE 0
+#define DIRENT_NAME_MAX 27
+#define DIRENTS_PER_BLOCK (BLOCK_SIZE / sizeof(Dirent))
+#define FEATURE_CHECKSUMS 0x1
+#define SB_BITMAP_CHECKSUMS 1012
+
+// Superblock structure
+typedef struct {
+    uint16_t magic;
+    uint32_t block_size;
+    uint32_t total_blocks;
+    uint32_t inode_bitmap_block;
+    uint32_t data_bitmap_block;
+    uint32_t inode_table_start;
+    uint32_t first_data_block;
+    uint32_t inode_size;
+    uint32_t inode_count;
+    // With FEATURE_CHECKSUMS: CRC32C of the superblock (taken without the
+    // checksum field) and of the bitmap blocks, split into at most
+    // SB_BITMAP_CHECKSUMS groups of equal size
+    uint32_t features;
+    uint32_t checksum;
+    uint32_t bitmap_checksums[SB_BITMAP_CHECKSUMS];
+    uint8_t reserved[2];
+} Superblock;
+
+// Inode structure
+typedef struct {
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t size;
+    uint32_t atime;
+    uint32_t ctime;
+    uint32_t mtime;
+    uint32_t dtime;
+    uint32_t links_count;
+    uint32_t blocks_count;
+    uint32_t direct[DIRECT_POINTERS];
+    uint32_t single_indirect;
+    uint32_t double_indirect;
+    uint32_t triple_indirect;
+    uint32_t checksum;
+    uint8_t reserved[152];
+} Inode;
+
+// Directory entry, 32 bytes; name_len 0 marks a free slot. Directories are
+// inodes with S_IFDIR in mode and the tree hangs off ROOT_INODE.
+typedef struct {
+    uint32_t inode;
+    uint8_t name_len;
+    char name[DIRENT_NAME_MAX];
+} Dirent;
+
+// The tools read and write these structures as raw blocks
+_Static_assert(sizeof(Superblock) == BLOCK_SIZE, "superblock must fill one block");
+_Static_assert(sizeof(Inode) == INODE_SIZE, "inode must be INODE_SIZE bytes");
+_Static_assert(BLOCK_SIZE % sizeof(Dirent) == 0 && sizeof(Dirent) == 32, "directory entry must be 32 bytes");
+
+// CRC32C tables for slicing by 8, and the fastest update routine this CPU
+// offers; both are set up on first use
+static uint32_t crc32c_table[8][256];
+static uint32_t (*crc32c_update)(uint32_t crc, const uint8_t *p, size_t len);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+// Table-driven CRC32C update, eight bytes per step
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        v = le64toh(v) ^ crc;
+        crc = crc32c_table[7][v & 0xFF] ^ crc32c_table[6][(v >> 8) & 0xFF] ^ crc32c_table[5][(v >> 16) & 0xFF] ^
+              crc32c_table[4][(v >> 24) & 0xFF] ^ crc32c_table[3][(v >> 32) & 0xFF] ^
+              crc32c_table[2][(v >> 40) & 0xFF] ^ crc32c_table[1][(v >> 48) & 0xFF] ^ crc32c_table[0][v >> 56];
+    }
+    while (len--) crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xFF];
+    return crc;
+}
+
+#if defined(__x86_64__)
+// CRC32C update with the SSE4.2 crc32 instruction
+__attribute__((target("sse4.2"))) static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t c = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+    }
+    while (len--) c = _mm_crc32_u8((uint32_t)c, *p++);
+    return (uint32_t)c;
+}
+#elif defined(__aarch64__)
+// CRC32C update with the ARMv8 CRC32 instructions
+__attribute__((target("+crc"))) static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = __crc32cd(crc, v);
+    }
+    while (len--) crc = __crc32cb(crc, *p++);
+    return crc;
+}
+#endif
+
+static void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++) crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+        crc32c_table[0][i] = crc;
+    }
+    for (int t = 1; t < 8; t++) {
+        for (int i = 0; i < 256; i++) {
+            uint32_t prev = crc32c_table[t - 1][i];
+            crc32c_table[t][i] = (prev >> 8) ^ crc32c_table[0][prev & 0xFF];
+        }
+    }
+    crc32c_update = crc32c_sw;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) crc32c_update = crc32c_hw;
+#elif defined(__aarch64__)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) crc32c_update = crc32c_hw;
+#endif
+}
+
+// Extend a CRC32C (Castagnoli) checksum over a buffer
+static inline uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_update(~crc, data, len);
+}
+
+// CRC32C of a structure leaving out its 32-bit checksum field, seeded with
+// the structure's own number so swapped copies do not pass
+static inline uint32_t checksum_without(uint32_t seed, const void *data, size_t len, size_t field) {
+    const uint8_t *bytes = data;
+    uint32_t crc = crc32c(0, &seed, sizeof(seed));
+    crc = crc32c(crc, bytes, field);
+    return crc32c(crc, bytes + field + sizeof(uint32_t), len - field - sizeof(uint32_t));
+}
+
+static inline uint32_t superblock_checksum(const Superblock *sb) {
+    return checksum_without(SUPERBLOCK_BLOCK, sb, sizeof(Superblock), offsetof(Superblock, checksum));
+}
+
+static inline uint32_t inode_checksum_of(uint32_t i, const Inode *inode) {
+    return checksum_without(i, inode, sizeof(Inode), offsetof(Inode, checksum));
+}
+
+#endif
@@ -0,0 +1,251 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define MAX_ARGS 32
+#define MAX_SIZES 16
+#define MAX_MODES 8
+
+// Phases of one benchmark round
+typedef enum {
+    PHASE_GENERATE,
+    PHASE_REPAIR,
+    PHASE_RECHECK,
+    PHASE_COUNT
+} Phase;
+
+const char *phase_names[] = { "generate", "repair", "recheck" };
+
+// Cost of running one command, from the clock, rusage and /proc/<pid>/io
+typedef struct {
+    double wall;
+    double user;
+    double sys;
+    uint64_t syscalls;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    long max_rss_kb;
+    int status;
+} RunCost;
+
+const char *mkvsfs_path = "./mkvsfs";
+const char *vsfsck_path = "./vsfsck";
+const char *work_dir = "/tmp";
+const char *corruptions = "magic,bitmap=8,dup=8,range=8,indirect=4";
+
+// Seconds on the monotonic clock
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Read the I/O counters of a child that has exited but not yet been reaped
+void read_io_counters(pid_t pid, RunCost *cost) {
+    char path[64], key[32];
+    unsigned long long value;
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    FILE *file = fopen(path, "r");
+    if (!file) return;
+    while (fscanf(file, "%31[^:]: %llu\n", key, &value) == 2) {
+        if (strcmp(key, "rchar") == 0) cost->bytes_read = value;
+        else if (strcmp(key, "wchar") == 0) cost->bytes_written = value;
+        else if (strcmp(key, "syscr") == 0 || strcmp(key, "syscw") == 0) cost->syscalls += value;
+    }
+    fclose(file);
+}
+
+// Run a command with its output discarded and measure what it cost.
+// syscalls counts the read and write class calls the kernel accounts in
+// /proc/<pid>/io, which covers pread, pwritev and friends.
+int run_command(char **args, RunCost *cost) {
+    memset(cost, 0, sizeof(*cost));
+    double start = now();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) {
+            dup2(null, STDOUT_FILENO);
+            close(null);
+        }
+        execvp(args[0], args);
+        perror(args[0]);
+        _exit(127);
+    }
+
+    // Wait without reaping so /proc/<pid>/io is still there to read
+    siginfo_t info;
+    if (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) < 0) {
+        perror("waitid");
+        return -1;
+    }
+    cost->wall = now() - start;
+    read_io_counters(pid, cost);
+
+    struct rusage usage;
+    int status;
+    if (wait4(pid, &status, 0, &usage) < 0) {
+        perror("wait4");
+        return -1;
+    }
+    cost->user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    cost->sys = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    cost->max_rss_kb = usage.ru_maxrss;
+    cost->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    return 0;
+}
+
+// Split a space separated mode string into args, after the program name
+int split_mode(char *mode, char **args, int first) {
+    int n = first;
+    for (char *arg = strtok(mode, " "); arg && n < MAX_ARGS - 2; arg = strtok(NULL, " ")) args[n++] = arg;
+    return n;
+}
+
+// Build the mkvsfs command line for one image
+void generate_args(char **args, char *blocks, char *seed, char *image, char *list) {
+    int n = 0;
+    args[n++] = (char *)mkvsfs_path;
+    args[n++] = "-b";
+    args[n++] = blocks;
+    args[n++] = "-s";
+    args[n++] = seed;
+    for (char *c = strtok(list, ","); c && n < MAX_ARGS - 3; c = strtok(NULL, ",")) {
+        args[n++] = "-c";
+        args[n++] = c;
+    }
+    args[n++] = image;
+    args[n] = NULL;
+}
+
+// Print one result row
+void print_row(const char *size, const char *mode, Phase phase, RunCost *cost) {
+    printf("%-10s %-12s %-9s %8.3f %8.3f %8.3f %10llu %12llu %12llu %9ld %4d\n", size, *mode ? mode : "(pread)",
+           phase_names[phase], cost->wall, cost->user, cost->sys, (unsigned long long)cost->syscalls,
+           (unsigned long long)cost->bytes_read, (unsigned long long)cost->bytes_written, cost->max_rss_kb,
+           cost->status);
+}
+
+// Parse a comma separated list of block counts
+int parse_sizes(char *list, char **sizes) {
+    int n = 0;
+    for (char *size = strtok(list, ","); size; size = strtok(NULL, ",")) {
+        char *end;
+        unsigned long long blocks = strtoull(size, &end, 0);
+        if (*end != '\0' || blocks == 0 || blocks > UINT32_MAX || n == MAX_SIZES) return -1;
+        sizes[n++] = size;
+    }
+    return n;
+}
+
+// Print usage
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-b BLOCKS[,BLOCKS...]] [-m MODE]... [-r RUNS] [-c CORRUPTIONS]\n", prog);
+    fprintf(stderr, "       [--mkvsfs PATH] [--vsfsck PATH] [--dir DIR]\n");
+    fprintf(stderr, "  -b BLOCKS   image sizes in blocks (default 65536,262144,1048576)\n");
+    fprintf(stderr, "  -m MODE     vsfsck options to compare, e.g. \"--mmap\" or \"-j 4\" (default: none, --mmap)\n");
+    fprintf(stderr, "  -r RUNS     rounds per configuration; the fastest is reported (default 3)\n");
+    fprintf(stderr, "  -c LIST     mkvsfs corruptions, comma separated (default %s)\n", corruptions);
+    fprintf(stderr, "Build: make vsfsck mkvsfs vsfsbench\n");
+}
+
+int main(int argc, char *argv[]) {
+    char default_sizes[] = "65536,262144,1048576";
+    char *size_list = default_sizes;
+    char *sizes[MAX_SIZES];
+    char *modes[MAX_MODES];
+    int mode_count = 0, runs = 3;
+
+    for (int i = 1; i < argc; i++) {
+        char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!value) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (strcmp(argv[i], "-b") == 0) {
+            size_list = value;
+        } else if (strcmp(argv[i], "-m") == 0 && mode_count < MAX_MODES) {
+            modes[mode_count++] = value;
+        } else if (strcmp(argv[i], "-r") == 0) {
+            runs = atoi(value);
+        } else if (strcmp(argv[i], "-c") == 0) {
+            corruptions = value;
+        } else if (strcmp(argv[i], "--mkvsfs") == 0) {
+            mkvsfs_path = value;
+        } else if (strcmp(argv[i], "--vsfsck") == 0) {
+            vsfsck_path = value;
+        } else if (strcmp(argv[i], "--dir") == 0) {
+            work_dir = value;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+        i++;
+    }
+    int size_count = parse_sizes(size_list, sizes);
+    if (size_count <= 0 || runs < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (mode_count == 0) {
+        modes[mode_count++] = "";
+        modes[mode_count++] = "--mmap";
+    }
+
+    char image[4096];
+    snprintf(image, sizeof(image), "%s/vsfsbench-%d.img", work_dir, (int)getpid());
+
+    printf("%-10s %-12s %-9s %8s %8s %8s %10s %12s %12s %9s %4s\n", "blocks", "mode", "phase", "wall_s",
+           "user_s", "sys_s", "syscalls", "read_bytes", "write_bytes", "rss_kb", "exit");
+    int failed = 0;
+    for (int s = 0; s < size_count; s++) {
+        for (int m = 0; m < mode_count; m++) {
+            RunCost best[PHASE_COUNT];
+            for (int r = 0; r < runs; r++) {
+                char seed[16], list[1024], mode[256];
+                char *args[MAX_ARGS];
+                RunCost cost[PHASE_COUNT];
+                snprintf(seed, sizeof(seed), "%d", r + 1);
+                snprintf(list, sizeof(list), "%s", corruptions);
+                generate_args(args, sizes[s], seed, image, list);
+                if (run_command(args, &cost[PHASE_GENERATE]) < 0 || cost[PHASE_GENERATE].status != 0) {
+                    fprintf(stderr, "Failed to generate %s\n", image);
+                    unlink(image);
+                    return 1;
+                }
+
+                // Repair the damaged image, then check the repaired one
+                for (Phase phase = PHASE_REPAIR; phase < PHASE_COUNT; phase++) {
+                    snprintf(mode, sizeof(mode), "%s", modes[m]);
+                    args[0] = (char *)vsfsck_path;
+                    int n = split_mode(mode, args, 1);
+                    args[n++] = image;
+                    args[n] = NULL;
+                    if (run_command(args, &cost[phase]) < 0) {
+                        unlink(image);
+                        return 1;
+                    }
+                }
+                if (cost[PHASE_RECHECK].status != 0) failed = 1;
+                for (Phase phase = PHASE_GENERATE; phase < PHASE_COUNT; phase++) {
+                    if (r == 0 || cost[phase].wall < best[phase].wall) best[phase] = cost[phase];
+                }
+            }
+            for (Phase phase = PHASE_GENERATE; phase < PHASE_COUNT; phase++) print_row(sizes[s], modes[m], phase, &best[phase]);
+        }
+    }
+    unlink(image);
+    if (failed) fprintf(stderr, "Some repaired images did not check clean\n");
+    return failed;
+}
@@ -1,122 +1,1274 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <endian.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <linux/io_uring.h>
+#include <linux/fs.h>
+#include "vsfsck.h"
+// After <linux/io_uring.h>, which pulls in <linux/fs.h> and its BLOCK_SIZE
+#include "vsfs_format.h"
 
-#define BLOCK_SIZE 4096
-#define TOTAL_BLOCKS 64
-#define INODE_SIZE 256
-#define MAGIC_NUMBER 0xD34D
-#define INODE_COUNT (5 * BLOCK_SIZE / INODE_SIZE)
-#define DATA_BLOCK_START 8
-#define INODE_TABLE_START 3
-#define INODE_BITMAP_BLOCK 1
-#define DATA_BITMAP_BLOCK 2
+#define INDIRECT_WINDOW 256
+#define INDIRECT_MAX_GAP 8
+#define MAX_THREADS 254
+#define WRITE_BATCH_BLOCKS 256
+#define JOURNAL_MAGIC "VSFSJNL1"
+#define JOURNAL_RECORD 0x4345524A
+#define JOURNAL_COMMIT 0x544D434A
+#define OVERLAY_MAGIC "VSFSOVL1"
+#define CACHE_MAGIC "VSFSDGC1"
+#define CACHE_REFERENCE 1
+#define CACHE_POINTER_BLOCK 2
+#define OWNER_NONE 0xFF
+#define REPORT_MAGIC "VSFSFND1"
+#define REPORT_FLUSH_RECORDS 65536
+#define DEFAULT_QUEUE_DEPTH 32
+#define MAX_QUEUE_DEPTH 256
+#define POOL_THREADS 8
+#define TABLE_CHUNK_BLOCKS 64
+#define RUN_MAX_BLOCKS 32
 
-// Superblock structure
+// Image geometry taken from the superblock
 typedef struct {
-    uint16_t magic;
-    uint32_t block_size;
     uint32_t total_blocks;
+    uint32_t inode_count;
     uint32_t inode_bitmap_block;
+    uint32_t inode_bitmap_blocks;
     uint32_t data_bitmap_block;
+    uint32_t data_bitmap_blocks;
     uint32_t inode_table_start;
+    uint32_t inode_table_blocks;
     uint32_t first_data_block;
-    uint32_t inode_size;
+} Geometry;
+
+// Reference to a pointer block still to be walked; depth 1 blocks hold data
+// pointers, deeper ones point to further pointer blocks
+typedef struct {
+    uint32_t block;
+    uint32_t inode;
+    uint32_t depth;
+} IndirectRef;
+
+// Growable list of pointer block references
+typedef struct {
+    IndirectRef *refs;
+    size_t count;
+    size_t capacity;
+} RefList;
+
+// Duplicate reference to a data block waiting for its own copy: slot of an
+// inode's pointers, or of a pointer block's when pointer_block is not 0
+typedef struct {
+    uint32_t inode;
+    uint32_t pointer_block;
+    uint32_t slot;
+    uint32_t block;
+} CloneRef;
+
+// Growable list of duplicate references to clone
+typedef struct {
+    CloneRef *refs;
+    size_t count;
+    size_t capacity;
+} CloneList;
+
+// Reference from a pointer block to a block that several pointer blocks of
+// one level claim, kept until the whole level is read
+typedef struct {
+    uint32_t block;
+    uint32_t depth;
+    uint32_t inode;
+    uint32_t pointer_block;
+    uint32_t slot;
+} Claim;
+
+// Growable list of contested claims
+typedef struct {
+    Claim *claims;
+    size_t count;
+    size_t capacity;
+} ClaimList;
+
+// Pointer block, or directory block (depth 0), modified by a repair
+typedef struct {
+    uint32_t block;
+    uint32_t inode;
+    uint32_t depth;
+    uint8_t *data;
+} PointerBlock;
+
+// Placement of the data blocks under one pointer block (or of a whole
+// file), in file order: the first and last block, how many there are and
+// how many runs of physically adjacent blocks they form
+typedef struct {
+    uint32_t block;
+    uint32_t first;
+    uint32_t last;
+    uint32_t blocks;
+    uint32_t fragments;
+} Span;
+
+// Pointer blocks of every file visited for an analysis. Leaf spans are
+// summed up as they are read; blocks holding further pointer blocks are
+// kept until the spans below them are known.
+typedef struct {
+    Span *spans;
+    size_t span_count;
+    size_t span_capacity;
+    PointerBlock *uppers;
+    size_t upper_count;
+    size_t upper_capacity;
+} SpanTable;
+
+// State of visiting one level of pointer blocks for an analysis
+typedef struct {
+    SpanTable *table;
+    RefList *level;
+    RefList *next;
+} SpanWalk;
+
+// Journal file header: the size of the image it was written for and the
+// CRC32C of that image's superblock block before the repairs
+typedef struct {
+    char magic[8];
+    uint32_t block_size;
+    uint32_t superblock_crc;
+    uint64_t image_blocks;
+} JournalHeader;
+
+// Journal record header, followed by the block's original and repaired
+// contents. The commit record carries the record count in place of a block
+// number and a checksum chained over all record checksums.
+typedef struct {
+    uint32_t type;
+    uint32_t block;
+    uint32_t checksum;
+    uint32_t reserved;
+} JournalRecord;
+
+// Overlay file header. The header block is followed by a bitmap of the
+// image blocks the overlay holds, then by a sparse copy of the image in
+// which only those blocks are ever written.
+typedef struct {
+    char magic[8];
+    uint32_t block_size;
+    uint32_t index_blocks;
+    uint64_t image_blocks;
+    uint64_t block_count;
+} OverlayHeader;
+
+// Digest cache header: the geometry it was written for and the superblock checksum
+typedef struct {
+    char magic[8];
+    uint32_t block_size;
+    uint32_t total_blocks;
     uint32_t inode_count;
-    uint8_t reserved[4058];
-} Superblock;
-
-// Inode structure
-typedef struct {
-    uint32_t mode;
-    uint32_t uid;
-    uint32_t gid;
-    uint32_t size;
-    uint32_t atime;
-    uint32_t ctime;
-    uint32_t mtime;
-    uint32_t dtime;
-    uint32_t links_count;
-    uint32_t blocks_count;
-    uint32_t direct[12];
-    uint32_t single_indirect;
-    uint32_t double_indirect;
-    uint32_t triple_indirect;
-    uint8_t reserved[156];
-} Inode;
+    uint32_t inode_bitmap_block;
+    uint32_t data_bitmap_block;
+    uint32_t inode_table_start;
+    uint32_t first_data_block;
+    uint32_t superblock_crc;
+    uint64_t tree_count;
+} CacheHeader;
+
+// One contribution of an inode table block's indirect trees: a block
+// referenced from a pointer block, or a pointer block and its checksum
+typedef struct {
+    uint32_t block;
+    uint32_t crc;
+    uint32_t flags;
+} TreeEntry;
+
+// Tree entry recorded during this run, tagged with its inode table block
+typedef struct {
+    uint32_t table_block;
+    TreeEntry entry;
+} TreeRecord;
+
+// Digest cache loaded from disk. crcs holds the inode bitmap, data bitmap
+// and inode table block checksums in that order; tree_offsets indexes each
+// inode table block's entries in trees.
+typedef struct {
+    CacheHeader header;
+    uint32_t *crcs;
+    uint64_t *tree_offsets;
+    TreeEntry *trees;
+} DigestCache;
+
+// One in-flight read of a run of blocks; first and last are the caller's
+// bookkeeping (the references the run covers)
+typedef struct {
+    uint32_t block;
+    uint32_t count;
+    uint8_t *buffer;
+    size_t first;
+    size_t last;
+    int status;
+} ReadSlot;
+
+// io_uring instance set up through the raw system calls
+typedef struct {
+    int fd;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_len;
+    size_t cq_len;
+    size_t sqes_len;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned unsubmitted;
+} Uring;
+
+// pread thread pool used where io_uring is not available
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    pthread_t thread[POOL_THREADS];
+    int threads;
+    int stop;
+    ReadSlot *queue[MAX_QUEUE_DEPTH];
+    size_t head;
+    size_t tail;
+} ReadPool;
+
+// How a kind of finding is named and printed. args picks the record fields
+// the text format prints, in order: i(node), b(lock), p(arent), e(xpected)
+// or a(ctual).
+typedef struct {
+    const char *name;
+    const char *format;
+    const char *args;
+} FindingFormat;
+
+// Findings recorded by one thread, plus counts per kind
+typedef struct {
+    Finding *records;
+    size_t count;
+    size_t capacity;
+    uint64_t counts[FINDING_KIND_COUNT];
+} FindingLog;
+
+// Binary findings stream header; flags bit 0 marks a summary stream holding
+// one record per kind with the count in actual
+typedef struct {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t flags;
+} ReportHeader;
+
+// Directory entry as indexed by the directory pass; name is an offset into
+// the name table's name arena
+typedef struct {
+    uint32_t parent;
+    uint32_t inode;
+    uint32_t block;
+    uint32_t name;
+    uint32_t hash;
+    uint16_t slot;
+    uint8_t name_len;
+} NameEntry;
+
+// (parent, name) -> entry index with open addressing; slots hold entry
+// index + 1 and 0 marks an empty slot
+typedef struct {
+    NameEntry *entries;
+    size_t count;
+    size_t capacity;
+    char *names;
+    size_t names_len;
+    size_t names_capacity;
+    uint32_t *slots;
+    size_t slot_count;
+} NameTable;
+
+// State of the directory pass. children lists entry indexes grouped by
+// parent, child_start[dir] being where dir's entries begin.
+typedef struct {
+    int repair;
+    int *fixes;
+    int errors;
+    NameTable names;
+    uint32_t *links;
+    uint32_t *parent;
+    uint32_t *queue;
+    uint64_t *reached;
+    uint32_t *child_start;
+    uint32_t *children;
+    RefList root_blocks;
+    size_t root_block;
+    uint32_t root_slot;
+} DirectoryPass;
+
+// Per-thread state of a parallel scan
+typedef struct {
+    pthread_t thread;
+    VsfsContext *ctx;
+    uint32_t index;
+    uint32_t first;
+    uint32_t last;
+    int repair;
+    int errors;
+    int fixes;
+    RefList indirect;
+    CloneList clones;
+    FindingLog log;
+} ScanWorker;
+
+// Allocation kept from one image to the next
+typedef struct {
+    void *data;
+    size_t size;
+} Buffer;
+
+// Everything known about the image being checked. Library calls make their
+// context current on the calling thread; threads started for a check make
+// it current on theirs.
+struct VsfsContext {
+    int scan_threads;
+    IoBackend io_backend;
+    int queue_depth;
+    int use_mmap;
+    const char *journal_path;
+    const char *cache_path;
+    const char *overlay_path;
+    int clone_duplicates;
+    int enable_checksums;
+    ReportFormat report_format;
+    int report_summary;
+    FILE *out;
+    FILE *info_out;
+
+    Geometry geo;
+    uint64_t image_blocks;
+    uint64_t *image_data;
+    int keep_checksums;
+    int verify_checksums;
+    uint8_t *inode_bitmap;
+    uint8_t *data_bitmap;
+    Superblock *superblock;
+    Superblock superblock_copy;
+    Inode *inodes;
+    uint64_t *block_seen;
+    uint64_t *block_shared;
+    // Blocks first claimed by the level of pointer blocks being walked
+    uint64_t *level_claimed;
+    uint8_t *dirty_blocks;
+    uint8_t *owner_range;
+    RefList indirect_refs;
+    CloneList clones;
+    PointerBlock *pointer_blocks;
+    size_t pointer_block_count;
+    size_t pointer_block_capacity;
+    int out_of_memory;
+    int record_trees;
+    TreeRecord *tree_records;
+    size_t tree_record_count;
+    size_t tree_record_capacity;
+    uint32_t *link_counts;
+    FindingLog main_log;
+    uint8_t *image_map;
+    size_t image_map_len;
+    int image_in_memory;
+    int map_private;
+    int fd;
+    int overlay_fd;
+    OverlayHeader overlay;
+    uint8_t *overlay_index;
+    int reader_ready;
+    Uring uring;
+    ReadPool pool;
+    ReadSlot *table_slots;
+    uint32_t table_chunks;
+    uint32_t table_submitted;
+    uint32_t table_completed;
+    int read_failed;
+    // Findings of the repair pass it has no fix for; the re-check after
+    // fixes only revisits repaired blocks, so these are added to its count
+    int unrepaired;
+    VsfsStats stats;
+
+    // Reused buffers behind the tables above and the pointer block reads
+    Buffer seen_buffer;
+    Buffer extent_buffer;
+    Buffer shared_buffer;
+    Buffer claimed_buffer;
+    Buffer dirty_buffer;
+    Buffer inode_bitmap_buffer;
+    Buffer data_bitmap_buffer;
+    Buffer inode_buffer;
+    ReadSlot *run_slots;
+    uint8_t *run_buffers;
+};
 
 // Global variables
-uint8_t inode_bitmap[BLOCK_SIZE];
-uint8_t data_bitmap[BLOCK_SIZE];
-Inode inodes[INODE_COUNT];
-uint32_t block_references[TOTAL_BLOCKS];
-int fd;
+__thread VsfsContext *ctx;
+__thread FindingLog *report_log;
+
+const FindingFormat finding_formats[FINDING_KIND_COUNT] = {
+    [FINDING_SB_MAGIC] = { "superblock_magic", "Superblock: Invalid magic number (0x%04llx, expected 0x%04llx)", "ae" },
+    [FINDING_SB_BLOCK_SIZE] = { "superblock_block_size", "Superblock: Invalid block size (%llu, expected %llu)", "ae" },
+    [FINDING_SB_TOTAL_BLOCKS] = { "superblock_total_blocks", "Superblock: Invalid total blocks (%llu, image holds %llu)", "ae" },
+    [FINDING_SB_INODE_BITMAP] = { "superblock_inode_bitmap", "Superblock: Invalid inode bitmap block (%llu, outside image)", "a" },
+    [FINDING_SB_DATA_BITMAP] = { "superblock_data_bitmap",
+                                 "Superblock: Invalid data bitmap block (%llu, overlaps inode bitmap or outside image)", "a" },
+    [FINDING_SB_INODE_TABLE] = { "superblock_inode_table",
+                                 "Superblock: Invalid inode table start (%llu, overlaps data bitmap or outside image)", "a" },
+    [FINDING_SB_FIRST_DATA] = { "superblock_first_data",
+                                "Superblock: Invalid first data block (%llu, must lie between inode table and block %llu)", "ae" },
+    [FINDING_SB_INODE_SIZE] = { "superblock_inode_size", "Superblock: Invalid inode size (%llu, expected %llu)", "ae" },
+    [FINDING_SB_INODE_COUNT] = { "superblock_inode_count", "Superblock: Invalid inode count (%llu, max %llu)", "ae" },
+    [FIX_SB_MAGIC] = { "fix_superblock_magic", "Fixing superblock: Setting magic number to 0x%04llx", "e" },
+    [FIX_SB_BLOCK_SIZE] = { "fix_superblock_block_size", "Fixing superblock: Setting block size to %llu", "e" },
+    [FIX_SB_TOTAL_BLOCKS] = { "fix_superblock_total_blocks", "Fixing superblock: Setting total blocks to %llu", "e" },
+    [FIX_SB_INODE_SIZE] = { "fix_superblock_inode_size", "Fixing superblock: Setting inode size to %llu", "e" },
+    [FIX_SB_INODE_COUNT] = { "fix_superblock_inode_count", "Fixing superblock: Setting inode count to %llu", "e" },
+    [FIX_SB_INODE_BITMAP] = { "fix_superblock_inode_bitmap", "Fixing superblock: Setting inode bitmap block to %llu", "e" },
+    [FIX_SB_DATA_BITMAP] = { "fix_superblock_data_bitmap", "Fixing superblock: Setting data bitmap block to %llu", "e" },
+    [FIX_SB_INODE_TABLE] = { "fix_superblock_inode_table", "Fixing superblock: Setting inode table start to %llu", "e" },
+    [FIX_SB_FIRST_DATA] = { "fix_superblock_first_data", "Fixing superblock: Setting first data block to %llu", "e" },
+    // Links count and deletion time go in actual and expected
+    [FINDING_INODE_MARKED_INVALID] = { "inode_marked_invalid",
+                                       "Inode %llu: Marked in bitmap but invalid (links=%llu, dtime=%llu)", "iae" },
+    [FIX_INODE_BITMAP_CLEAR] = { "fix_inode_bitmap_clear", "Fixing inode %llu: Clearing bitmap bit (invalid inode)", "i" },
+    [FINDING_INODE_NOT_MARKED] = { "inode_not_marked", "Inode %llu: Valid but not marked in bitmap", "i" },
+    [FIX_INODE_BITMAP_SET] = { "fix_inode_bitmap_set", "Fixing inode %llu: Setting bitmap bit (valid inode)", "i" },
+    [FINDING_BAD_POINTER] = { "bad_pointer", "Inode %llu: Bad block pointer %llu", "ib" },
+    [FIX_BAD_POINTER] = { "fix_bad_pointer", "Fixing inode %llu: Clearing bad block pointer %llu", "ib" },
+    [FIX_DUPLICATE] = { "fix_duplicate", "Fixing inode %llu: Clearing duplicate reference to block %llu", "ib" },
+    [FINDING_BAD_INDIRECT_POINTER] = { "bad_indirect_pointer", "Inode %llu: Bad block pointer %llu in indirect block %llu", "ibp" },
+    [FIX_BAD_INDIRECT_POINTER] = { "fix_bad_indirect_pointer",
+                                   "Fixing inode %llu: Clearing bad block pointer %llu in indirect block %llu", "ibp" },
+    [FIX_INDIRECT_DUPLICATE] = { "fix_indirect_duplicate",
+                                 "Fixing inode %llu: Clearing duplicate reference to block %llu in indirect block %llu", "ibp" },
+    [FINDING_UNREADABLE_INDIRECT] = { "unreadable_indirect", "Inode %llu: Unreadable indirect block %llu", "ib" },
+    // Bad pointers in actual, pointers in use in expected
+    [FINDING_GARBAGE_INDIRECT] = { "garbage_indirect",
+                                   "Inode %llu: Indirect block %llu is garbage (%llu bad pointers)", "iba" },
+    [FIX_GARBAGE_INDIRECT] = { "fix_garbage_indirect",
+                               "Fixing inode %llu: Clearing %llu pointers of garbage indirect block %llu", "ieb" },
+    [FINDING_DATA_SHARED] = { "data_shared", "Data block %llu: Referenced more than once", "b" },
+    [FINDING_DATA_UNREFERENCED] = { "data_unreferenced", "Data block %llu: Marked in bitmap but not referenced", "b" },
+    [FIX_DATA_BITMAP_CLEAR] = { "fix_data_bitmap_clear", "Fixing data block %llu: Clearing bitmap bit (unreferenced)", "b" },
+    [FINDING_DATA_UNMARKED] = { "data_unmarked", "Data block %llu: Referenced but not marked in bitmap", "b" },
+    [FIX_DATA_BITMAP_SET] = { "fix_data_bitmap_set", "Fixing data block %llu: Setting bitmap bit (referenced)", "b" },
+    [FINDING_REPAIR_NOT_WRITTEN] = { "repair_not_written", "Block %llu: Repaired contents did not reach the image", "b" },
+    [FINDING_ROOT_NOT_DIRECTORY] = { "root_not_directory", "Inode %llu: Root is not a directory", "i" },
+    [FINDING_UNREADABLE_DIRECTORY] = { "unreadable_directory", "Directory %llu: Unreadable block %llu", "ib" },
+    [FINDING_DIRENT_INVALID] = { "dirent_invalid", "Directory %llu: Invalid entry for inode %llu in block %llu", "iab" },
+    [FINDING_DIRENT_DUPLICATE] = { "dirent_duplicate", "Directory %llu: Duplicate name for inode %llu in block %llu", "iab" },
+    [FIX_DIRENT_REMOVE] = { "fix_dirent_remove", "Fixing directory %llu: Removing entry for inode %llu in block %llu", "iab" },
+    [FINDING_DIR_CYCLE] = { "dir_cycle", "Directory %llu: Entry for ancestor %llu in block %llu creates a cycle", "iab" },
+    [FINDING_DIR_HARD_LINK] = { "dir_hard_link", "Directory %llu: Extra link to directory %llu in block %llu", "iab" },
+    [FINDING_ORPHAN] = { "orphan", "Inode %llu: Not reachable from the root directory", "i" },
+    [FIX_ORPHAN] = { "fix_orphan", "Fixing inode %llu: Linking into root directory as #%llu", "ii" },
+    [FINDING_LINK_COUNT] = { "link_count", "Inode %llu: Link count %llu, expected %llu", "iae" },
+    [FIX_LINK_COUNT] = { "fix_link_count", "Fixing inode %llu: Setting link count to %llu", "ie" },
+    [FIX_CLONE_DUPLICATE] = { "fix_clone_duplicate", "Fixing inode %llu: Copying shared block %llu to block %llu", "ibe" },
+    [FINDING_INDIRECT_IN_HOLE] = { "indirect_in_hole",
+                                   "Inode %llu: Indirect block %llu lies in a hole of the image (never written)", "ib" },
+    [FIX_INDIRECT_IN_HOLE] = { "fix_indirect_in_hole",
+                               "Fixing inode %llu: Clearing pointer to indirect block %llu in a hole", "ib" },
+    // Stored checksum in actual, the one computed from the contents in expected
+    [FINDING_SB_CHECKSUM] = { "superblock_checksum", "Superblock: Checksum mismatch (0x%08llx, expected 0x%08llx)", "ae" },
+    [FIX_SB_CHECKSUM] = { "fix_superblock_checksum", "Fixing superblock: Setting checksum", "" },
+    [FINDING_BITMAP_CHECKSUM] = { "bitmap_checksum",
+                                  "Bitmap block %llu: Checksum mismatch (0x%08llx, expected 0x%08llx)", "bae" },
+    [FIX_BITMAP_CHECKSUM] = { "fix_bitmap_checksum", "Fixing bitmap block %llu: Setting checksum", "b" },
+    [FINDING_INODE_CHECKSUM] = { "inode_checksum", "Inode %llu: Checksum mismatch (0x%08llx, expected 0x%08llx)", "iae" },
+    [FIX_INODE_CHECKSUM] = { "fix_inode_checksum", "Fixing inode %llu: Setting checksum", "i" },
+};
+
+// Value of one record field named by a FindingFormat args letter
+unsigned long long finding_field(const Finding *f, char field) {
+    switch (field) {
+    case 'i': return f->inode;
+    case 'b': return f->block;
+    case 'p': return f->parent;
+    case 'e': return f->expected;
+    case 'a': return f->actual;
+    }
+    return 0;
+}
+
+// Write one finding in the chosen format
+void write_finding(FILE *out, ReportFormat report_format, const Finding *f) {
+    const FindingFormat *format = &finding_formats[f->kind];
+    if (report_format == REPORT_BINARY) {
+        fwrite(f, sizeof(*f), 1, out);
+    } else if (report_format == REPORT_JSONL) {
+        fprintf(out, "{\"kind\":\"%s\",\"inode\":%u,\"block\":%u,\"parent\":%u,\"expected\":%llu,\"actual\":%llu}\n",
+                format->name, f->inode, f->block, f->parent, (unsigned long long)f->expected,
+                (unsigned long long)f->actual);
+    } else {
+        unsigned long long args[3] = { 0 };
+        for (int k = 0; k < 3 && format->args[k]; k++) args[k] = finding_field(f, format->args[k]);
+        fprintf(out, format->format, args[0], args[1], args[2]);
+        fputc('\n', out);
+    }
+}
+
+// Write out and drop the findings collected so far on the main thread.
+// Without an output stream they are kept for vsfsck_findings.
+void flush_findings() {
+    if (!ctx->out) return;
+    for (size_t k = 0; k < ctx->main_log.count; k++) {
+        write_finding(ctx->out, ctx->report_format, &ctx->main_log.records[k]);
+    }
+    ctx->main_log.count = 0;
+}
+
+// Keep a finding's record; the main log is flushed when it fills up
+void store_finding(FindingLog *log, const Finding *f) {
+    int flushed = log == &ctx->main_log && ctx->out;
+    if (flushed && log->count == REPORT_FLUSH_RECORDS) flush_findings();
+    if (log->count == log->capacity) {
+        size_t capacity = log->capacity ? log->capacity * 2 : 1024;
+        if (flushed && capacity > REPORT_FLUSH_RECORDS) capacity = REPORT_FLUSH_RECORDS;
+        Finding *records = realloc(log->records, capacity * sizeof(Finding));
+        if (!records) {
+            ctx->out_of_memory = 1;
+            return;
+        }
+        log->records = records;
+        log->capacity = capacity;
+    }
+    log->records[log->count++] = *f;
+}
+
+// Record a finding in this thread's log. Summaries only count them.
+void report(FindingKind kind, uint32_t inode, uint32_t block, uint32_t parent, uint64_t expected, uint64_t actual) {
+    Finding f = { kind, inode, block, parent, expected, actual };
+    report_log->counts[kind]++;
+    if (!ctx->report_summary) store_finding(report_log, &f);
+}
+
+// Move a worker's findings to the end of the main log
+void merge_findings(FindingLog *log) {
+    for (int kind = 0; kind < FINDING_KIND_COUNT; kind++) ctx->main_log.counts[kind] += log->counts[kind];
+    for (size_t k = 0; k < log->count; k++) store_finding(&ctx->main_log, &log->records[k]);
+    free(log->records);
+    memset(log, 0, sizeof(*log));
+}
+
+// Print a progress or result line after the findings that precede it
+void report_info(const char *format, ...) {
+    va_list args;
+    flush_findings();
+    if (!ctx->info_out) return;
+    va_start(args, format);
+    vfprintf(ctx->info_out, format, args);
+    va_end(args);
+}
+
+// Print the number of findings of each kind seen
+void print_summary(FILE *out, ReportFormat report_format, const uint64_t *counts) {
+    if (report_format == REPORT_BINARY) {
+        for (int kind = 0; kind < FINDING_KIND_COUNT; kind++) {
+            Finding f = { kind, 0, 0, 0, 0, counts[kind] };
+            if (counts[kind]) fwrite(&f, sizeof(f), 1, out);
+        }
+        return;
+    }
+    int first = 1;
+    if (report_format == REPORT_TEXT) fprintf(out, "\nFindings by kind:\n");
+    else fprintf(out, "{\"summary\":{");
+    for (int kind = 0; kind < FINDING_KIND_COUNT; kind++) {
+        unsigned long long count = counts[kind];
+        if (!count) continue;
+        if (report_format == REPORT_TEXT) fprintf(out, "  %-28s %llu\n", finding_formats[kind].name, count);
+        else fprintf(out, "%s\"%s\":%llu", first ? "" : ",", finding_formats[kind].name, count);
+        first = 0;
+    }
+    if (report_format == REPORT_JSONL) fprintf(out, "}}\n");
+}
+
+const char *phase_names[STATS_PHASE_COUNT] = {
+    "superblock", "load", "digest", "inode_scan", "indirect_walk",
+    "data_sweep", "directories", "journal", "write_back", "recheck", "analyze",
+};
+
+// Seconds on the monotonic clock
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Charge the time since *start to a phase and restart the clock
+void phase_done(StatsPhase phase, double *start) {
+    double t = now();
+    ctx->stats.phase_seconds[phase] += t - *start;
+    *start = t;
+}
+
+// Count one I/O system call; pool and scan threads count concurrently
+void count_syscall() {
+    __atomic_fetch_add(&ctx->stats.syscalls, 1, __ATOMIC_RELAXED);
+}
+
+// Count bytes moved to or from the image or journal
+void count_transfer(int write, ssize_t n, int image) {
+    if (n <= 0) return;
+    __atomic_fetch_add(write ? &ctx->stats.bytes_written : &ctx->stats.bytes_read, n, __ATOMIC_RELAXED);
+    if (image) __atomic_fetch_add(write ? &ctx->stats.blocks_written : &ctx->stats.blocks_read, n / BLOCK_SIZE, __ATOMIC_RELAXED);
+}
+
+// Whether a block lies in a hole of a sparse image file
+int block_in_hole(uint32_t block) {
+    if (!ctx->image_data || block >= ctx->image_blocks) return 0;
+    if (ctx->overlay_index && (ctx->overlay_index[block / 8] >> (block % 8)) & 1) return 0;
+    return !((__atomic_load_n(&ctx->image_data[block / 64], __ATOMIC_RELAXED) >> (block % 64)) & 1);
+}
+
+// Whether a whole run of blocks lies in holes
+int run_in_hole(uint32_t block, uint32_t count) {
+    if (!ctx->image_data) return 0;
+    for (uint32_t k = 0; k < count; k++) {
+        if (!block_in_hole(block + k)) return 0;
+    }
+    return 1;
+}
+
+// Answer a run of blocks in holes with zeros
+void read_hole(uint32_t count, void *buffer) {
+    memset(buffer, 0, (size_t)count * BLOCK_SIZE);
+    __atomic_fetch_add(&ctx->stats.hole_blocks, count, __ATOMIC_RELAXED);
+}
+
+// Blocks written to the image hold data from now on
+void note_written(uint32_t block_num, uint32_t count) {
+    if (!ctx->image_data) return;
+    for (uint64_t block = block_num; block < (uint64_t)block_num + count && block < ctx->image_blocks; block++) {
+        __atomic_fetch_or(&ctx->image_data[block / 64], 1ULL << (block % 64), __ATOMIC_RELAXED);
+    }
+}
 
 // Write block to file system image
 int write_block(uint32_t block_num, void *buffer) {
-    off_t offset = block_num * BLOCK_SIZE;
-    if (lseek(fd, offset, SEEK_SET) == -1) return -1;
-    return write(fd, buffer, BLOCK_SIZE);
+    ssize_t n = pwrite(ctx->fd, buffer, BLOCK_SIZE, (off_t)block_num * BLOCK_SIZE);
+    count_syscall();
+    count_transfer(1, n, 1);
+    note_written(block_num, 1);
+    return n;
 }
 
 // Read block from file system image
 int read_block(uint32_t block_num, void *buffer) {
-    off_t offset = block_num * BLOCK_SIZE;
-    if (lseek(fd, offset, SEEK_SET) == -1) return -1;
-    return read(fd, buffer, BLOCK_SIZE);
+    if (block_in_hole(block_num)) {
+        read_hole(1, buffer);
+        return BLOCK_SIZE;
+    }
+    ssize_t n = pread(ctx->fd, buffer, BLOCK_SIZE, (off_t)block_num * BLOCK_SIZE);
+    count_syscall();
+    count_transfer(0, n, 1);
+    return n;
+}
+
+// Read a run of consecutive blocks that holds data
+int read_data_blocks(uint32_t block_num, uint32_t count, void *buffer) {
+    off_t offset = (off_t)block_num * BLOCK_SIZE;
+    size_t len = (size_t)count * BLOCK_SIZE;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(ctx->fd, (uint8_t *)buffer + done, len - done, offset + done);
+        count_syscall();
+        count_transfer(0, n, 1);
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+// Read a run of consecutive blocks from file system image, one pread per
+// stretch of data and none for the stretches in holes
+int read_blocks(uint32_t block_num, uint32_t count, void *buffer) {
+    if (!ctx->image_data) return read_data_blocks(block_num, count, buffer);
+    uint8_t *out = buffer;
+    while (count > 0) {
+        int hole = block_in_hole(block_num);
+        uint32_t n = 1;
+        while (n < count && block_in_hole(block_num + n) == hole) n++;
+        if (hole) read_hole(n, out);
+        else if (read_data_blocks(block_num, n, out) < 0) return -1;
+        block_num += n;
+        count -= n;
+        out += (size_t)n * BLOCK_SIZE;
+    }
+    return 0;
+}
+
+// Write a run of consecutive blocks to file system image
+int write_blocks(uint32_t block_num, uint32_t count, void *buffer) {
+    off_t offset = (off_t)block_num * BLOCK_SIZE;
+    size_t len = (size_t)count * BLOCK_SIZE;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(ctx->fd, (uint8_t *)buffer + done, len - done, offset + done);
+        count_syscall();
+        count_transfer(1, n, 1);
+        if (n <= 0) return -1;
+        done += n;
+    }
+    note_written(block_num, count);
+    return 0;
+}
+
+// Map the whole image so metadata can be checked and repaired in place. A
+// private mapping keeps repairs off the image until they are written back.
+int map_image() {
+    ctx->image_map_len = (size_t)ctx->image_blocks * BLOCK_SIZE;
+    int flags = ctx->map_private ? MAP_PRIVATE : MAP_SHARED;
+    ctx->image_map = mmap(NULL, ctx->image_map_len, PROT_READ | PROT_WRITE, flags, ctx->fd, 0);
+    count_syscall();
+    if (ctx->image_map == MAP_FAILED) {
+        ctx->image_map = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Unmap the image mapped by map_image; a memory image is only let go
+void unmap_image() {
+    if (ctx->image_map && !ctx->image_in_memory) munmap(ctx->image_map, ctx->image_map_len);
+    ctx->image_map = NULL;
+}
+
+// Address of a block inside the image mapping
+uint8_t *mapped_block(uint32_t block_num) {
+    return ctx->image_map + (size_t)block_num * BLOCK_SIZE;
+}
+
+// Give the kernel an access hint for a run of mapped blocks
+void advise_blocks(uint32_t block_num, uint32_t count, int advice) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = (size_t)block_num * BLOCK_SIZE;
+    size_t end = start + (size_t)count * BLOCK_SIZE;
+    start -= start % page;
+    count_syscall();
+    madvise(ctx->image_map + start, end - start, advice);
+}
+
+// Flush a run of mapped blocks to the image
+int sync_blocks(uint32_t block_num, uint32_t count) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = (size_t)block_num * BLOCK_SIZE;
+    size_t end = start + (size_t)count * BLOCK_SIZE;
+    start -= start % page;
+    count_syscall();
+    return msync(ctx->image_map + start, end - start, MS_SYNC);
+}
+
+// Map the rings of a new io_uring instance with room for queue_depth reads
+int uring_open() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ring_fd = syscall(__NR_io_uring_setup, ctx->queue_depth, &params);
+    if (ring_fd < 0) return -1;
+
+    Uring *u = &ctx->uring;
+    u->fd = ring_fd;
+    u->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    u->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_len > u->sq_len) u->sq_len = u->cq_len;
+        u->cq_len = u->sq_len;
+    }
+    u->sq_ring = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    u->cq_ring = u->sq_ring;
+    if (u->sq_ring != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        u->cq_ring = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    }
+    u->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+        if (u->sqes != MAP_FAILED) munmap(u->sqes, u->sqes_len);
+        if (u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring) munmap(u->cq_ring, u->cq_len);
+        if (u->sq_ring != MAP_FAILED) munmap(u->sq_ring, u->sq_len);
+        close(ring_fd);
+        memset(u, 0, sizeof(*u));
+        return -1;
+    }
+
+    uint8_t *sq = u->sq_ring, *cq = u->cq_ring;
+    u->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + params.sq_off.array);
+    u->cq_head = (unsigned *)(cq + params.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+// Tear down the io_uring instance
+void uring_close() {
+    Uring *u = &ctx->uring;
+    munmap(u->sqes, u->sqes_len);
+    if (u->cq_ring != u->sq_ring) munmap(u->cq_ring, u->cq_len);
+    munmap(u->sq_ring, u->sq_len);
+    close(u->fd);
+    memset(u, 0, sizeof(*u));
+}
+
+// Queue a read for a slot; it is submitted with the next wait
+void uring_submit(ReadSlot *slot) {
+    Uring *u = &ctx->uring;
+    unsigned tail = *u->sq_tail;
+    unsigned index = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = ctx->fd;
+    sqe->off = (uint64_t)slot->block * BLOCK_SIZE;
+    sqe->addr = (uint64_t)(uintptr_t)slot->buffer;
+    sqe->len = slot->count * BLOCK_SIZE;
+    sqe->user_data = (uint64_t)(uintptr_t)slot;
+    u->sq_array[index] = index;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->unsubmitted++;
+}
+
+// Submit queued reads and reap completions until the slot has finished.
+// Failed or short reads (or kernels without IORING_OP_READ) are redone
+// with pread.
+void uring_wait(ReadSlot *slot) {
+    Uring *u = &ctx->uring;
+    while (slot->status == 0) {
+        unsigned head = *u->cq_head;
+        unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail || u->unsubmitted > 0) {
+            int n = syscall(__NR_io_uring_enter, u->fd, u->unsubmitted, head == tail ? 1 : 0, IORING_ENTER_GETEVENTS, NULL, 0);
+            count_syscall();
+            if (n >= 0) {
+                u->unsubmitted -= n;
+            } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                // The ring is unusable: finish this read synchronously
+                slot->status = read_blocks(slot->block, slot->count, slot->buffer) < 0 ? -1 : 1;
+                return;
+            }
+            continue;
+        }
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+            ReadSlot *done = (ReadSlot *)(uintptr_t)cqe->user_data;
+            if (cqe->res == (int)(done->count * BLOCK_SIZE)) {
+                count_transfer(0, cqe->res, 1);
+                done->status = 1;
+            } else {
+                done->status = read_blocks(done->block, done->count, done->buffer) < 0 ? -1 : 1;
+            }
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+// Thread pool worker: take queued slots and read them with pread
+void *pool_worker(void *arg) {
+    ctx = arg;
+    pthread_mutex_lock(&ctx->pool.lock);
+    for (;;) {
+        while (!ctx->pool.stop && ctx->pool.head == ctx->pool.tail) pthread_cond_wait(&ctx->pool.work, &ctx->pool.lock);
+        if (ctx->pool.head == ctx->pool.tail) break;
+        ReadSlot *slot = ctx->pool.queue[ctx->pool.head++ % MAX_QUEUE_DEPTH];
+        pthread_mutex_unlock(&ctx->pool.lock);
+
+        int status = read_blocks(slot->block, slot->count, slot->buffer) < 0 ? -1 : 1;
+
+        pthread_mutex_lock(&ctx->pool.lock);
+        slot->status = status;
+        pthread_cond_broadcast(&ctx->pool.done);
+    }
+    pthread_mutex_unlock(&ctx->pool.lock);
+    return NULL;
+}
+
+// Start the pread thread pool
+int pool_open() {
+    pthread_mutex_init(&ctx->pool.lock, NULL);
+    pthread_cond_init(&ctx->pool.work, NULL);
+    pthread_cond_init(&ctx->pool.done, NULL);
+    ctx->pool.threads = ctx->queue_depth < POOL_THREADS ? ctx->queue_depth : POOL_THREADS;
+    for (int t = 0; t < ctx->pool.threads; t++) {
+        if (pthread_create(&ctx->pool.thread[t], NULL, pool_worker, ctx) != 0) {
+            ctx->pool.threads = t;
+            break;
+        }
+    }
+    return ctx->pool.threads > 0 ? 0 : -1;
+}
+
+// Stop the pool once its queue has drained
+void pool_close() {
+    pthread_mutex_lock(&ctx->pool.lock);
+    ctx->pool.stop = 1;
+    pthread_cond_broadcast(&ctx->pool.work);
+    pthread_mutex_unlock(&ctx->pool.lock);
+    for (int t = 0; t < ctx->pool.threads; t++) pthread_join(ctx->pool.thread[t], NULL);
+    pthread_mutex_destroy(&ctx->pool.lock);
+    pthread_cond_destroy(&ctx->pool.work);
+    pthread_cond_destroy(&ctx->pool.done);
+    memset(&ctx->pool, 0, sizeof(ctx->pool));
+}
+
+// Start the asynchronous reader, falling back from io_uring to the thread
+// pool and from the pool to plain synchronous reads. The reader stays up
+// for the context's later images.
+void reader_open() {
+    if (ctx->reader_ready) return;
+    if (ctx->io_backend == IO_URING && uring_open() < 0) ctx->io_backend = IO_THREADS;
+    if (ctx->io_backend == IO_THREADS && pool_open() < 0) ctx->io_backend = IO_SYNC;
+    ctx->reader_ready = 1;
+}
+
+// Stop the reader; callers wait for their slots first
+void reader_close() {
+    if (ctx->io_backend == IO_URING && ctx->uring.sq_ring) uring_close();
+    if (ctx->io_backend == IO_THREADS && ctx->pool.threads) pool_close();
+    ctx->reader_ready = 0;
+}
+
+// Start reading a slot's blocks into its buffer. A run that lies wholly in
+// holes is answered at once.
+void reader_submit(ReadSlot *slot) {
+    slot->status = 0;
+    if (run_in_hole(slot->block, slot->count)) {
+        read_hole(slot->count, slot->buffer);
+        slot->status = 1;
+    } else if (ctx->io_backend == IO_URING) {
+        uring_submit(slot);
+    } else if (ctx->io_backend == IO_THREADS) {
+        pthread_mutex_lock(&ctx->pool.lock);
+        ctx->pool.queue[ctx->pool.tail++ % MAX_QUEUE_DEPTH] = slot;
+        pthread_cond_signal(&ctx->pool.work);
+        pthread_mutex_unlock(&ctx->pool.lock);
+    } else {
+        slot->status = read_blocks(slot->block, slot->count, slot->buffer) < 0 ? -1 : 1;
+    }
+}
+
+// Wait for a submitted slot; returns 0 once its blocks are in the buffer
+int reader_wait(ReadSlot *slot) {
+    if (ctx->io_backend == IO_URING) {
+        uring_wait(slot);
+    } else if (ctx->io_backend == IO_THREADS) {
+        pthread_mutex_lock(&ctx->pool.lock);
+        while (slot->status == 0) pthread_cond_wait(&ctx->pool.done, &ctx->pool.lock);
+        pthread_mutex_unlock(&ctx->pool.lock);
+    }
+    return slot->status > 0 ? 0 : -1;
+}
+
+// Size of the image in blocks (regular file or block device)
+int get_image_blocks(uint64_t *blocks) {
+    struct stat st;
+    uint64_t bytes;
+    if (fstat(ctx->fd, &st) < 0) return -1;
+    if (S_ISBLK(st.st_mode)) {
+        if (ioctl(ctx->fd, BLKGETSIZE64, &bytes) < 0) return -1;
+    } else {
+        bytes = st.st_size;
+    }
+    *blocks = bytes / BLOCK_SIZE;
+    return 0;
+}
+
+// Number of blocks needed for a bitmap with the given number of bits
+uint32_t bitmap_blocks_for(uint32_t bits) {
+    uint32_t blocks = (uint32_t)(((uint64_t)bits + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK);
+    return blocks ? blocks : 1;
+}
+
+// Number of blocks needed for an inode table with the given number of inodes
+uint32_t inode_table_blocks_for(uint32_t count) {
+    return (uint32_t)(((uint64_t)count + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK);
+}
+
+// Largest total block count the image can back
+uint32_t image_total_blocks() {
+    return ctx->image_blocks > UINT32_MAX ? UINT32_MAX : (uint32_t)ctx->image_blocks;
+}
+
+// Check total block count against the image size
+int total_blocks_valid(Superblock *sb) {
+    return sb->total_blocks >= MIN_TOTAL_BLOCKS && sb->total_blocks <= ctx->image_blocks;
+}
+
+// Lay out bitmaps, inode table and data region back to back after the superblock
+void default_layout(Superblock *sb) {
+    sb->inode_bitmap_block = INODE_BITMAP_BLOCK;
+    sb->data_bitmap_block = sb->inode_bitmap_block + bitmap_blocks_for(sb->inode_count);
+    sb->inode_table_start = sb->data_bitmap_block + bitmap_blocks_for(sb->total_blocks);
+    sb->first_data_block = sb->inode_table_start + inode_table_blocks_for(sb->inode_count);
+}
+
+// Largest inode count whose default layout leaves at least one data block
+uint32_t max_inode_count(uint32_t total_blocks) {
+    uint64_t meta = 1 + (uint64_t)INODE_BITMAP_BLOCK + bitmap_blocks_for(total_blocks) + 1;
+    if (total_blocks <= meta) return 0;
+    uint64_t table = total_blocks - meta;
+    uint64_t count = table * INODES_PER_BLOCK;
+    if (count > UINT32_MAX) count = UINT32_MAX;
+    while (count > 0 && (uint64_t)bitmap_blocks_for(count) + inode_table_blocks_for(count) > table + 1) {
+        count -= count > INODES_PER_BLOCK ? INODES_PER_BLOCK : count;
+    }
+    return (uint32_t)count;
+}
+
+// Validity of each layout field given the fields before it
+int inode_bitmap_valid(Superblock *sb, uint32_t total) {
+    return sb->inode_bitmap_block >= INODE_BITMAP_BLOCK &&
+           (uint64_t)sb->inode_bitmap_block + bitmap_blocks_for(sb->inode_count) <= total;
+}
+
+int data_bitmap_valid(Superblock *sb, uint32_t total) {
+    return sb->data_bitmap_block >= (uint64_t)sb->inode_bitmap_block + bitmap_blocks_for(sb->inode_count) &&
+           (uint64_t)sb->data_bitmap_block + bitmap_blocks_for(total) <= total;
+}
+
+int inode_table_valid(Superblock *sb, uint32_t total) {
+    return sb->inode_table_start >= (uint64_t)sb->data_bitmap_block + bitmap_blocks_for(total) &&
+           sb->inode_table_start < total;
+}
+
+int first_data_valid(Superblock *sb, uint32_t total) {
+    return sb->first_data_block > sb->inode_table_start && sb->first_data_block < total;
+}
+
+// Inodes that fit between the inode table start and the first data block
+uint32_t inode_table_capacity(Superblock *sb, uint32_t total) {
+    if (!inode_table_valid(sb, total) || !first_data_valid(sb, total)) return max_inode_count(total);
+    uint64_t capacity = (uint64_t)(sb->first_data_block - sb->inode_table_start) * INODES_PER_BLOCK;
+    return capacity > UINT32_MAX ? UINT32_MAX : (uint32_t)capacity;
+}
+
+// Take the image geometry from a validated superblock
+void load_geometry(Superblock *sb) {
+    ctx->geo.total_blocks = sb->total_blocks;
+    ctx->geo.inode_count = sb->inode_count;
+    ctx->geo.inode_bitmap_block = sb->inode_bitmap_block;
+    ctx->geo.inode_bitmap_blocks = bitmap_blocks_for(sb->inode_count);
+    ctx->geo.data_bitmap_block = sb->data_bitmap_block;
+    ctx->geo.data_bitmap_blocks = bitmap_blocks_for(sb->total_blocks);
+    ctx->geo.inode_table_start = sb->inode_table_start;
+    ctx->geo.inode_table_blocks = inode_table_blocks_for(sb->inode_count);
+    ctx->geo.first_data_block = sb->first_data_block;
+}
+
+// Number of 64-bit words in a per-block reference bitset
+size_t reference_words() {
+    return ((size_t)ctx->geo.total_blocks + 63) / 64;
+}
+
+// A reused buffer of at least len bytes. Its contents are not kept when it
+// has to grow.
+void *reserve(Buffer *buffer, size_t len) {
+    if (buffer->size < len) {
+        free(buffer->data);
+        buffer->data = malloc(len);
+        buffer->size = buffer->data ? len : 0;
+    }
+    return buffer->data;
+}
+
+// Release a reused buffer
+void release(Buffer *buffer) {
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->size = 0;
+}
+
+// Set up bitmaps, inode table and reference bitsets sized for the geometry,
+// in the context's buffers from earlier images where they are big enough
+int alloc_tables() {
+    size_t words = reference_words() * sizeof(uint64_t);
+    ctx->block_seen = reserve(&ctx->seen_buffer, words);
+    ctx->block_shared = reserve(&ctx->shared_buffer, words);
+    ctx->dirty_blocks = reserve(&ctx->dirty_buffer, (ctx->geo.total_blocks + 7) / 8);
+    if (!ctx->block_seen || !ctx->block_shared || !ctx->dirty_blocks) return -1;
+    memset(ctx->block_seen, 0, words);
+    memset(ctx->block_shared, 0, words);
+    memset(ctx->dirty_blocks, 0, (ctx->geo.total_blocks + 7) / 8);
+
+    // Mapped images are checked in place, no copies needed
+    if (ctx->image_map) {
+        ctx->inode_bitmap = mapped_block(ctx->geo.inode_bitmap_block);
+        ctx->data_bitmap = mapped_block(ctx->geo.data_bitmap_block);
+        ctx->inodes = (Inode *)mapped_block(ctx->geo.inode_table_start);
+        if (ctx->image_in_memory) return 0;
+        advise_blocks(ctx->geo.inode_bitmap_block, ctx->geo.inode_bitmap_blocks, MADV_WILLNEED);
+        advise_blocks(ctx->geo.data_bitmap_block, ctx->geo.data_bitmap_blocks, MADV_WILLNEED);
+        advise_blocks(ctx->geo.inode_table_start, ctx->geo.inode_table_blocks, MADV_SEQUENTIAL);
+        return 0;
+    }
+
+    size_t table_blocks = ctx->geo.inode_table_blocks ? ctx->geo.inode_table_blocks : 1;
+    ctx->inode_bitmap = reserve(&ctx->inode_bitmap_buffer, (size_t)ctx->geo.inode_bitmap_blocks * BLOCK_SIZE);
+    ctx->data_bitmap = reserve(&ctx->data_bitmap_buffer, (size_t)ctx->geo.data_bitmap_blocks * BLOCK_SIZE);
+    ctx->inodes = reserve(&ctx->inode_buffer, table_blocks * BLOCK_SIZE);
+    if (!ctx->inode_bitmap || !ctx->data_bitmap || !ctx->inodes) return -1;
+    return 0;
+}
+
+// Drop what alloc_tables and the check set up for one image. The reused
+// buffers and the pointer block and tree record arrays stay with the context.
+void free_tables() {
+    free(ctx->owner_range);
+    ctx->owner_range = NULL;
+    for (size_t k = 0; k < ctx->pointer_block_count; k++) {
+        if (!ctx->image_map) free(ctx->pointer_blocks[k].data);
+    }
+    ctx->pointer_block_count = 0;
+    free(ctx->indirect_refs.refs);
+    ctx->indirect_refs = (RefList){ 0 };
+    ctx->clones.count = 0;
+    ctx->tree_record_count = 0;
+    free(ctx->link_counts);
+    ctx->link_counts = NULL;
+}
+
+// Queue the next inode table chunk into its slot
+void submit_table_chunk() {
+    uint32_t chunk = ctx->table_submitted++;
+    uint32_t first = chunk * TABLE_CHUNK_BLOCKS;
+    ReadSlot *slot = &ctx->table_slots[chunk % ctx->queue_depth];
+    slot->block = ctx->geo.inode_table_start + first;
+    uint32_t left = ctx->geo.inode_table_blocks - first;
+    slot->count = left < TABLE_CHUNK_BLOCKS ? left : TABLE_CHUNK_BLOCKS;
+    slot->buffer = (uint8_t *)ctx->inodes + (size_t)first * BLOCK_SIZE;
+    reader_submit(slot);
+}
+
+// Start reading the inode table in chunks, queue_depth chunks ahead of the scan
+int start_table_reads() {
+    ctx->table_chunks = (ctx->geo.inode_table_blocks + TABLE_CHUNK_BLOCKS - 1) / TABLE_CHUNK_BLOCKS;
+    ctx->table_submitted = ctx->table_completed = 0;
+    ctx->table_slots = calloc(ctx->queue_depth, sizeof(ReadSlot));
+    if (!ctx->table_slots) return -1;
+    while (ctx->table_submitted < ctx->table_chunks && ctx->table_submitted < (uint32_t)ctx->queue_depth) {
+        submit_table_chunk();
+    }
+    return 0;
+}
+
+// Wait until inodes [0, last) are in memory. Each finished chunk hands its
+// slot to the next chunk still to be read. An unreadable chunk is zeroed and
+// flagged so no repair is written.
+void wait_table_reads(uint32_t last) {
+    uint64_t blocks = inode_table_blocks_for(last);
+    while (ctx->table_slots && (uint64_t)ctx->table_completed * TABLE_CHUNK_BLOCKS < blocks) {
+        ReadSlot *slot = &ctx->table_slots[ctx->table_completed % ctx->queue_depth];
+        if (reader_wait(slot) < 0) {
+            ctx->read_failed = 1;
+            memset(slot->buffer, 0, (size_t)slot->count * BLOCK_SIZE);
+        }
+        ctx->table_completed++;
+        if (ctx->table_submitted < ctx->table_chunks) submit_table_chunk();
+    }
+    if (ctx->table_slots && ctx->table_completed == ctx->table_chunks) {
+        free(ctx->table_slots);
+        ctx->table_slots = NULL;
+    }
+}
+
+// Read bitmaps and inode table from the image
+int read_tables() {
+    if (ctx->image_map) return 0;
+    if (read_blocks(ctx->geo.inode_bitmap_block, ctx->geo.inode_bitmap_blocks, ctx->inode_bitmap) < 0 ||
+        read_blocks(ctx->geo.data_bitmap_block, ctx->geo.data_bitmap_blocks, ctx->data_bitmap) < 0) {
+        perror("Failed to read bitmaps");
+        return -1;
+    }
+    // The inode table streams in while the scan runs
+    if (start_table_reads() == 0) return 0;
+    if (read_blocks(ctx->geo.inode_table_start, ctx->geo.inode_table_blocks, ctx->inodes) < 0) {
+        perror("Failed to read inode table");
+        return -1;
+    }
+    return 0;
 }
 
 // Fix superblock
 int fix_superblock(Superblock *sb) {
     int fixes = 0;
     if (sb->magic != MAGIC_NUMBER) {
-        printf("Fixing superblock: Setting magic number to 0x%04x\n", MAGIC_NUMBER);
+        report(FIX_SB_MAGIC, 0, 0, 0, MAGIC_NUMBER, sb->magic);
         sb->magic = MAGIC_NUMBER;
         fixes++;
     }
     if (sb->block_size != BLOCK_SIZE) {
-        printf("Fixing superblock: Setting block size to %u\n", BLOCK_SIZE);
+        report(FIX_SB_BLOCK_SIZE, 0, 0, 0, BLOCK_SIZE, sb->block_size);
         sb->block_size = BLOCK_SIZE;
         fixes++;
     }
-    if (sb->total_blocks != TOTAL_BLOCKS) {
-        printf("Fixing superblock: Setting total blocks to %u\n", TOTAL_BLOCKS);
-        sb->total_blocks = TOTAL_BLOCKS;
+    if (!total_blocks_valid(sb)) {
+        report(FIX_SB_TOTAL_BLOCKS, 0, 0, 0, image_total_blocks(), sb->total_blocks);
+        sb->total_blocks = image_total_blocks();
         fixes++;
     }
-    if (sb->inode_bitmap_block != INODE_BITMAP_BLOCK) {
-        printf("Fixing superblock: Setting inode bitmap block to %u\n", INODE_BITMAP_BLOCK);
-        sb->inode_bitmap_block = INODE_BITMAP_BLOCK;
+    if (sb->inode_size != INODE_SIZE) {
+        report(FIX_SB_INODE_SIZE, 0, 0, 0, INODE_SIZE, sb->inode_size);
+        sb->inode_size = INODE_SIZE;
         fixes++;
     }
-    if (sb->data_bitmap_block != DATA_BITMAP_BLOCK) {
-        printf("Fixing superblock: Setting data bitmap block to %u\n", DATA_BITMAP_BLOCK);
-        sb->data_bitmap_block = DATA_BITMAP_BLOCK;
+
+    uint32_t total = sb->total_blocks;
+    if (inode_bitmap_valid(sb, total) && data_bitmap_valid(sb, total) &&
+        inode_table_valid(sb, total) && first_data_valid(sb, total)) {
+        uint32_t capacity = inode_table_capacity(sb, total);
+        if (sb->inode_count > capacity) {
+            report(FIX_SB_INODE_COUNT, 0, 0, 0, capacity, sb->inode_count);
+            sb->inode_count = capacity;
+            fixes++;
+        }
+        return fixes;
+    }
+
+    // Layout is inconsistent: fall back to the default layout for this size
+    Superblock layout = *sb;
+    if (layout.inode_count > max_inode_count(total)) {
+        layout.inode_count = max_inode_count(total);
+        report(FIX_SB_INODE_COUNT, 0, 0, 0, layout.inode_count, sb->inode_count);
         fixes++;
     }
-    if (sb->inode_table_start != INODE_TABLE_START) {
-        printf("Fixing superblock: Setting inode table start to %u\n", INODE_TABLE_START);
-        sb->inode_table_start = INODE_TABLE_START;
+    default_layout(&layout);
+    if (sb->inode_bitmap_block != layout.inode_bitmap_block) {
+        report(FIX_SB_INODE_BITMAP, 0, 0, 0, layout.inode_bitmap_block, sb->inode_bitmap_block);
         fixes++;
     }
-    if (sb->first_data_block != DATA_BLOCK_START) {
-        printf("Fixing superblock: Setting first data block to %u\n", DATA_BLOCK_START);
-        sb->first_data_block = DATA_BLOCK_START;
+    if (sb->data_bitmap_block != layout.data_bitmap_block) {
+        report(FIX_SB_DATA_BITMAP, 0, 0, 0, layout.data_bitmap_block, sb->data_bitmap_block);
         fixes++;
     }
-    if (sb->inode_size != INODE_SIZE) {
-        printf("Fixing superblock: Setting inode size to %u\n", INODE_SIZE);
-        sb->inode_size = INODE_SIZE;
+    if (sb->inode_table_start != layout.inode_table_start) {
+        report(FIX_SB_INODE_TABLE, 0, 0, 0, layout.inode_table_start, sb->inode_table_start);
         fixes++;
     }
-    if (sb->inode_count > INODE_COUNT) {
-        printf("Fixing superblock: Setting inode count to %u\n", INODE_COUNT);
-        sb->inode_count = INODE_COUNT;
+    if (sb->first_data_block != layout.first_data_block) {
+        report(FIX_SB_FIRST_DATA, 0, 0, 0, layout.first_data_block, sb->first_data_block);
         fixes++;
     }
+    *sb = layout;
     return fixes;
 }
 
@@ -124,39 +1276,42 @@ int fix_superblock(Superblock *sb) {
 int validate_superblock(Superblock *sb) {
     int errors = 0;
     if (sb->magic != MAGIC_NUMBER) {
-        printf("Superblock: Invalid magic number (0x%04x stimulus artifact, expected 0x%04x)\n", sb->magic, MAGIC_NUMBER);
+        report(FINDING_SB_MAGIC, 0, 0, 0, MAGIC_NUMBER, sb->magic);
         errors++;
     }
     if (sb->block_size != BLOCK_SIZE) {
-        printf("Superblock: Invalid block size (%u, expected %u)\n", sb->block_size, BLOCK_SIZE);
+        report(FINDING_SB_BLOCK_SIZE, 0, 0, 0, BLOCK_SIZE, sb->block_size);
         errors++;
     }
-    if (sb->total_blocks != TOTAL_BLOCKS) {
-        printf("Superblock: Invalid total blocks (%u, expected %u)\n", sb->total_blocks, TOTAL_BLOCKS);
+    if (!total_blocks_valid(sb)) {
+        report(FINDING_SB_TOTAL_BLOCKS, 0, 0, 0, ctx->image_blocks, sb->total_blocks);
         errors++;
     }
-    if (sb->inode_bitmap_block != INODE_BITMAP_BLOCK) {
-        printf("Superblock: Invalid inode bitmap block (%u, expected %u)\n", sb->inode_bitmap_block, INODE_BITMAP_BLOCK);
+
+    // Check the layout against the block count the image can actually back
+    uint32_t total = total_blocks_valid(sb) ? sb->total_blocks : image_total_blocks();
+    if (!inode_bitmap_valid(sb, total)) {
+        report(FINDING_SB_INODE_BITMAP, 0, 0, 0, 0, sb->inode_bitmap_block);
         errors++;
     }
-    if (sb->data_bitmap_block != DATA_BITMAP_BLOCK) {
-        printf("Superblock: Invalid data bitmap block (%u, expected %u)\n", sb->data_bitmap_block, DATA_BITMAP_BLOCK);
+    if (!data_bitmap_valid(sb, total)) {
+        report(FINDING_SB_DATA_BITMAP, 0, 0, 0, 0, sb->data_bitmap_block);
         errors++;
     }
-    if (sb->inode_table_start != INODE_TABLE_START) {
-        printf("Superblock: Invalid inode table start (%u, expected %u)\n", sb->inode_table_start, INODE_TABLE_START);
+    if (!inode_table_valid(sb, total)) {
+        report(FINDING_SB_INODE_TABLE, 0, 0, 0, 0, sb->inode_table_start);
         errors++;
     }
-    if (sb->first_data_block != DATA_BLOCK_START) {
-        printf("Superblock: Invalid first data block (%u, expected %u)\n", sb->first_data_block, DATA_BLOCK_START);
+    if (!first_data_valid(sb, total)) {
+        report(FINDING_SB_FIRST_DATA, 0, 0, 0, total, sb->first_data_block);
         errors++;
     }
     if (sb->inode_size != INODE_SIZE) {
-        printf("Superblock: Invalid inode size (%u, expected %u)\n", sb->inode_size, INODE_SIZE);
+        report(FINDING_SB_INODE_SIZE, 0, 0, 0, INODE_SIZE, sb->inode_size);
         errors++;
     }
-    if (sb->inode_count > INODE_COUNT) {
-        printf("Superblock: Invalid inode count (%u, max %u)\n", sb->inode_count, INODE_COUNT);
+    if (sb->inode_count > inode_table_capacity(sb, total)) {
+        report(FINDING_SB_INODE_COUNT, 0, 0, 0, inode_table_capacity(sb, total), sb->inode_count);
         errors++;
     }
     return errors;
@@ -176,322 +1331,3272 @@ void set_bitmap_bit(uint8_t *bitmap, uint32_t block, int value) {
     }
 }
 
-// Count references to data blocks from an inode
-void count_block_references(Inode *inode, uint32_t inode_num) {
-    for (int i = 0; i < 12; i++) {
-        if (inode->direct[i] >= TOTAL_BLOCKS) {
-            printf("Inode %u: Invalid direct block pointer %u\n",(inode_num), inode->direct[i]);
-        } else if (inode->direct[i] >= DATA_BLOCK_START) {
-            block_references[inode->direct[i]]++;
-        }
-    }
+// Test, set and clear bits of the 64-bit reference bitsets
+int test_bit64(uint64_t *bits, uint32_t bit) {
+    return (bits[bit / 64] >> (bit % 64)) & 1;
 }
 
-// Fix inode and data bitmap consistency
-int fix_bitmaps() {
-    int fixes = 0;
-    
-    // Fix inode bitmap
-    for (uint32_t i = 0; i < INODE_COUNT; i++) {
-        int marked = is_block_marked(inode_bitmap, i);
-        int valid = (inodes[i].links_count > 0 && inodes[i].dtime == 0);
-        
-        if (marked && !valid) {
-            printf("Fixing inode %u: Clearing bitmap bit (invalid inode)\n", i);
-            set_bitmap_bit(inode_bitmap, i, 0);
-            fixes++;
-        }
-        if (valid && !marked) {
-            printf("Fixing inode %u: Setting bitmap bit (valid inode)\n", i);
-            set_bitmap_bit(inode_bitmap, i, 1);
-            fixes++;
-        }
-    }
-    
-    // Recount block references
-    memset(block_references, 0, sizeof(block_references));
-    for (uint32_t i = 0; i < INODE_COUNT; i++) {
-        if (inodes[i].links_count > 0 && inodes[i].dtime == 0) {
-            count_block_references(&inodes[i], i);
-        }
-    }
-    
-    // Fix data bitmap
-    for (uint32_t i = DATA_BLOCK_START; i < TOTAL_BLOCKS; i++) {
-        int marked = is_block_marked(data_bitmap, i);
-        int referenced = block_references[i] > 0;
-        
-        if (marked && !referenced) {
-            printf("Fixing data block %u: Clearing bitmap bit (unreferenced)\n", i);
-            set_bitmap_bit(data_bitmap, i, 0);
-            fixes++;
-        }
-        if (referenced && !marked) {
-            printf("Fixing data block %u: Setting bitmap bit (referenced)\n", i);
-            set_bitmap_bit(data_bitmap, i, 1);
-            fixes++;
+void set_bit64(uint64_t *bits, uint32_t bit) {
+    bits[bit / 64] |= 1ULL << (bit % 64);
+}
+
+void clear_bit64(uint64_t *bits, uint32_t bit) {
+    bits[bit / 64] &= ~(1ULL << (bit % 64));
+}
+
+// 64 bits of an on-disk bitmap, bit n of the word being bit n of the word's bytes
+uint64_t bitmap_word(uint8_t *bitmap, uint64_t word) {
+    uint64_t value;
+    memcpy(&value, bitmap + word * 8, sizeof(value));
+    return le64toh(value);
+}
+
+// Bits of a word that fall inside [first, last)
+uint64_t range_mask(uint64_t word, uint64_t first, uint64_t last) {
+    uint64_t mask = ~0ULL;
+    if (first > word * 64) mask &= ~0ULL << (first - word * 64);
+    if (last < word * 64 + 64) mask &= ~0ULL >> (word * 64 + 64 - last);
+    return mask;
+}
+
+// Remember that a block was modified and must reach the image
+void mark_block_dirty(uint32_t block) {
+    // Scan workers share bytes of the dirty bitmap
+    __atomic_fetch_or(&ctx->dirty_blocks[block / 8], (uint8_t)(1 << (block % 8)), __ATOMIC_RELAXED);
+}
+
+// Mark the inode table block holding an inode as modified
+void mark_inode_dirty(uint32_t inode_num) {
+    mark_block_dirty(ctx->geo.inode_table_start + inode_num / INODES_PER_BLOCK);
+}
+
+// Mark the bitmap block holding a bit as modified
+void mark_bitmap_dirty(uint32_t bitmap_block, uint32_t bit) {
+    mark_block_dirty(bitmap_block + bit / BITS_PER_BLOCK);
+}
+
+// First block marked in a bitmap at or after a block, or end if none
+uint32_t next_marked_block(uint8_t *bitmap, uint32_t block, uint32_t end) {
+    while (block < end) {
+        if (bitmap[block / 8] == 0) {
+            block = (block / 8 + 1) * 8;
+            continue;
+        }
+        if (is_block_marked(bitmap, block)) return block;
+        block++;
+    }
+    return end;
+}
+
+// First dirty block at or after a block, or total_blocks if none
+uint32_t next_dirty_block(uint32_t block) {
+    return next_marked_block(ctx->dirty_blocks, block, ctx->geo.total_blocks);
+}
+
+// Flush runs of dirty mapped blocks with one msync per run
+int sync_dirty_blocks() {
+    uint32_t block = next_dirty_block(0);
+    while (block < ctx->geo.total_blocks) {
+        uint32_t start = block;
+        while (block < ctx->geo.total_blocks && is_block_marked(ctx->dirty_blocks, block)) block++;
+        if (sync_blocks(start, block - start) < 0) return -1;
+        block = next_dirty_block(block);
+    }
+    return 0;
+}
+
+// Compare pointer blocks by block number
+int compare_pointer_blocks(const void *a, const void *b) {
+    uint32_t x = ((const PointerBlock *)a)->block, y = ((const PointerBlock *)b)->block;
+    return x < y ? -1 : x > y;
+}
+
+// Repaired pointer block by block number, or NULL
+PointerBlock *find_pointer_block(uint32_t block) {
+    PointerBlock key = { .block = block };
+    if (ctx->pointer_block_count == 0) return NULL;
+    return bsearch(&key, ctx->pointer_blocks, ctx->pointer_block_count, sizeof(PointerBlock), compare_pointer_blocks);
+}
+
+// In-memory copy of a metadata block, or NULL if it is not held
+uint8_t *cached_block(uint32_t block) {
+    if (ctx->image_map) return mapped_block(block);
+    if (block == SUPERBLOCK_BLOCK) return (uint8_t *)ctx->superblock;
+    if (block >= ctx->geo.inode_bitmap_block && block - ctx->geo.inode_bitmap_block < ctx->geo.inode_bitmap_blocks)
+        return ctx->inode_bitmap + (size_t)(block - ctx->geo.inode_bitmap_block) * BLOCK_SIZE;
+    if (block >= ctx->geo.data_bitmap_block && block - ctx->geo.data_bitmap_block < ctx->geo.data_bitmap_blocks)
+        return ctx->data_bitmap + (size_t)(block - ctx->geo.data_bitmap_block) * BLOCK_SIZE;
+    if (block >= ctx->geo.inode_table_start && block - ctx->geo.inode_table_start < ctx->geo.inode_table_blocks)
+        return (uint8_t *)ctx->inodes + (size_t)(block - ctx->geo.inode_table_start) * BLOCK_SIZE;
+    PointerBlock *repaired = find_pointer_block(block);
+    return repaired ? repaired->data : NULL;
+}
+
+// Write a run of blocks gathered from several buffers, retrying short writes
+int write_vectored(int fd, off_t offset, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t n = pwritev(fd, iov, count, offset);
+        count_syscall();
+        count_transfer(1, n, 1);
+        if (n <= 0) return -1;
+        offset += n;
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Write only the dirty blocks back, one pwritev per run of adjacent blocks,
+// then flush them to stable storage with a single fdatasync. Block n goes
+// to offset base + n blocks of fd: the image itself, or an overlay.
+int write_dirty_blocks(int fd, off_t base) {
+    struct iovec iov[WRITE_BATCH_BLOCKS];
+    uint32_t block = next_dirty_block(0);
+    while (block < ctx->geo.total_blocks) {
+        uint32_t start = block;
+        int count = 0;
+        while (block < ctx->geo.total_blocks && count < WRITE_BATCH_BLOCKS &&
+               is_block_marked(ctx->dirty_blocks, block)) {
+            uint8_t *cached = cached_block(block);
+            if (!cached) break;
+            iov[count].iov_base = cached;
+            iov[count].iov_len = BLOCK_SIZE;
+            count++;
+            block++;
+        }
+        if (count == 0) {
+            fprintf(stderr, "Block %u: Dirty but not held in memory\n", block);
+            return -1;
+        }
+        if (write_vectored(fd, base + (off_t)start * BLOCK_SIZE, iov, count) < 0) return -1;
+        if (fd == ctx->fd) note_written(start, count);
+        block = next_dirty_block(block);
+    }
+    count_syscall();
+    return fdatasync(fd);
+}
+
+uint32_t inode_checksum(uint32_t i) {
+    return inode_checksum_of(i, &ctx->inodes[i]);
+}
+
+// The inode bitmap blocks followed by the data bitmap blocks are split into
+// at most SB_BITMAP_CHECKSUMS groups of equal size, one checksum each, so
+// the checksums of any image fit in the superblock
+uint32_t bitmap_group_blocks() {
+    uint32_t blocks = ctx->geo.inode_bitmap_blocks + ctx->geo.data_bitmap_blocks;
+    return (blocks + SB_BITMAP_CHECKSUMS - 1) / SB_BITMAP_CHECKSUMS;
+}
+
+uint32_t bitmap_groups() {
+    uint32_t blocks = ctx->geo.inode_bitmap_blocks + ctx->geo.data_bitmap_blocks;
+    return blocks ? (blocks + bitmap_group_blocks() - 1) / bitmap_group_blocks() : 0;
+}
+
+// Image block and contents of the k-th bitmap block in group order
+uint32_t bitmap_sequence_block(uint32_t k, uint8_t **data) {
+    if (k < ctx->geo.inode_bitmap_blocks) {
+        *data = ctx->inode_bitmap + (size_t)k * BLOCK_SIZE;
+        return ctx->geo.inode_bitmap_block + k;
+    }
+    k -= ctx->geo.inode_bitmap_blocks;
+    *data = ctx->data_bitmap + (size_t)k * BLOCK_SIZE;
+    return ctx->geo.data_bitmap_block + k;
+}
+
+// Checksum of one bitmap group; first gets the group's first image block
+uint32_t bitmap_group_checksum(uint32_t group, uint32_t *first) {
+    uint32_t blocks = ctx->geo.inode_bitmap_blocks + ctx->geo.data_bitmap_blocks;
+    uint32_t k = group * bitmap_group_blocks(), end = k + bitmap_group_blocks();
+    uint32_t crc = crc32c(0, &group, sizeof(group));
+    uint8_t *data;
+    *first = bitmap_sequence_block(k, &data);
+    for (; k < end && k < blocks; k++) {
+        bitmap_sequence_block(k, &data);
+        crc = crc32c(crc, data, BLOCK_SIZE);
+    }
+    return crc;
+}
+
+// Verify the superblock checksum; the repair is setting it again once all
+// other repairs are done
+int check_superblock_checksum(Superblock *sb, int repair, int *fixes) {
+    if (!ctx->verify_checksums) return 0;
+    uint32_t crc = superblock_checksum(sb);
+    if (sb->checksum == crc) return 0;
+    report(FINDING_SB_CHECKSUM, 0, 0, 0, crc, sb->checksum);
+    if (repair) {
+        report(FIX_SB_CHECKSUM, 0, 0, 0, 0, 0);
+        (*fixes)++;
+    }
+    return 1;
+}
+
+// Verify the checksums of the bitmap groups
+int check_bitmap_checksums(int repair, int *fixes) {
+    if (!ctx->verify_checksums) return 0;
+    int errors = 0;
+    for (uint32_t group = 0; group < bitmap_groups(); group++) {
+        uint32_t block, crc = bitmap_group_checksum(group, &block);
+        if (ctx->superblock->bitmap_checksums[group] == crc) continue;
+        report(FINDING_BITMAP_CHECKSUM, 0, block, 0, crc, ctx->superblock->bitmap_checksums[group]);
+        errors++;
+        if (repair) {
+            report(FIX_BITMAP_CHECKSUM, 0, block, 0, 0, 0);
+            mark_block_dirty(SUPERBLOCK_BLOCK);
+            (*fixes)++;
+        }
+    }
+    return errors;
+}
+
+// Verify one inode's checksum
+int check_inode_checksum(uint32_t i, int repair, int *fixes) {
+    if (!ctx->verify_checksums) return 0;
+    uint32_t crc = inode_checksum(i);
+    if (ctx->inodes[i].checksum == crc) return 0;
+    report(FINDING_INODE_CHECKSUM, i, 0, 0, crc, ctx->inodes[i].checksum);
+    if (repair) {
+        report(FIX_INODE_CHECKSUM, i, 0, 0, 0, 0);
+        mark_inode_dirty(i);
+        (*fixes)++;
+    }
+    return 1;
+}
+
+// Turn checksums on for an image without them: every inode table block and
+// the superblock get rewritten with theirs
+void add_checksums() {
+    if (ctx->verify_checksums || !ctx->enable_checksums) return;
+    report_info("Adding metadata checksums\n");
+    ctx->superblock->features |= FEATURE_CHECKSUMS;
+    ctx->keep_checksums = 1;
+    mark_block_dirty(SUPERBLOCK_BLOCK);
+    for (uint32_t k = 0; k < ctx->geo.inode_table_blocks; k++) mark_block_dirty(ctx->geo.inode_table_start + k);
+}
+
+// Set the checksums of everything the repairs touched, last thing before
+// the repairs are written. The bitmap checksums live in the superblock, so
+// any repair rewrites it.
+void update_checksums() {
+    if (!ctx->keep_checksums) return;
+    ctx->verify_checksums = 1;
+    if (next_dirty_block(0) >= ctx->geo.total_blocks) return;
+    uint32_t end = ctx->geo.inode_table_start + ctx->geo.inode_table_blocks;
+    for (uint32_t block = next_marked_block(ctx->dirty_blocks, ctx->geo.inode_table_start, end); block < end;
+         block = next_marked_block(ctx->dirty_blocks, block + 1, end)) {
+        uint32_t first = (block - ctx->geo.inode_table_start) * INODES_PER_BLOCK;
+        for (uint32_t i = first; i < first + INODES_PER_BLOCK && i < ctx->geo.inode_count; i++) {
+            ctx->inodes[i].checksum = inode_checksum(i);
+        }
+    }
+    uint32_t block;
+    for (uint32_t group = 0; group < bitmap_groups(); group++) {
+        ctx->superblock->bitmap_checksums[group] = bitmap_group_checksum(group, &block);
+    }
+    ctx->superblock->checksum = superblock_checksum(ctx->superblock);
+    mark_block_dirty(SUPERBLOCK_BLOCK);
+}
+
+// Checksum of one journal record: block number, original and repaired contents
+uint32_t journal_checksum(uint32_t block, const uint8_t *undo, const uint8_t *redo) {
+    uint32_t crc = crc32c(0, &block, sizeof(block));
+    crc = crc32c(crc, undo, BLOCK_SIZE);
+    return crc32c(crc, redo, BLOCK_SIZE);
+}
+
+// Append to the journal, retrying short writes
+int journal_append(int jfd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(jfd, iov, count);
+        count_syscall();
+        count_transfer(1, n, 0);
+        if (n <= 0) return -1;
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Record the original and repaired contents of every dirty block in an
+// append-only journal, then commit it with a single fdatasync. Originals are
+// read from the image, which repairs have not touched yet.
+int write_journal(const char *path) {
+    int jfd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (jfd < 0) return -1;
+
+    JournalHeader header = { JOURNAL_MAGIC, BLOCK_SIZE, 0, ctx->image_blocks };
+    struct iovec iov[3 * WRITE_BATCH_BLOCKS];
+    JournalRecord records[WRITE_BATCH_BLOCKS];
+    uint8_t *undo = malloc((size_t)WRITE_BATCH_BLOCKS * BLOCK_SIZE);
+    uint32_t count = 0, chain = 0;
+    iov[0] = (struct iovec){ &header, sizeof(header) };
+    if (!undo || read_blocks(SUPERBLOCK_BLOCK, 1, undo) < 0) goto fail;
+    header.superblock_crc = crc32c(0, undo, BLOCK_SIZE);
+    if (journal_append(jfd, iov, 1) < 0) goto fail;
+
+    uint32_t block = next_dirty_block(0);
+    while (block < ctx->geo.total_blocks) {
+        // Gather a run of adjacent dirty blocks and read their originals at once
+        uint32_t start = block;
+        int n = 0;
+        while (block < ctx->geo.total_blocks && n < WRITE_BATCH_BLOCKS && is_block_marked(ctx->dirty_blocks, block) &&
+               cached_block(block)) {
+            n++;
+            block++;
+        }
+        if (n == 0 || read_blocks(start, n, undo) < 0) goto fail;
+
+        for (int k = 0; k < n; k++) {
+            uint8_t *redo = cached_block(start + k);
+            uint8_t *original = undo + (size_t)k * BLOCK_SIZE;
+            records[k] = (JournalRecord){ JOURNAL_RECORD, start + k, journal_checksum(start + k, original, redo), 0 };
+            chain = crc32c(chain, &records[k].checksum, sizeof(uint32_t));
+            iov[3 * k] = (struct iovec){ &records[k], sizeof(JournalRecord) };
+            iov[3 * k + 1] = (struct iovec){ original, BLOCK_SIZE };
+            iov[3 * k + 2] = (struct iovec){ redo, BLOCK_SIZE };
+        }
+        if (journal_append(jfd, iov, 3 * n) < 0) goto fail;
+        count += n;
+        block = next_dirty_block(block);
+    }
+
+    JournalRecord commit = { JOURNAL_COMMIT, count, chain, 0 };
+    iov[0] = (struct iovec){ &commit, sizeof(commit) };
+    count_syscall();
+    if (journal_append(jfd, iov, 1) < 0 || fdatasync(jfd) < 0) goto fail;
+    free(undo);
+    return close(jfd);
+
+fail:
+    free(undo);
+    close(jfd);
+    return -1;
+}
+
+// Read exactly len bytes from the journal; 0 at a clean end, -1 otherwise
+int journal_read(int jfd, void *buffer, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(jfd, (uint8_t *)buffer + done, len - done);
+        count_syscall();
+        count_transfer(0, n, 0);
+        if (n < 0) return -1;
+        if (n == 0) return done == 0 ? 0 : -1;
+        done += n;
+    }
+    return 1;
+}
+
+// Walk a journal's records. The first pass checks every record and the
+// commit; the second writes back the repaired (replay) or original (undo)
+// contents. An uncommitted journal means the image was never touched. The
+// image must be the one the journal was written for: same size, its
+// superblock as it was before the repairs, and every journaled block holding
+// either its original or its repaired contents, as an interrupted write-back
+// leaves them.
+int apply_journal(const char *path, int undo) {
+    int jfd = open(path, O_RDONLY);
+    if (jfd < 0) {
+        perror("Failed to open journal");
+        return -1;
+    }
+
+    JournalHeader header;
+    JournalRecord record;
+    uint8_t *contents = malloc(3 * BLOCK_SIZE);
+    int status = -1;
+    if (!contents) goto done;
+    if (journal_read(jfd, &header, sizeof(header)) != 1 || memcmp(header.magic, JOURNAL_MAGIC, 8) != 0 ||
+        header.block_size != BLOCK_SIZE) {
+        fprintf(stderr, "%s: Not a vsfsck journal\n", path);
+        goto done;
+    }
+    if (header.image_blocks != ctx->image_blocks) {
+        fprintf(stderr, "%s: Journal is for an image of %llu blocks, not %llu\n", path,
+                (unsigned long long)header.image_blocks, (unsigned long long)ctx->image_blocks);
+        goto done;
+    }
+    if (read_block(SUPERBLOCK_BLOCK, contents) != BLOCK_SIZE) {
+        perror("Failed to read superblock");
+        goto done;
+    }
+    int superblock_matches = crc32c(0, contents, BLOCK_SIZE) == header.superblock_crc;
+    int superblock_journaled = 0, foreign = 0;
+
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t count = 0, chain = 0;
+        int committed = 0;
+        if (lseek(jfd, sizeof(header), SEEK_SET) < 0) goto done;
+        while (!committed && journal_read(jfd, &record, sizeof(record)) == 1) {
+            if (record.type == JOURNAL_COMMIT) {
+                committed = record.block == count && record.checksum == chain;
+                break;
+            }
+            if (record.type != JOURNAL_RECORD || record.block >= ctx->image_blocks ||
+                journal_read(jfd, contents, 2 * BLOCK_SIZE) != 1 ||
+                journal_checksum(record.block, contents, contents + BLOCK_SIZE) != record.checksum) {
+                break;
+            }
+            chain = crc32c(chain, &record.checksum, sizeof(uint32_t));
+            count++;
+            if (pass == 0) {
+                uint8_t *current = contents + 2 * BLOCK_SIZE;
+                if (read_block(record.block, current) != BLOCK_SIZE) {
+                    perror("Failed to read journaled block");
+                    goto done;
+                }
+                if (memcmp(current, contents, BLOCK_SIZE) != 0 && memcmp(current, contents + BLOCK_SIZE, BLOCK_SIZE) != 0) {
+                    foreign = 1;
+                }
+                // The repairs may already have rewritten the superblock
+                if (record.block == SUPERBLOCK_BLOCK) superblock_journaled = 1;
+            }
+            if (pass == 1 && write_block(record.block, undo ? contents : contents + BLOCK_SIZE) != BLOCK_SIZE) {
+                perror("Failed to write journaled block");
+                goto done;
+            }
+        }
+        if (pass == 0 && !committed) {
+            report_info("Journal %s has no valid commit record; nothing applied\n", path);
+            status = 0;
+            goto done;
+        }
+        if (pass == 0 && (foreign || (!superblock_journaled && !superblock_matches))) {
+            fprintf(stderr, "%s: Journal was written for another image\n", path);
+            goto done;
+        }
+        if (pass == 1) {
+            count_syscall();
+            if (fdatasync(ctx->fd) < 0) {
+                perror("Failed to sync image");
+                goto done;
+            }
+            report_info("%s %u blocks from journal %s\n", undo ? "Rolled back" : "Replayed", count, path);
+            status = 0;
+        }
+    }
+
+done:
+    free(contents);
+    close(jfd);
+    return status;
+}
+
+// Read or write exactly len bytes at an offset of a file other than the
+// image, retrying short transfers
+int transfer_file(int fd, int write, void *buffer, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write ? pwrite(fd, (uint8_t *)buffer + done, len - done, offset + done)
+                          : pread(fd, (uint8_t *)buffer + done, len - done, offset + done);
+        count_syscall();
+        count_transfer(write, n, 0);
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+// Copy len bytes between files with copy_file_range, which lets the kernel
+// (or a file system that shares extents) move the data without a round trip
+// through user space. Where it is not supported the rest goes through a buffer.
+int copy_range(int in_fd, off_t in, int out_fd, off_t out, size_t len) {
+    loff_t from = in, to = out;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = copy_file_range(in_fd, &from, out_fd, &to, len - done, 0);
+        count_syscall();
+        if (n <= 0) break;
+        count_transfer(1, n, 1);
+        done += n;
+    }
+
+    uint8_t *buffer = done < len ? malloc((size_t)WRITE_BATCH_BLOCKS * BLOCK_SIZE) : NULL;
+    while (done < len) {
+        size_t n = len - done < (size_t)WRITE_BATCH_BLOCKS * BLOCK_SIZE ? len - done : (size_t)WRITE_BATCH_BLOCKS * BLOCK_SIZE;
+        if (!buffer || transfer_file(in_fd, 0, buffer, n, in + done) < 0 ||
+            transfer_file(out_fd, 1, buffer, n, out + done) < 0) {
+            free(buffer);
+            return -1;
+        }
+        done += n;
+    }
+    free(buffer);
+    return 0;
+}
+
+// Offset of a block's copy inside an overlay
+off_t overlay_offset(OverlayHeader *header, uint32_t block) {
+    return ((off_t)1 + header->index_blocks + block) * BLOCK_SIZE;
+}
+
+// Blocks of the overlay index for the open image
+uint32_t overlay_index_blocks() {
+    return (ctx->image_blocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+}
+
+// Image blocks an overlay can hold
+uint32_t overlay_end() {
+    return ctx->image_blocks < UINT32_MAX ? ctx->image_blocks : UINT32_MAX;
+}
+
+// Read an overlay's header and index, refusing overlays made for an image
+// of another size
+int read_overlay_index(int ofd, const char *path, OverlayHeader *header, uint8_t **index) {
+    *index = NULL;
+    if (transfer_file(ofd, 0, header, sizeof(*header), 0) < 0 || memcmp(header->magic, OVERLAY_MAGIC, 8) != 0 ||
+        header->block_size != BLOCK_SIZE) {
+        fprintf(stderr, "%s: Not a vsfsck overlay\n", path);
+        return -1;
+    }
+    if (header->image_blocks != ctx->image_blocks || header->index_blocks != overlay_index_blocks()) {
+        fprintf(stderr, "%s: Overlay is for an image of %llu blocks, not %llu\n", path,
+                (unsigned long long)header->image_blocks, (unsigned long long)ctx->image_blocks);
+        return -1;
+    }
+    *index = malloc((size_t)header->index_blocks * BLOCK_SIZE);
+    if (!*index || transfer_file(ofd, 0, *index, (size_t)header->index_blocks * BLOCK_SIZE, BLOCK_SIZE) < 0) {
+        fprintf(stderr, "%s: Failed to read overlay index\n", path);
+        free(*index);
+        *index = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Open the overlay for this check, creating it if it does not exist, and
+// lay the blocks it already holds over the private image mapping, so the
+// check sees the image as the earlier runs left it
+int load_overlay() {
+    ctx->overlay_fd = open(ctx->overlay_path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (ctx->overlay_fd < 0 || fstat(ctx->overlay_fd, &st) < 0) {
+        perror("Failed to open overlay");
+        return -1;
+    }
+    if (st.st_size == 0) {
+        ctx->overlay = (OverlayHeader){ OVERLAY_MAGIC, BLOCK_SIZE, overlay_index_blocks(), ctx->image_blocks, 0 };
+        ctx->overlay_index = calloc(ctx->overlay.index_blocks, BLOCK_SIZE);
+        if (!ctx->overlay_index) perror("Failed to allocate overlay index");
+        return ctx->overlay_index ? 0 : -1;
+    }
+    if (read_overlay_index(ctx->overlay_fd, ctx->overlay_path, &ctx->overlay, &ctx->overlay_index) < 0) return -1;
+
+    uint32_t end = overlay_end();
+    for (uint32_t block = next_marked_block(ctx->overlay_index, 0, end); block < end;) {
+        uint32_t start = block;
+        while (block < end && is_block_marked(ctx->overlay_index, block)) block++;
+        if (transfer_file(ctx->overlay_fd, 0, mapped_block(start), (size_t)(block - start) * BLOCK_SIZE,
+                          overlay_offset(&ctx->overlay, start)) < 0) {
+            fprintf(stderr, "%s: Failed to read overlay blocks\n", ctx->overlay_path);
+            return -1;
+        }
+        block = next_marked_block(ctx->overlay_index, block, end);
+    }
+    return 0;
+}
+
+// Write the repaired blocks into the overlay, then add them to its index.
+// The index is only rewritten once the blocks are on stable storage, so
+// blocks a torn run adds are never merged.
+int write_overlay() {
+    if (write_dirty_blocks(ctx->overlay_fd, overlay_offset(&ctx->overlay, 0)) < 0) return -1;
+    for (uint32_t block = next_dirty_block(0); block < ctx->geo.total_blocks; block = next_dirty_block(block + 1)) {
+        if (!is_block_marked(ctx->overlay_index, block)) ctx->overlay.block_count++;
+        set_bitmap_bit(ctx->overlay_index, block, 1);
+    }
+    if (transfer_file(ctx->overlay_fd, 1, ctx->overlay_index, (size_t)ctx->overlay.index_blocks * BLOCK_SIZE,
+                      BLOCK_SIZE) < 0 ||
+        transfer_file(ctx->overlay_fd, 1, &ctx->overlay, sizeof(OverlayHeader), 0) < 0) {
+        return -1;
+    }
+    count_syscall();
+    return fdatasync(ctx->overlay_fd);
+}
+
+// Copy every block an overlay holds onto the image in one ascending pass,
+// one copy_file_range per run of adjacent blocks, then sync the image once
+int merge_overlay(const char *path) {
+    int ofd = open(path, O_RDONLY);
+    if (ofd < 0) {
+        perror("Failed to open overlay");
+        return -1;
+    }
+
+    OverlayHeader header;
+    uint8_t *index = NULL;
+    uint32_t end = overlay_end(), count = 0;
+    int status = -1;
+    if (read_overlay_index(ofd, path, &header, &index) < 0) goto done;
+    for (uint32_t block = next_marked_block(index, 0, end); block < end;) {
+        uint32_t start = block;
+        while (block < end && is_block_marked(index, block)) block++;
+        if (copy_range(ofd, overlay_offset(&header, start), ctx->fd, (off_t)start * BLOCK_SIZE,
+                       (size_t)(block - start) * BLOCK_SIZE) < 0) {
+            perror("Failed to merge overlay");
+            goto done;
+        }
+        note_written(start, block - start);
+        count += block - start;
+        block = next_marked_block(index, block, end);
+    }
+    count_syscall();
+    if (fdatasync(ctx->fd) < 0) {
+        perror("Failed to sync image");
+        goto done;
+    }
+    report_info("Merged %u blocks from overlay %s\n", count, path);
+    status = 0;
+
+done:
+    free(index);
+    close(ofd);
+    return status;
+}
+
+// Whether an inode is in use
+int inode_in_use(Inode *inode) {
+    return inode->links_count > 0 && inode->dtime == 0;
+}
+
+// Block pointer slot of an inode: 12 direct, then single, double and triple indirect
+uint32_t *inode_pointer(Inode *inode, int slot) {
+    if (slot < DIRECT_POINTERS) return &inode->direct[slot];
+    if (slot == DIRECT_POINTERS) return &inode->single_indirect;
+    if (slot == DIRECT_POINTERS + 1) return &inode->double_indirect;
+    return &inode->triple_indirect;
+}
+
+// Levels of pointer blocks below an inode pointer slot
+uint32_t slot_depth(int slot) {
+    return slot < DIRECT_POINTERS ? 0 : slot - DIRECT_POINTERS + 1;
+}
+
+// Queue a pointer block for the indirect walk
+void append_ref(RefList *list, uint32_t block, uint32_t inode, uint32_t depth) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 1024;
+        IndirectRef *refs = realloc(list->refs, capacity * sizeof(IndirectRef));
+        if (!refs) {
+            ctx->out_of_memory = 1;
+            return;
+        }
+        list->refs = refs;
+        list->capacity = capacity;
+    }
+    list->refs[list->count++] = (IndirectRef){ block, inode, depth };
+}
+
+// Queue a duplicate reference to be given its own copy of the block
+void append_clone(CloneList *list, uint32_t inode, uint32_t pointer_block, uint32_t slot, uint32_t block) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 64;
+        CloneRef *refs = realloc(list->refs, capacity * sizeof(CloneRef));
+        if (!refs) {
+            ctx->out_of_memory = 1;
+            return;
+        }
+        list->refs = refs;
+        list->capacity = capacity;
+    }
+    list->refs[list->count++] = (CloneRef){ inode, pointer_block, slot, block };
+}
+
+// Keep a contested claim for the level's ownership pass
+void append_claim(ClaimList *list, Claim claim) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 64;
+        Claim *claims = realloc(list->claims, capacity * sizeof(Claim));
+        if (!claims) {
+            ctx->out_of_memory = 1;
+            return;
+        }
+        list->claims = claims;
+        list->capacity = capacity;
+    }
+    list->claims[list->count++] = claim;
+}
+
+// Whether a block pointer lies outside the data region
+int is_bad_block(uint32_t block) {
+    return block < ctx->geo.first_data_block || block >= ctx->geo.total_blocks;
+}
+
+// Drop one block pointer from an inode and shrink its size to match
+void clear_block_pointer(uint32_t inode_num, uint32_t *pointer) {
+    Inode *inode = &ctx->inodes[inode_num];
+    mark_inode_dirty(inode_num);
+    *pointer = 0;
+    if (inode->blocks_count > 0) inode->blocks_count--;
+    if (inode->size > (uint64_t)inode->blocks_count * BLOCK_SIZE) {
+        inode->size = inode->blocks_count * BLOCK_SIZE;
+    }
+}
+
+// Check an inode's bitmap bit against its state
+int check_inode_bitmap(uint32_t i, int repair, int *fixes) {
+    int marked = is_block_marked(ctx->inode_bitmap, i);
+    int valid = inode_in_use(&ctx->inodes[i]);
+
+    if (marked && !valid) {
+        report(FINDING_INODE_MARKED_INVALID, i, 0, 0, ctx->inodes[i].dtime, ctx->inodes[i].links_count);
+        if (repair) {
+            report(FIX_INODE_BITMAP_CLEAR, i, 0, 0, 0, 1);
+            mark_bitmap_dirty(ctx->geo.inode_bitmap_block, i);
+            set_bitmap_bit(ctx->inode_bitmap, i, 0);
+            (*fixes)++;
+        }
+        return 1;
+    }
+    if (valid && !marked) {
+        report(FINDING_INODE_NOT_MARKED, i, 0, 0, 1, 0);
+        if (repair) {
+            report(FIX_INODE_BITMAP_SET, i, 0, 0, 1, 0);
+            mark_bitmap_dirty(ctx->geo.inode_bitmap_block, i);
+            set_bitmap_bit(ctx->inode_bitmap, i, 1);
+            (*fixes)++;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+// Whether a reference to a block repeats an earlier one. Serial scans mark
+// blocks seen as they go; parallel scans use the shared bits and owning range
+// from the counting phase, so the first reference in inode order keeps the block.
+int is_duplicate_reference(uint32_t block, ScanWorker *worker) {
+    if (!worker) {
+        if (test_bit64(ctx->block_seen, block)) {
+            set_bit64(ctx->block_shared, block);
+            return 1;
+        }
+        set_bit64(ctx->block_seen, block);
+        return 0;
+    }
+    if (!test_bit64(ctx->block_shared, block)) return 0;
+    if (__atomic_load_n(&ctx->owner_range[block], __ATOMIC_RELAXED) != worker->index) return 1;
+    __atomic_store_n(&ctx->owner_range[block], OWNER_NONE, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Check one inode's pointers: bad pointers and references to already claimed
+// blocks. The first reference to a block keeps it; later ones are duplicates.
+int scan_inode(uint32_t i, int repair, int *fixes, ScanWorker *worker) {
+    int errors = 0;
+    Inode *inode = &ctx->inodes[i];
+    if (!inode_in_use(inode)) return errors;
+
+    for (int j = 0; j < INODE_POINTERS; j++) {
+        uint32_t *pointer = inode_pointer(inode, j);
+        uint32_t block = *pointer;
+        if (block == 0) continue;
+
+        if (is_bad_block(block)) {
+            report(FINDING_BAD_POINTER, i, block, 0, 0, block);
+            errors++;
+            if (repair) {
+                report(FIX_BAD_POINTER, i, block, 0, 0, block);
+                clear_block_pointer(i, pointer);
+                (*fixes)++;
+            }
+        } else if (is_duplicate_reference(block, worker)) {
+            // Data blocks are cloned once every reference is known
+            if (repair && ctx->clone_duplicates && slot_depth(j) == 0) {
+                append_clone(worker ? &worker->clones : &ctx->clones, i, 0, j, block);
+            } else if (repair) {
+                report(FIX_DUPLICATE, i, block, 0, 0, block);
+                clear_block_pointer(i, pointer);
+                (*fixes)++;
+            }
+        } else if (slot_depth(j) > 0) {
+            append_ref(worker ? &worker->indirect : &ctx->indirect_refs, block, i, slot_depth(j));
+        }
+    }
+    return errors;
+}
+
+// Inode bitmap bits of inodes [first, first + 64) that disagree with the
+// inodes' state; first is a multiple of 64
+uint64_t inode_bitmap_diff(uint32_t first) {
+    uint32_t count = ctx->geo.inode_count - first < 64 ? ctx->geo.inode_count - first : 64;
+    uint64_t valid = 0;
+    for (uint32_t k = 0; k < count; k++) {
+        if (inode_in_use(&ctx->inodes[first + k])) valid |= 1ULL << k;
+    }
+    return (valid ^ bitmap_word(ctx->inode_bitmap, first / 64)) & range_mask(0, 0, count);
+}
+
+// Check inodes [first, last), first being a multiple of 64. Bitmap bits are
+// compared a word at a time and only mismatching inodes are reported.
+int scan_inodes(uint32_t first, uint32_t last, int repair, int *fixes, ScanWorker *worker) {
+    int errors = 0;
+    __atomic_fetch_add(&ctx->stats.inodes_visited, last - first, __ATOMIC_RELAXED);
+    for (uint32_t group = first; group < last; group += 64) {
+        uint32_t end = last - group < 64 ? last : group + 64;
+        if (!worker) wait_table_reads(end);
+        uint64_t diff = inode_bitmap_diff(group);
+        for (uint32_t i = group; i < end; i++) {
+            errors += check_inode_checksum(i, repair, fixes);
+            if ((diff >> (i - group)) & 1) errors += check_inode_bitmap(i, repair, fixes);
+            errors += scan_inode(i, repair, fixes, worker);
+        }
+    }
+    return errors;
+}
+
+// Compare indirect references by block, then inode, then depth
+int compare_refs(const void *a, const void *b) {
+    const IndirectRef *x = a, *y = b;
+    if (x->block != y->block) return x->block < y->block ? -1 : 1;
+    if (x->inode != y->inode) return x->inode < y->inode ? -1 : 1;
+    return x->depth < y->depth ? -1 : x->depth > y->depth;
+}
+
+// Compare claims by block, then by how they rank for ownership: depth of
+// the claiming pointer block, inode, then place in the tree
+int compare_claims(const void *a, const void *b) {
+    const Claim *x = a, *y = b;
+    if (x->block != y->block) return x->block < y->block ? -1 : 1;
+    if (x->depth != y->depth) return x->depth < y->depth ? -1 : 1;
+    if (x->inode != y->inode) return x->inode < y->inode ? -1 : 1;
+    if (x->pointer_block != y->pointer_block) return x->pointer_block < y->pointer_block ? -1 : 1;
+    return x->slot < y->slot ? -1 : x->slot > y->slot;
+}
+
+// Compare claims by the pointer slot they come from
+int compare_claim_slots(const void *a, const void *b) {
+    const Claim *x = a, *y = b;
+    if (x->pointer_block != y->pointer_block) return x->pointer_block < y->pointer_block ? -1 : 1;
+    return x->slot < y->slot ? -1 : x->slot > y->slot;
+}
+
+// End of the read window starting at refs[from]: the references after it
+// whose blocks lie less than a window beyond it
+size_t window_end(RefList *level, size_t from) {
+    uint32_t base = level->refs[from].block;
+    size_t to = from;
+    while (to < level->count && level->refs[to].block >= base && level->refs[to].block - base < INDIRECT_WINDOW) to++;
+    return to;
+}
+
+// Advise the mapped pointer blocks of one window. Nearby blocks are merged
+// into one run so a window costs a handful of hints.
+void advise_window(RefList *level, size_t from, size_t to) {
+    size_t k = from;
+    while (k < to) {
+        uint32_t start = level->refs[k].block;
+        uint32_t end = start + 1;
+        while (k + 1 < to && level->refs[k + 1].block >= start && level->refs[k + 1].block <= end + INDIRECT_MAX_GAP) {
+            if (level->refs[k + 1].block + 1 > end) end = level->refs[k + 1].block + 1;
+            k++;
+        }
+        k++;
+        advise_blocks(start, end - start, MADV_WILLNEED);
+    }
+}
+
+// Queue the run of nearby blocks starting at refs[*next] into a slot
+void submit_run(RefList *level, size_t *next, ReadSlot *slot) {
+    size_t k = *next;
+    uint32_t start = level->refs[k].block;
+    uint32_t end = start + 1;
+    while (k + 1 < level->count && level->refs[k + 1].block <= end + INDIRECT_MAX_GAP &&
+           level->refs[k + 1].block - start < RUN_MAX_BLOCKS) {
+        if (level->refs[k + 1].block + 1 > end) end = level->refs[k + 1].block + 1;
+        k++;
+    }
+    slot->block = start;
+    slot->count = end - start;
+    slot->first = *next;
+    slot->last = k + 1;
+    *next = k + 1;
+    reader_submit(slot);
+}
+
+// Hand every pointer block of a sorted level to visit in list order, with
+// NULL data for blocks that could not be read. Mapped blocks are advised a
+// window ahead; otherwise runs of nearby blocks are read queue_depth runs
+// ahead, so checking one run overlaps the reads of the next ones.
+void visit_pointer_blocks(RefList *level, void (*visit)(IndirectRef *, uint8_t *, void *), void *arg) {
+    if (ctx->image_map) {
+        size_t from = 0, to = window_end(level, 0);
+        advise_window(level, from, to);
+        while (from < level->count) {
+            size_t next_to = window_end(level, to);
+            if (to < level->count) advise_window(level, to, next_to);
+            for (size_t k = from; k < to; k++) visit(&level->refs[k], mapped_block(level->refs[k].block), arg);
+            from = to;
+            to = next_to;
+        }
+        return;
+    }
+
+    // The run buffers are allocated once per context
+    if (!ctx->run_slots) ctx->run_slots = malloc(ctx->queue_depth * sizeof(ReadSlot));
+    if (!ctx->run_buffers) ctx->run_buffers = malloc((size_t)ctx->queue_depth * RUN_MAX_BLOCKS * BLOCK_SIZE);
+    if (!ctx->run_slots || !ctx->run_buffers) {
+        ctx->out_of_memory = 1;
+        return;
+    }
+    ReadSlot *slots = ctx->run_slots;
+    uint8_t *buffers = ctx->run_buffers;
+
+    size_t next = 0;
+    int queued = 0, head = 0;
+    for (; queued < ctx->queue_depth && next < level->count; queued++) {
+        slots[queued].buffer = buffers + (size_t)queued * RUN_MAX_BLOCKS * BLOCK_SIZE;
+        submit_run(level, &next, &slots[queued]);
+    }
+    while (queued > 0) {
+        ReadSlot *slot = &slots[head];
+        int readable = reader_wait(slot) == 0;
+        for (size_t k = slot->first; k < slot->last; k++) {
+            IndirectRef *ref = &level->refs[k];
+            visit(ref, readable ? slot->buffer + (size_t)(ref->block - slot->block) * BLOCK_SIZE : NULL, arg);
+        }
+        queued--;
+        if (next < level->count) {
+            submit_run(level, &next, slot);
+            queued++;
+        }
+        head = (head + 1) % ctx->queue_depth;
+    }
+}
+
+// Writable copy of a pointer block, registered for write-back on first repair
+uint32_t *repairable_pointers(IndirectRef *ref, uint32_t *pointers, PointerBlock **repaired) {
+    if (*repaired) return (uint32_t *)(*repaired)->data;
+    if (ctx->pointer_block_count == ctx->pointer_block_capacity) {
+        size_t capacity = ctx->pointer_block_capacity ? ctx->pointer_block_capacity * 2 : 64;
+        PointerBlock *blocks = realloc(ctx->pointer_blocks, capacity * sizeof(PointerBlock));
+        if (!blocks) {
+            ctx->out_of_memory = 1;
+            return NULL;
+        }
+        ctx->pointer_blocks = blocks;
+        ctx->pointer_block_capacity = capacity;
+    }
+    uint8_t *data = (uint8_t *)pointers;
+    if (!ctx->image_map) {
+        data = malloc(BLOCK_SIZE);
+        if (!data) {
+            ctx->out_of_memory = 1;
+            return NULL;
+        }
+        memcpy(data, pointers, BLOCK_SIZE);
+    }
+    mark_block_dirty(ref->block);
+    *repaired = &ctx->pointer_blocks[ctx->pointer_block_count++];
+    **repaired = (PointerBlock){ ref->block, ref->inode, ref->depth, data };
+    return (uint32_t *)data;
+}
+
+// Remember one contribution of an inode table block's trees for the digest cache
+void record_tree_entry(uint32_t inode, uint32_t block, uint32_t crc, uint32_t flags) {
+    if (!ctx->record_trees) return;
+    if (ctx->tree_record_count == ctx->tree_record_capacity) {
+        size_t capacity = ctx->tree_record_capacity ? ctx->tree_record_capacity * 2 : 4096;
+        TreeRecord *records = realloc(ctx->tree_records, capacity * sizeof(TreeRecord));
+        if (!records) {
+            ctx->out_of_memory = 1;
+            return;
+        }
+        ctx->tree_records = records;
+        ctx->tree_record_capacity = capacity;
+    }
+    ctx->tree_records[ctx->tree_record_count++] = (TreeRecord){ inode / INODES_PER_BLOCK, { block, crc, flags } };
+}
+
+// Number of pointers in a pointer block that lie outside the data region,
+// with the number in use in *used
+uint32_t count_bad_pointers(uint32_t *pointers, uint32_t *used) {
+    uint32_t bad = 0;
+    *used = 0;
+    for (uint32_t k = 0; k < POINTERS_PER_BLOCK; k++) {
+        if (pointers[k] == 0) continue;
+        (*used)++;
+        if (is_bad_block(pointers[k])) bad++;
+    }
+    return bad;
+}
+
+// Empty a pointer block that holds more garbage than pointers. Its in-range
+// entries are as random as the rest, so none of them may claim a block.
+int clear_garbage_block(IndirectRef *ref, uint32_t *pointers, uint32_t used, uint32_t bad, int repair, int *fixes) {
+    PointerBlock *repaired = NULL;
+    report(FINDING_GARBAGE_INDIRECT, ref->inode, ref->block, 0, used, bad);
+    if (!repair || (pointers = repairable_pointers(ref, pointers, &repaired)) == NULL) return 1;
+    report(FIX_GARBAGE_INDIRECT, ref->inode, ref->block, 0, used, 0);
+    for (uint32_t k = 0; k < POINTERS_PER_BLOCK; k++) {
+        if (pointers[k]) clear_block_pointer(ref->inode, &pointers[k]);
+    }
+    (*fixes)++;
+    if (ctx->record_trees) record_tree_entry(ref->inode, ref->block, crc32c(0, pointers, BLOCK_SIZE), CACHE_POINTER_BLOCK);
+    return 1;
+}
+
+// Check the pointers held in one pointer block and queue the next level.
+// A block another pointer block of this level claimed first is counted in
+// *contested and left for the ownership pass.
+int walk_pointer_block(IndirectRef *ref, uint32_t *pointers, RefList *next, int repair, int *fixes, size_t *contested) {
+    int errors = 0, cloned = 0;
+    PointerBlock *repaired = NULL;
+
+    uint32_t used, bad = count_bad_pointers(pointers, &used);
+    if (bad * 2 > used) return clear_garbage_block(ref, pointers, used, bad, repair, fixes);
+
+    for (uint32_t k = 0; k < POINTERS_PER_BLOCK; k++) {
+        uint32_t block = pointers[k];
+        if (block == 0) continue;
+
+        if (is_bad_block(block)) {
+            report(FINDING_BAD_INDIRECT_POINTER, ref->inode, block, ref->block, 0, block);
+            errors++;
+            if (repair && (pointers = repairable_pointers(ref, pointers, &repaired)) != NULL) {
+                report(FIX_BAD_INDIRECT_POINTER, ref->inode, block, ref->block, 0, block);
+                clear_block_pointer(ref->inode, &pointers[k]);
+                (*fixes)++;
+            }
+        } else if (is_duplicate_reference(block, NULL)) {
+            if (test_bit64(ctx->level_claimed, block)) {
+                (*contested)++;
+            } else if (repair && ctx->clone_duplicates && ref->depth == 1) {
+                if ((pointers = repairable_pointers(ref, pointers, &repaired)) != NULL) {
+                    append_clone(&ctx->clones, ref->inode, ref->block, k, block);
+                    cloned = 1;
+                }
+            } else if (repair && (pointers = repairable_pointers(ref, pointers, &repaired)) != NULL) {
+                report(FIX_INDIRECT_DUPLICATE, ref->inode, block, ref->block, 0, block);
+                clear_block_pointer(ref->inode, &pointers[k]);
+                (*fixes)++;
+            }
+        } else if (ref->depth > 1 && block_in_hole(block)) {
+            // Pointer blocks are always written; one in a hole reads as no
+            // pointers, so dropping the pointer to it loses nothing
+            report(FINDING_INDIRECT_IN_HOLE, ref->inode, block, ref->block, 0, 0);
+            errors++;
+            if (repair && (pointers = repairable_pointers(ref, pointers, &repaired)) != NULL) {
+                report(FIX_INDIRECT_IN_HOLE, ref->inode, block, ref->block, 0, 0);
+                clear_block_pointer(ref->inode, &pointers[k]);
+                clear_bit64(ctx->block_seen, block);
+                (*fixes)++;
+            } else if (repair) {
+                ctx->unrepaired++;
+            }
+        } else {
+            set_bit64(ctx->level_claimed, block);
+            if (ref->depth > 1) append_ref(next, block, ref->inode, ref->depth - 1);
+            record_tree_entry(ref->inode, block, 0, CACHE_REFERENCE);
+        }
+        if (!pointers) return errors;
+    }
+    // A block waiting for clones is recorded once they are in place
+    if (ctx->record_trees && !cloned) {
+        record_tree_entry(ref->inode, ref->block, crc32c(0, pointers, BLOCK_SIZE), CACHE_POINTER_BLOCK);
+    }
+    return errors;
+}
+
+// Drop an inode's own pointer to a pointer block lying in a hole
+void clear_pointer_in_hole(IndirectRef *ref, int *fixes) {
+    Inode *inode = &ctx->inodes[ref->inode];
+    for (int j = DIRECT_POINTERS; j < INODE_POINTERS; j++) {
+        uint32_t *pointer = inode_pointer(inode, j);
+        if (*pointer != ref->block || slot_depth(j) != ref->depth) continue;
+        report(FIX_INDIRECT_IN_HOLE, ref->inode, ref->block, 0, 0, 0);
+        clear_block_pointer(ref->inode, pointer);
+        clear_bit64(ctx->block_seen, ref->block);
+        (*fixes)++;
+        return;
+    }
+    ctx->unrepaired++;
+}
+
+// State of one indirect level walk
+typedef struct {
+    RefList *level;
+    RefList *next;
+    int repair;
+    int *fixes;
+    int errors;
+    size_t contested;
+    ClaimList claims;
+} LevelWalk;
+
+// Walk one pointer block of a level
+void walk_level_block(IndirectRef *ref, uint8_t *data, void *arg) {
+    LevelWalk *walk = arg;
+    // A block listed twice is only walked once
+    if (ref > walk->level->refs && ref->block == ref[-1].block) return;
+    if (!data) {
+        report(FINDING_UNREADABLE_INDIRECT, ref->inode, ref->block, 0, 0, 0);
+        walk->errors++;
+        if (walk->repair) ctx->unrepaired++;
+        return;
+    }
+    ctx->stats.pointer_blocks_visited++;
+    // Deeper blocks in holes are caught with the pointer to them, so only
+    // the inode's own pointers are left to clear here
+    if (block_in_hole(ref->block)) {
+        report(FINDING_INDIRECT_IN_HOLE, ref->inode, ref->block, 0, 0, 0);
+        walk->errors++;
+        if (walk->repair) clear_pointer_in_hole(ref, walk->fixes);
+        return;
+    }
+    walk->errors += walk_pointer_block(ref, (uint32_t *)data, walk->next, walk->repair, walk->fixes, &walk->contested);
+}
+
+// Collect the references of one pointer block to blocks contested on its
+// level. Repairs of the first pass are read from their copies.
+void collect_claims(IndirectRef *ref, uint8_t *data, void *arg) {
+    LevelWalk *walk = arg;
+    if (ref > walk->level->refs && ref->block == ref[-1].block) return;
+    if (!data || block_in_hole(ref->block)) return;
+    PointerBlock *repaired = find_pointer_block(ref->block);
+    uint32_t *pointers = repaired ? (uint32_t *)repaired->data : (uint32_t *)data;
+    uint32_t used, bad = count_bad_pointers(pointers, &used);
+    if (bad * 2 > used) return;
+    for (uint32_t k = 0; k < POINTERS_PER_BLOCK; k++) {
+        uint32_t block = pointers[k];
+        if (block == 0 || is_bad_block(block)) continue;
+        if (!test_bit64(ctx->level_claimed, block) || !test_bit64(ctx->block_shared, block)) continue;
+        append_claim(&walk->claims, (Claim){ block, ref->depth, ref->inode, ref->block, k });
+    }
+}
+
+// Drop one losing claim from its pointer block, or queue it for a copy of
+// the block. repaired carries the block's writable copy between the claims
+// of one pointer block.
+void drop_claim(Claim *claim, PointerBlock **repaired, size_t sorted, int *fixes) {
+    IndirectRef ref = { claim->pointer_block, claim->inode, claim->depth };
+    uint32_t *pointers = NULL;
+    if (!*repaired || (*repaired)->block != claim->pointer_block) {
+        PointerBlock key = { .block = claim->pointer_block };
+        *repaired = bsearch(&key, ctx->pointer_blocks, sorted, sizeof(PointerBlock), compare_pointer_blocks);
+    }
+    if (!*repaired) {
+        if (ctx->image_map) {
+            pointers = (uint32_t *)mapped_block(claim->pointer_block);
+        } else {
+            if (!ctx->run_buffers || read_block(claim->pointer_block, ctx->run_buffers) != BLOCK_SIZE) {
+                ctx->unrepaired++;
+                return;
+            }
+            pointers = (uint32_t *)ctx->run_buffers;
+        }
+    }
+    if ((pointers = repairable_pointers(&ref, pointers, repaired)) == NULL) return;
+    if (ctx->clone_duplicates && claim->depth == 1) {
+        append_clone(&ctx->clones, claim->inode, claim->pointer_block, claim->slot, claim->block);
+        return;
+    }
+    report(FIX_INDIRECT_DUPLICATE, claim->inode, claim->block, claim->pointer_block, 0, claim->block);
+    clear_block_pointer(claim->inode, &pointers[claim->slot]);
+    (*fixes)++;
+}
+
+// Settle the blocks several pointer blocks of the level claimed: the claim
+// from the shallowest pointer block wins, and among those the lowest inode,
+// however the pointer blocks are laid out. The other claims are dropped and
+// the next level is queued from the winners.
+void settle_claims(LevelWalk *walk) {
+    walk->claims.count = 0;
+    qsort(ctx->pointer_blocks, ctx->pointer_block_count, sizeof(PointerBlock), compare_pointer_blocks);
+    visit_pointer_blocks(walk->level, collect_claims, walk);
+    ClaimList *list = &walk->claims;
+    qsort(list->claims, list->count, sizeof(Claim), compare_claims);
+
+    // Pointer blocks the first claimants queued make way for the winners'
+    size_t kept = 0;
+    for (size_t k = 0; k < walk->next->count; k++) {
+        uint32_t block = walk->next->refs[k].block;
+        if (!test_bit64(ctx->block_shared, block) || !test_bit64(ctx->level_claimed, block)) {
+            walk->next->refs[kept++] = walk->next->refs[k];
+        }
+    }
+    walk->next->count = kept;
+
+    size_t losers = 0;
+    for (size_t k = 0; k < list->count; k++) {
+        Claim *claim = &list->claims[k];
+        if (k > 0 && claim->block == claim[-1].block) {
+            list->claims[losers++] = *claim;
+        } else if (claim->depth > 1) {
+            append_ref(walk->next, claim->block, claim->inode, claim->depth - 1);
+        }
+    }
+    if (!walk->repair) return;
+
+    qsort(list->claims, losers, sizeof(Claim), compare_claim_slots);
+    size_t sorted = ctx->pointer_block_count;
+    PointerBlock *repaired = NULL;
+    for (size_t k = 0; k < losers && !ctx->out_of_memory; k++) {
+        drop_claim(&list->claims[k], &repaired, sorted, walk->fixes);
+    }
+}
+
+// Walk one level of pointer blocks in block order, so reads batch. A block
+// claimed twice on the level is left to a second pass over the level that
+// settles its owner; blocks claimed on earlier levels stay with the claim
+// nearer an inode.
+int walk_indirect_level(LevelWalk *walk) {
+    walk->errors = 0;
+    walk->contested = 0;
+    memset(ctx->level_claimed, 0, reference_words() * sizeof(uint64_t));
+    qsort(walk->level->refs, walk->level->count, sizeof(IndirectRef), compare_refs);
+    visit_pointer_blocks(walk->level, walk_level_block, walk);
+    if (walk->contested > 0 && !ctx->out_of_memory) settle_claims(walk);
+    return walk->errors;
+}
+
+// Free data block at or after goal, wrapping around to the start of the
+// data region, or 0 if there is none. Free means neither referenced nor
+// marked in the bitmap; each word's first free block is found with
+// count-trailing-zeros.
+uint32_t allocate_block(uint32_t goal) {
+    uint32_t first = ctx->geo.first_data_block, last = ctx->geo.total_blocks;
+    if (goal < first || goal >= last) goal = first;
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t from = pass ? first : goal, to = pass ? goal : last;
+        for (uint64_t word = from / 64; word * 64 < to; word++) {
+            uint64_t used = ctx->block_seen[word] | bitmap_word(ctx->data_bitmap, word);
+            uint64_t free = ~used & range_mask(word, from, to);
+            if (free) return word * 64 + __builtin_ctzll(free);
+        }
+    }
+    return 0;
+}
+
+// Copy one image block to another without bouncing it through user space:
+// a reflink where the backing file system shares extents, otherwise
+// copy_file_range. Blocks held repaired in memory, and images where
+// neither call works, are copied through a buffer. With an overlay the
+// copy is made in the private mapping and written out with the repairs.
+int copy_block(uint32_t from, uint32_t to) {
+    if (ctx->image_in_memory || ctx->overlay_fd >= 0) {
+        memcpy(mapped_block(to), mapped_block(from), BLOCK_SIZE);
+        if (ctx->overlay_fd >= 0) mark_block_dirty(to);
+        return 0;
+    }
+    PointerBlock *held = find_pointer_block(from);
+    if (held) return write_block(to, held->data) == BLOCK_SIZE ? 0 : -1;
+
+    struct file_clone_range range = { ctx->fd, (uint64_t)from * BLOCK_SIZE, BLOCK_SIZE, (uint64_t)to * BLOCK_SIZE };
+    count_syscall();
+    note_written(to, 1);
+    if (ioctl(ctx->fd, FICLONERANGE, &range) == 0) return 0;
+    return copy_range(ctx->fd, (off_t)from * BLOCK_SIZE, ctx->fd, (off_t)to * BLOCK_SIZE, BLOCK_SIZE);
+}
+
+// Give each duplicate reference queued by the scans its own copy of the
+// block, allocated next to the block before it in the same pointer array so
+// a file's clones form runs. The copies land in free blocks, so writing
+// them ahead of the metadata (and its journal) leaves nothing to undo.
+// Without a free block or a working copy the reference is dropped as usual.
+void clone_shared_blocks(int *fixes) {
+    for (size_t k = 0; k < ctx->clones.count; k++) {
+        CloneRef *ref = &ctx->clones.refs[k];
+        uint32_t *pointer = inode_pointer(&ctx->inodes[ref->inode], ref->slot);
+        if (ref->pointer_block) {
+            PointerBlock *repaired = find_pointer_block(ref->pointer_block);
+            if (!repaired) continue;
+            pointer = (uint32_t *)repaired->data + ref->slot;
+        }
+        uint32_t goal = ref->slot > 0 && pointer[-1] ? pointer[-1] + 1 : ref->block;
+        uint32_t copy = allocate_block(goal);
+        if (copy == 0 || copy_block(ref->block, copy) < 0) {
+            report(ref->pointer_block ? FIX_INDIRECT_DUPLICATE : FIX_DUPLICATE, ref->inode, ref->block,
+                   ref->pointer_block, 0, ref->block);
+            clear_block_pointer(ref->inode, pointer);
+            (*fixes)++;
+            continue;
+        }
+
+        report(FIX_CLONE_DUPLICATE, ref->inode, ref->block, ref->pointer_block, copy, ref->block);
+        *pointer = copy;
+        if (!ref->pointer_block) mark_inode_dirty(ref->inode);
+        else record_tree_entry(ref->inode, copy, 0, CACHE_REFERENCE);
+        set_bit64(ctx->block_seen, copy);
+        set_bitmap_bit(ctx->data_bitmap, copy, 1);
+        mark_bitmap_dirty(ctx->geo.data_bitmap_block, copy);
+        (*fixes)++;
+    }
+
+    // The clones of one pointer block are queued together; its digest
+    // cache record is taken now that they have all been made
+    for (size_t k = 0; ctx->record_trees && k < ctx->clones.count; k++) {
+        CloneRef *ref = &ctx->clones.refs[k];
+        if (!ref->pointer_block || (k + 1 < ctx->clones.count && ref[1].pointer_block == ref->pointer_block)) continue;
+        PointerBlock *repaired = find_pointer_block(ref->pointer_block);
+        if (repaired) record_tree_entry(ref->inode, ref->pointer_block, crc32c(0, repaired->data, BLOCK_SIZE), CACHE_POINTER_BLOCK);
+    }
+    ctx->clones.count = 0;
+}
+
+// Walk every indirect tree found by the inode scan, one level at a time
+int walk_indirect_blocks(int repair, int *fixes) {
+    int errors = 0;
+    RefList level = ctx->indirect_refs;
+    ctx->indirect_refs = (RefList){ 0 };
+    ctx->level_claimed = reserve(&ctx->claimed_buffer, reference_words() * sizeof(uint64_t));
+    if (!ctx->level_claimed) {
+        ctx->out_of_memory = 1;
+        free(level.refs);
+        return errors;
+    }
+
+    LevelWalk walk = { &level, NULL, repair, fixes, 0, 0, { 0 } };
+    while (level.count > 0 && !ctx->out_of_memory) {
+        RefList next = { 0 };
+        walk.next = &next;
+        errors += walk_indirect_level(&walk);
+        free(level.refs);
+        level = next;
+    }
+    free(level.refs);
+    free(walk.claims.claims);
+
+    qsort(ctx->pointer_blocks, ctx->pointer_block_count, sizeof(PointerBlock), compare_pointer_blocks);
+    if (ctx->clones.count > 0) clone_shared_blocks(fixes);
+    return errors;
+}
+
+// Check one data block's references and bitmap bit
+int check_data_block(uint32_t block, int repair, int *fixes) {
+    int errors = 0;
+    if (test_bit64(ctx->block_shared, block)) {
+        report(FINDING_DATA_SHARED, 0, block, 0, 1, 2);
+        errors++;
+        // Duplicate references were dropped during the scan
+        if (repair) clear_bit64(ctx->block_shared, block);
+    }
+
+    int marked = is_block_marked(ctx->data_bitmap, block);
+    int referenced = test_bit64(ctx->block_seen, block);
+    if (marked && !referenced) {
+        report(FINDING_DATA_UNREFERENCED, 0, block, 0, 0, 1);
+        errors++;
+        if (repair) {
+            report(FIX_DATA_BITMAP_CLEAR, 0, block, 0, 0, 1);
+            mark_bitmap_dirty(ctx->geo.data_bitmap_block, block);
+            set_bitmap_bit(ctx->data_bitmap, block, 0);
+            (*fixes)++;
+        }
+    }
+    if (referenced && !marked) {
+        report(FINDING_DATA_UNMARKED, 0, block, 0, 1, 0);
+        errors++;
+        if (repair) {
+            report(FIX_DATA_BITMAP_SET, 0, block, 0, 1, 0);
+            mark_bitmap_dirty(ctx->geo.data_bitmap_block, block);
+            set_bitmap_bit(ctx->data_bitmap, block, 1);
+            (*fixes)++;
+        }
+    }
+    return errors;
+}
+
+// Check data blocks [first, last) a word at a time. Words where the on-disk
+// bitmap matches the referenced set and no block is shared are skipped; in
+// the rest, mismatching blocks are found with count-trailing-zeros.
+int sweep_data_blocks(uint32_t first, uint32_t last, int repair, int *fixes) {
+    int errors = 0;
+    for (uint64_t word = first / 64; word * 64 < last; word++) {
+        uint64_t diff = (bitmap_word(ctx->data_bitmap, word) ^ ctx->block_seen[word]) | ctx->block_shared[word];
+        diff &= range_mask(word, first, last);
+        while (diff) {
+            uint32_t block = word * 64 + __builtin_ctzll(diff);
+            diff &= diff - 1;
+            errors += check_data_block(block, repair, fixes);
+        }
+    }
+    return errors;
+}
+
+// FNV-1a hash of a (parent, name) pair
+uint32_t name_hash(uint32_t parent, const char *name, uint32_t len) {
+    uint32_t hash = 2166136261u;
+    for (int k = 0; k < 4; k++) hash = (hash ^ ((parent >> (8 * k)) & 0xFF)) * 16777619u;
+    for (uint32_t k = 0; k < len; k++) hash = (hash ^ (uint8_t)name[k]) * 16777619u;
+    return hash;
+}
+
+// Double the open-addressing index and re-insert every entry
+int grow_name_index(NameTable *table) {
+    size_t slot_count = table->slot_count ? table->slot_count * 2 : 1024;
+    uint32_t *slots = calloc(slot_count, sizeof(uint32_t));
+    if (!slots) return -1;
+    for (size_t e = 0; e < table->count; e++) {
+        size_t s = table->entries[e].hash & (slot_count - 1);
+        while (slots[s]) s = (s + 1) & (slot_count - 1);
+        slots[s] = e + 1;
+    }
+    free(table->slots);
+    table->slots = slots;
+    table->slot_count = slot_count;
+    return 0;
+}
+
+// Add a directory entry to the name table. Entries and names live in two
+// arrays that grow by doubling, so millions of entries cost a few dozen
+// allocations. Returns the entry already holding this (parent, name), the
+// new entry, or NULL when out of memory.
+NameEntry *insert_name(NameTable *table, NameEntry *entry, const char *name) {
+    if (2 * (table->count + 1) > table->slot_count && grow_name_index(table) < 0) return NULL;
+    entry->hash = name_hash(entry->parent, name, entry->name_len);
+    size_t s = entry->hash & (table->slot_count - 1);
+    for (; table->slots[s]; s = (s + 1) & (table->slot_count - 1)) {
+        NameEntry *other = &table->entries[table->slots[s] - 1];
+        if (other->hash == entry->hash && other->parent == entry->parent && other->name_len == entry->name_len &&
+            memcmp(table->names + other->name, name, entry->name_len) == 0) {
+            return other;
+        }
+    }
+
+    if (table->count == table->capacity) {
+        size_t capacity = table->capacity ? table->capacity * 2 : 4096;
+        NameEntry *entries = realloc(table->entries, capacity * sizeof(NameEntry));
+        if (!entries) return NULL;
+        table->entries = entries;
+        table->capacity = capacity;
+    }
+    if (table->names_len + entry->name_len > table->names_capacity) {
+        size_t capacity = table->names_capacity ? table->names_capacity * 2 : 65536;
+        char *names = realloc(table->names, capacity);
+        if (!names) return NULL;
+        table->names = names;
+        table->names_capacity = capacity;
+    }
+    entry->name = table->names_len;
+    memcpy(table->names + table->names_len, name, entry->name_len);
+    table->names_len += entry->name_len;
+    table->entries[table->count] = *entry;
+    table->slots[s] = ++table->count;
+    return &table->entries[table->count - 1];
+}
+
+// Release the name table
+void free_name_table(NameTable *table) {
+    free(table->entries);
+    free(table->names);
+    free(table->slots);
+    memset(table, 0, sizeof(*table));
+}
+
+// Whether an inode is a directory in use
+int is_directory(uint32_t i) {
+    return i < ctx->geo.inode_count && inode_in_use(&ctx->inodes[i]) && S_ISDIR(ctx->inodes[i].mode);
+}
+
+// Current contents of a directory block: the repaired copy if there is one
+int read_directory_block(uint32_t block, uint8_t *buffer, uint8_t **data) {
+    PointerBlock *repaired = find_pointer_block(block);
+    if (repaired) *data = repaired->data;
+    else if (ctx->image_map) *data = mapped_block(block);
+    else if (read_block(block, buffer) != BLOCK_SIZE) return -1;
+    else *data = buffer;
+    return 0;
+}
+
+// Queue the data blocks of a directory, following its indirect trees
+void collect_tree_blocks(uint32_t block, uint32_t depth, uint32_t dir, RefList *blocks) {
+    if (block == 0 || is_bad_block(block)) return;
+    if (depth == 0) {
+        append_ref(blocks, block, dir, 0);
+        return;
+    }
+    uint8_t buffer[BLOCK_SIZE], *data;
+    if (read_directory_block(block, buffer, &data) < 0) return;
+    uint32_t *pointers = (uint32_t *)data;
+    for (uint32_t k = 0; k < POINTERS_PER_BLOCK; k++) collect_tree_blocks(pointers[k], depth - 1, dir, blocks);
+}
+
+// Queue the data blocks of one directory
+void collect_directory_blocks(uint32_t dir, RefList *blocks) {
+    for (int j = 0; j < INODE_POINTERS; j++) {
+        collect_tree_blocks(*inode_pointer(&ctx->inodes[dir], j), slot_depth(j), dir, blocks);
+    }
+}
+
+// Writable copy of a directory block, registered for write-back
+Dirent *writable_directory_block(uint32_t block, uint32_t dir) {
+    PointerBlock *repaired = find_pointer_block(block);
+    if (repaired) return (Dirent *)repaired->data;
+
+    uint8_t buffer[BLOCK_SIZE], *data;
+    if (read_directory_block(block, buffer, &data) < 0) return NULL;
+    IndirectRef ref = { block, dir, 0 };
+    data = (uint8_t *)repairable_pointers(&ref, (uint32_t *)data, &repaired);
+    qsort(ctx->pointer_blocks, ctx->pointer_block_count, sizeof(PointerBlock), compare_pointer_blocks);
+    return (Dirent *)data;
+}
+
+// Clear one directory entry slot in the image
+void clear_dirent(uint32_t block, uint32_t slot, uint32_t dir) {
+    Dirent *dirents = writable_directory_block(block, dir);
+    if (dirents) memset(&dirents[slot], 0, sizeof(Dirent));
+}
+
+// Parse one directory block: drop entries naming unused inodes and second
+// entries with a name already taken, index the rest
+void parse_directory_block(IndirectRef *ref, uint8_t *data, void *arg) {
+    DirectoryPass *pass = arg;
+    if (!data) {
+        report(FINDING_UNREADABLE_DIRECTORY, ref->inode, ref->block, 0, 0, 0);
+        pass->errors++;
+        if (pass->repair) ctx->unrepaired++;
+        return;
+    }
+    ctx->stats.directory_blocks_visited++;
+    Dirent *dirents = (Dirent *)data;
+    PointerBlock *repaired = NULL;
+    for (uint32_t slot = 0; slot < DIRENTS_PER_BLOCK; slot++) {
+        Dirent *d = &dirents[slot];
+        if (d->name_len == 0) continue;
+
+        FindingKind problem = FINDING_KIND_COUNT;
+        NameEntry entry = { ref->inode, d->inode, ref->block, 0, 0, slot, d->name_len };
+        if (d->name_len > DIRENT_NAME_MAX || d->inode >= ctx->geo.inode_count ||
+            !inode_in_use(&ctx->inodes[d->inode])) {
+            problem = FINDING_DIRENT_INVALID;
+        } else {
+            NameEntry *stored = insert_name(&pass->names, &entry, d->name);
+            if (!stored) {
+                ctx->out_of_memory = 1;
+                return;
+            }
+            if (stored->block != ref->block || stored->slot != slot) problem = FINDING_DIRENT_DUPLICATE;
+        }
+        if (problem == FINDING_KIND_COUNT) continue;
+
+        report(problem, ref->inode, ref->block, 0, 0, d->inode);
+        pass->errors++;
+        if (pass->repair) {
+            IndirectRef dir_ref = { ref->block, ref->inode, 0 };
+            dirents = (Dirent *)repairable_pointers(&dir_ref, (uint32_t *)dirents, &repaired);
+            if (!dirents) return;
+            report(FIX_DIRENT_REMOVE, ref->inode, ref->block, 0, 0, dirents[slot].inode);
+            memset(&dirents[slot], 0, sizeof(Dirent));
+            (*pass->fixes)++;
+        }
+    }
+}
+
+// Whether dir is an ancestor of (or is) the directory from in the tree
+// built so far
+int is_ancestor(DirectoryPass *pass, uint32_t dir, uint32_t from) {
+    for (uint32_t d = from;; d = pass->parent[d]) {
+        if (d == dir) return 1;
+        if (d == ROOT_INODE) return 0;
+    }
+}
+
+// Walk the tree breadth first from a reachable directory, counting links.
+// A second path to a directory is a cycle (it names an ancestor) or a hard
+// link; either way the entry is dropped so every directory has one parent.
+void walk_directory_tree(DirectoryPass *pass, uint32_t start) {
+    size_t head = 0, tail = 0;
+    pass->queue[tail++] = start;
+    while (head < tail) {
+        uint32_t dir = pass->queue[head++];
+        for (uint32_t k = pass->child_start[dir]; k < pass->child_start[dir + 1]; k++) {
+            NameEntry *entry = &pass->names.entries[pass->children[k]];
+            uint32_t target = entry->inode;
+            if (!is_directory(target)) {
+                pass->links[target]++;
+                continue;
+            }
+            if (!test_bit64(pass->reached, target)) {
+                set_bit64(pass->reached, target);
+                pass->parent[target] = dir;
+                pass->links[target]++;
+                pass->queue[tail++] = target;
+                continue;
+            }
+            report(is_ancestor(pass, target, dir) ? FINDING_DIR_CYCLE : FINDING_DIR_HARD_LINK, dir, entry->block, 0, 0, target);
+            pass->errors++;
+            if (pass->repair) {
+                report(FIX_DIRENT_REMOVE, dir, entry->block, 0, 0, target);
+                clear_dirent(entry->block, entry->slot, dir);
+                (*pass->fixes)++;
+            } else {
+                pass->links[target]++;
+            }
+        }
+    }
+}
+
+// Link an orphaned inode into the root directory as "#<inode>", using the
+// first free slot of the root's existing blocks
+int reconnect_orphan(DirectoryPass *pass, uint32_t i) {
+    uint8_t buffer[BLOCK_SIZE], *data;
+    for (; pass->root_block < pass->root_blocks.count; pass->root_block++, pass->root_slot = 0) {
+        uint32_t block = pass->root_blocks.refs[pass->root_block].block;
+        if (read_directory_block(block, buffer, &data) < 0) continue;
+        Dirent *dirents = (Dirent *)data;
+        for (; pass->root_slot < DIRENTS_PER_BLOCK; pass->root_slot++) {
+            if (dirents[pass->root_slot].name_len != 0) continue;
+            char name[DIRENT_NAME_MAX + 1];
+            NameEntry entry = { ROOT_INODE, i, block, 0, 0, pass->root_slot, 0 };
+            entry.name_len = snprintf(name, sizeof(name), "#%u", i);
+            NameEntry *stored = insert_name(&pass->names, &entry, name);
+            // Another entry already has the name: leave the inode orphaned
+            if (!stored || stored->block != block || stored->slot != pass->root_slot) return -1;
+
+            dirents = writable_directory_block(block, ROOT_INODE);
+            if (!dirents) return -1;
+            Dirent *d = &dirents[pass->root_slot++];
+            d->inode = i;
+            d->name_len = entry.name_len;
+            memcpy(d->name, name, entry.name_len);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Report an inode no directory reaches, and link it into the root
+void handle_orphan(DirectoryPass *pass, uint32_t i) {
+    report(FINDING_ORPHAN, i, 0, 0, 0, 0);
+    pass->errors++;
+    if (!pass->repair) return;
+    // The recheck only covers repaired blocks, so an orphan left in place
+    // has to be counted here
+    if (reconnect_orphan(pass, i) < 0) {
+        ctx->unrepaired++;
+        return;
+    }
+    report(FIX_ORPHAN, i, 0, 0, 0, 0);
+    (*pass->fixes)++;
+    pass->links[i]++;
+    if (is_directory(i)) {
+        set_bit64(pass->reached, i);
+        pass->parent[i] = ROOT_INODE;
+        walk_directory_tree(pass, i);
+    }
+}
+
+// Check the directory tree: parse every directory's entries into the name
+// table, walk the tree from the root, then report orphans and links_count
+// values that disagree with the entries naming each inode. Images without
+// directories have no tree to check.
+int check_directories(int repair, int *fixes) {
+    DirectoryPass pass = { 0 };
+    pass.repair = repair;
+    pass.fixes = fixes;
+    free(ctx->link_counts);
+    ctx->link_counts = NULL;
+
+    uint32_t directories = 0;
+    for (uint32_t i = 0; i < ctx->geo.inode_count; i++) {
+        if (is_directory(i)) directories++;
+    }
+    if (directories == 0) return 0;
+    if (!is_directory(ROOT_INODE)) {
+        report(FINDING_ROOT_NOT_DIRECTORY, ROOT_INODE, 0, 0, 0, 0);
+        if (repair) ctx->unrepaired++;
+        return 1;
+    }
+
+    // Parse directory blocks in block order through the reader
+    RefList blocks = { 0 };
+    for (uint32_t i = 0; i < ctx->geo.inode_count; i++) {
+        if (is_directory(i)) collect_directory_blocks(i, &blocks);
+    }
+    qsort(blocks.refs, blocks.count, sizeof(IndirectRef), compare_refs);
+    visit_pointer_blocks(&blocks, parse_directory_block, &pass);
+    free(blocks.refs);
+    qsort(ctx->pointer_blocks, ctx->pointer_block_count, sizeof(PointerBlock), compare_pointer_blocks);
+
+    pass.links = calloc(ctx->geo.inode_count, sizeof(uint32_t));
+    pass.parent = calloc(ctx->geo.inode_count, sizeof(uint32_t));
+    pass.queue = malloc((size_t)ctx->geo.inode_count * sizeof(uint32_t));
+    pass.reached = calloc(ctx->geo.inode_count / 64 + 1, sizeof(uint64_t));
+    pass.child_start = calloc((size_t)ctx->geo.inode_count + 1, sizeof(uint32_t));
+    pass.children = malloc((pass.names.count ? pass.names.count : 1) * sizeof(uint32_t));
+    if (ctx->out_of_memory || !pass.links || !pass.parent || !pass.queue || !pass.reached || !pass.child_start ||
+        !pass.children) {
+        ctx->out_of_memory = 1;
+    } else {
+        // Group entries by parent directory, keeping block order within each
+        for (size_t e = 0; e < pass.names.count; e++) pass.child_start[pass.names.entries[e].parent + 1]++;
+        for (uint32_t i = 0; i < ctx->geo.inode_count; i++) pass.child_start[i + 1] += pass.child_start[i];
+        uint32_t *fill = pass.queue;
+        memcpy(fill, pass.child_start, (size_t)ctx->geo.inode_count * sizeof(uint32_t));
+        for (size_t e = 0; e < pass.names.count; e++) pass.children[fill[pass.names.entries[e].parent]++] = e;
+
+        set_bit64(pass.reached, ROOT_INODE);
+        pass.links[ROOT_INODE] = 1;
+        walk_directory_tree(&pass, ROOT_INODE);
+
+        // Orphans: detached subtrees first (directories nothing names), then
+        // directories only named from inside a detached cycle, then the rest
+        collect_directory_blocks(ROOT_INODE, &pass.root_blocks);
+        uint8_t *named = calloc(ctx->geo.inode_count / 8 + 1, 1);
+        if (named) {
+            for (size_t e = 0; e < pass.names.count; e++) set_bitmap_bit(named, pass.names.entries[e].inode, 1);
+            for (uint32_t i = 0; i < ctx->geo.inode_count; i++) {
+                if (is_directory(i) && !test_bit64(pass.reached, i) && !is_block_marked(named, i)) handle_orphan(&pass, i);
+            }
+            free(named);
+        }
+        for (uint32_t i = 0; i < ctx->geo.inode_count; i++) {
+            if (is_directory(i) && !test_bit64(pass.reached, i)) handle_orphan(&pass, i);
+        }
+        for (uint32_t i = 0; i < ctx->geo.inode_count; i++) {
+            if (inode_in_use(&ctx->inodes[i]) && !is_directory(i) && pass.links[i] == 0) handle_orphan(&pass, i);
+        }
+        free(pass.root_blocks.refs);
+
+        // Orphans that could not be linked keep their count rather than being freed
+        for (uint32_t i = 0; i < ctx->geo.inode_count; i++) {
+            Inode *inode = &ctx->inodes[i];
+            if (!inode_in_use(inode) || pass.links[i] == 0 || inode->links_count == pass.links[i]) continue;
+            report(FINDING_LINK_COUNT, i, 0, 0, pass.links[i], inode->links_count);
+            pass.errors++;
+            if (repair) {
+                report(FIX_LINK_COUNT, i, 0, 0, pass.links[i], inode->links_count);
+                mark_inode_dirty(i);
+                inode->links_count = pass.links[i];
+                (*fixes)++;
+            }
+        }
+        ctx->link_counts = pass.links;
+        pass.links = NULL;
+    }
+
+    free(pass.links);
+    free(pass.parent);
+    free(pass.queue);
+    free(pass.reached);
+    free(pass.child_start);
+    free(pass.children);
+    free_name_table(&pass.names);
+    return pass.errors;
+}
+
+// Check (and optionally repair) bitmaps, duplicates and bad blocks in one pass
+// over the inode table followed by one sweep over the data blocks
+int check_filesystem_parallel(int repair, int *fixes);
+
+int check_filesystem(int repair, int *fixes) {
+    if (ctx->scan_threads > 1) return check_filesystem_parallel(repair, fixes);
+
+    int errors = 0;
+    double start = now();
+    memset(ctx->block_seen, 0, reference_words() * sizeof(uint64_t));
+    memset(ctx->block_shared, 0, reference_words() * sizeof(uint64_t));
+
+    errors += scan_inodes(0, ctx->geo.inode_count, repair, fixes, NULL);
+    phase_done(STATS_INODE_SCAN, &start);
+    errors += walk_indirect_blocks(repair, fixes);
+    phase_done(STATS_INDIRECT_WALK, &start);
+    errors += sweep_data_blocks(ctx->geo.first_data_block, ctx->geo.total_blocks, repair, fixes);
+    phase_done(STATS_DATA_SWEEP, &start);
+    errors += check_directories(repair, fixes);
+    phase_done(STATS_DIRECTORIES, &start);
+    return errors;
+}
+
+// Count references from one range of inodes and note the lowest range
+// referencing each block
+void *count_range(void *arg) {
+    ScanWorker *worker = arg;
+    ctx = worker->ctx;
+    for (uint32_t i = worker->first; i < worker->last; i++) {
+        Inode *inode = &ctx->inodes[i];
+        if (!inode_in_use(inode)) continue;
+        for (int j = 0; j < INODE_POINTERS; j++) {
+            uint32_t block = *inode_pointer(inode, j);
+            if (block == 0 || is_bad_block(block)) continue;
+            uint64_t bit = 1ULL << (block % 64);
+            if (__atomic_fetch_or(&ctx->block_seen[block / 64], bit, __ATOMIC_RELAXED) & bit) {
+                __atomic_fetch_or(&ctx->block_shared[block / 64], bit, __ATOMIC_RELAXED);
+            }
+            uint8_t owner = __atomic_load_n(&ctx->owner_range[block], __ATOMIC_RELAXED);
+            while (owner > worker->index &&
+                   !__atomic_compare_exchange_n(&ctx->owner_range[block], &owner, (uint8_t)worker->index, 1,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            }
+        }
+    }
+    return NULL;
+}
+
+// Check and repair one range of inodes, reporting into the worker's log
+void *scan_range(void *arg) {
+    ScanWorker *worker = arg;
+    ctx = worker->ctx;
+    report_log = &worker->log;
+    worker->errors += scan_inodes(worker->first, worker->last, worker->repair, &worker->fixes, worker);
+    return NULL;
+}
+
+// Check one range of data blocks, reporting into the worker's log
+void *sweep_range(void *arg) {
+    ScanWorker *worker = arg;
+    ctx = worker->ctx;
+    report_log = &worker->log;
+    worker->errors += sweep_data_blocks(worker->first, worker->last, worker->repair, &worker->fixes);
+    return NULL;
+}
+
+// Split [first, last) into aligned per-thread ranges, run them and emit
+// their reports in range order so output matches a serial scan
+int run_workers(uint32_t first, uint32_t last, uint32_t align, void *(*fn)(void *), int repair, int *fixes) {
+    ScanWorker workers[MAX_THREADS];
+    // Range boundaries fall on absolute multiples of align; only the first
+    // range starts part way in, at first
+    uint64_t base = first / align * align;
+    uint64_t span = ((uint64_t)last - base + ctx->scan_threads - 1) / ctx->scan_threads;
+    span = (span + align - 1) / align * align;
+    int errors = 0;
+
+    for (int t = 0; t < ctx->scan_threads; t++) {
+        ScanWorker *worker = &workers[t];
+        uint64_t start = t == 0 ? first : base + span * t;
+        uint64_t end = base + span * (t + 1);
+        memset(worker, 0, sizeof(*worker));
+        worker->ctx = ctx;
+        worker->index = t;
+        worker->first = start < last ? start : last;
+        worker->last = end < last ? end : last;
+        worker->repair = repair;
+        if (pthread_create(&worker->thread, NULL, fn, worker) != 0) {
+            // Fall back to running the range on this thread
+            fn(worker);
+            worker->thread = 0;
+        }
+    }
+    for (int t = 0; t < ctx->scan_threads; t++) {
+        ScanWorker *worker = &workers[t];
+        if (worker->thread) pthread_join(worker->thread, NULL);
+        merge_findings(&worker->log);
+        errors += worker->errors;
+        *fixes += worker->fixes;
+        for (size_t k = 0; k < worker->indirect.count; k++) {
+            IndirectRef *ref = &worker->indirect.refs[k];
+            append_ref(&ctx->indirect_refs, ref->block, ref->inode, ref->depth);
+        }
+        free(worker->indirect.refs);
+        for (size_t k = 0; k < worker->clones.count; k++) {
+            CloneRef *ref = &worker->clones.refs[k];
+            append_clone(&ctx->clones, ref->inode, ref->pointer_block, ref->slot, ref->block);
+        }
+        free(worker->clones.refs);
+    }
+    return errors;
+}
+
+// Parallel form of check_filesystem: count references across all ranges
+// first, then check inode ranges and data block ranges concurrently.
+// Indirect trees are walked between the two on this thread.
+int check_filesystem_parallel(int repair, int *fixes) {
+    int errors = 0;
+    double start = now();
+    wait_table_reads(ctx->geo.inode_count);
+    memset(ctx->block_seen, 0, reference_words() * sizeof(uint64_t));
+    memset(ctx->block_shared, 0, reference_words() * sizeof(uint64_t));
+    ctx->owner_range = malloc(ctx->geo.total_blocks);
+    if (!ctx->owner_range) {
+        perror("Failed to allocate owner table");
+        ctx->scan_threads = 1;
+        return check_filesystem(repair, fixes);
+    }
+    memset(ctx->owner_range, OWNER_NONE, ctx->geo.total_blocks);
+
+    // Range boundaries are multiples of 64 entries, inodes and data blocks
+    // alike, so no two threads share a bitmap byte or a reference word
+    run_workers(0, ctx->geo.inode_count, 64, count_range, repair, fixes);
+    errors += run_workers(0, ctx->geo.inode_count, 64, scan_range, repair, fixes);
+    phase_done(STATS_INODE_SCAN, &start);
+    errors += walk_indirect_blocks(repair, fixes);
+    phase_done(STATS_INDIRECT_WALK, &start);
+    errors += run_workers(ctx->geo.first_data_block, ctx->geo.total_blocks, 64, sweep_range, repair, fixes);
+    phase_done(STATS_DATA_SWEEP, &start);
+    errors += check_directories(repair, fixes);
+    phase_done(STATS_DIRECTORIES, &start);
+
+    free(ctx->owner_range);
+    ctx->owner_range = NULL;
+    return errors;
+}
+
+// Checksums of the superblock, bitmap and inode table blocks as held in memory
+void metadata_checksums(uint32_t *superblock_crc, uint32_t *crcs) {
+    uint32_t n = 0;
+    *superblock_crc = crc32c(0, ctx->superblock, sizeof(Superblock));
+    for (uint32_t k = 0; k < ctx->geo.inode_bitmap_blocks; k++)
+        crcs[n++] = crc32c(0, ctx->inode_bitmap + (size_t)k * BLOCK_SIZE, BLOCK_SIZE);
+    for (uint32_t k = 0; k < ctx->geo.data_bitmap_blocks; k++)
+        crcs[n++] = crc32c(0, ctx->data_bitmap + (size_t)k * BLOCK_SIZE, BLOCK_SIZE);
+    for (uint32_t k = 0; k < ctx->geo.inode_table_blocks; k++)
+        crcs[n++] = crc32c(0, (uint8_t *)ctx->inodes + (size_t)k * BLOCK_SIZE, BLOCK_SIZE);
+}
+
+// Number of checksummed metadata blocks
+uint32_t metadata_block_count() {
+    return ctx->geo.inode_bitmap_blocks + ctx->geo.data_bitmap_blocks + ctx->geo.inode_table_blocks;
+}
+
+// Release a loaded digest cache
+void free_cache(DigestCache *cache) {
+    free(cache->crcs);
+    free(cache->tree_offsets);
+    free(cache->trees);
+    memset(cache, 0, sizeof(*cache));
+}
+
+// Load a digest cache written for an image with the current geometry
+int load_cache(const char *path, DigestCache *cache) {
+    FILE *file = fopen(path, "rb");
+    if (!file) return -1;
+
+    CacheHeader *h = &cache->header;
+    uint32_t tables = ctx->geo.inode_table_blocks;
+    int ok = fread(h, sizeof(*h), 1, file) == 1 && memcmp(h->magic, CACHE_MAGIC, 8) == 0 &&
+             h->block_size == BLOCK_SIZE && h->total_blocks == ctx->geo.total_blocks &&
+             h->inode_count == ctx->geo.inode_count && h->inode_bitmap_block == ctx->geo.inode_bitmap_block &&
+             h->data_bitmap_block == ctx->geo.data_bitmap_block && h->inode_table_start == ctx->geo.inode_table_start &&
+             h->first_data_block == ctx->geo.first_data_block && h->tree_count < SIZE_MAX / sizeof(TreeEntry);
+    if (ok) {
+        cache->crcs = malloc((size_t)metadata_block_count() * sizeof(uint32_t));
+        cache->tree_offsets = malloc(((size_t)tables + 1) * sizeof(uint64_t));
+        cache->trees = malloc((h->tree_count ? h->tree_count : 1) * sizeof(TreeEntry));
+        ok = cache->crcs && cache->tree_offsets && cache->trees &&
+             fread(cache->crcs, sizeof(uint32_t), metadata_block_count(), file) == metadata_block_count() &&
+             fread(cache->tree_offsets, sizeof(uint64_t), tables + 1, file) == tables + 1 &&
+             fread(cache->trees, sizeof(TreeEntry), h->tree_count, file) == h->tree_count &&
+             cache->tree_offsets[tables] == h->tree_count;
+        for (uint32_t k = 0; ok && k < tables; k++) {
+            ok = cache->tree_offsets[k] <= cache->tree_offsets[k + 1];
         }
     }
-    
-    return fixes;
+    fclose(file);
+    if (!ok) {
+        free_cache(cache);
+        return -1;
+    }
+    return 0;
 }
 
-// Check inode and data bitmap consistency
-int check_bitmaps() {
-    int errors = 0;
-    
-    // Check inode bitmap
-    for (uint32_t i = 0; i < INODE_COUNT; i++) {
-        int marked = is_block_marked(inode_bitmap, i);
-        int valid = (inodes[i].links_count > 0 && inodes[i].dtime == 0);
-        
-        if (marked && !valid) {
-            printf("Inode %u: Marked in bitmap but invalid (links=%u, dtime=%u)\n", 
-                   i, inodes[i].links_count, inodes[i].dtime);
-            errors++;
+// Compare tree records by inode table block
+int compare_tree_records(const void *a, const void *b) {
+    uint32_t x = ((const TreeRecord *)a)->table_block, y = ((const TreeRecord *)b)->table_block;
+    return x < y ? -1 : x > y;
+}
+
+// Write the digest cache for a clean image. Inode table blocks listed in
+// fresh were walked this run; the others keep their entries from old.
+int write_cache(const char *path, DigestCache *old, uint8_t *fresh) {
+    uint32_t tables = ctx->geo.inode_table_blocks;
+    uint32_t *crcs = malloc((size_t)metadata_block_count() * sizeof(uint32_t));
+    uint64_t *offsets = malloc(((size_t)tables + 1) * sizeof(uint64_t));
+    char temp[4096];
+    FILE *file = NULL;
+    int ok = crcs && offsets && snprintf(temp, sizeof(temp), "%s.tmp", path) < (int)sizeof(temp);
+
+    CacheHeader h = { CACHE_MAGIC, BLOCK_SIZE, ctx->geo.total_blocks, ctx->geo.inode_count, ctx->geo.inode_bitmap_block,
+                      ctx->geo.data_bitmap_block, ctx->geo.inode_table_start, ctx->geo.first_data_block, 0, 0 };
+    if (ok) {
+        metadata_checksums(&h.superblock_crc, crcs);
+        qsort(ctx->tree_records, ctx->tree_record_count, sizeof(TreeRecord), compare_tree_records);
+
+        // Offsets of each inode table block's entries in the merged list
+        size_t r = 0;
+        for (uint32_t k = 0; k < tables; k++) {
+            offsets[k] = h.tree_count;
+            if (old && !is_block_marked(fresh, k)) {
+                h.tree_count += old->tree_offsets[k + 1] - old->tree_offsets[k];
+            } else {
+                while (r < ctx->tree_record_count && ctx->tree_records[r].table_block == k) {
+                    h.tree_count++;
+                    r++;
+                }
+            }
+            while (r < ctx->tree_record_count && ctx->tree_records[r].table_block == k) r++;
         }
-        if (valid && !marked) {
-            printf("Inode %u: Valid but not marked in bitmap\n", i);
-            errors++;
+        offsets[tables] = h.tree_count;
+
+        file = fopen(temp, "wb");
+        ok = file && fwrite(&h, sizeof(h), 1, file) == 1 &&
+             fwrite(crcs, sizeof(uint32_t), metadata_block_count(), file) == metadata_block_count() &&
+             fwrite(offsets, sizeof(uint64_t), tables + 1, file) == tables + 1;
+    }
+    size_t r = 0;
+    for (uint32_t k = 0; ok && k < tables; k++) {
+        if (old && !is_block_marked(fresh, k)) {
+            size_t n = old->tree_offsets[k + 1] - old->tree_offsets[k];
+            ok = fwrite(old->trees + old->tree_offsets[k], sizeof(TreeEntry), n, file) == n;
+        } else {
+            for (size_t q = r; ok && q < ctx->tree_record_count && ctx->tree_records[q].table_block == k; q++) {
+                ok = fwrite(&ctx->tree_records[q].entry, sizeof(TreeEntry), 1, file) == 1;
+            }
         }
+        while (r < ctx->tree_record_count && ctx->tree_records[r].table_block == k) r++;
+    }
+    if (file && fclose(file) != 0) ok = 0;
+    if (ok && rename(temp, path) < 0) ok = 0;
+    if (!ok && file) unlink(temp);
+    free(crcs);
+    free(offsets);
+    return ok ? 0 : -1;
+}
+
+// State of hashing the cached pointer blocks
+typedef struct {
+    DigestCache *cache;
+    uint8_t *changed;
+    uint32_t mismatches;
+} TreeHash;
+
+// Compare one pointer block with its cached checksum. Each ref holds the
+// inode table block in inode and the cache entry index in depth.
+void hash_cached_block(IndirectRef *ref, uint8_t *data, void *arg) {
+    TreeHash *hash = arg;
+    if (!data || crc32c(0, data, BLOCK_SIZE) != hash->cache->trees[ref->depth].crc) {
+        if (!is_block_marked(hash->changed, ref->inode)) hash->mismatches++;
+        set_bitmap_bit(hash->changed, ref->inode, 1);
+    }
+}
+
+// Hash the cached pointer blocks of unchanged inode table blocks and mark
+// the inode table blocks whose trees changed
+uint32_t hash_cached_trees(DigestCache *cache, RefList *blocks, uint8_t *changed) {
+    TreeHash hash = { cache, changed, 0 };
+    qsort(blocks->refs, blocks->count, sizeof(IndirectRef), compare_refs);
+    visit_pointer_blocks(blocks, hash_cached_block, &hash);
+    return hash.mismatches;
+}
+
+// Check the image against the digest cache of its last clean run. Inode
+// table blocks whose checksum or trees changed are parsed again; the others
+// contribute their inode pointers and cached tree references directly.
+// Findings are not reported: the return value is the number of findings, or
+// -1 if the cache cannot be used. changed receives the re-parsed blocks.
+int incremental_check(DigestCache *cache, uint8_t **changed_out) {
+    wait_table_reads(ctx->geo.inode_count);
+    uint32_t tables = ctx->geo.inode_table_blocks;
+    uint32_t superblock_crc;
+    uint32_t *crcs = malloc((size_t)metadata_block_count() * sizeof(uint32_t));
+    uint8_t *changed = calloc(tables / 8 + 1, 1);
+    RefList blocks = { 0 };
+    if (!crcs || !changed) {
+        free(crcs);
+        free(changed);
+        return -1;
     }
-    
-    // Check data bitmap
-    memset(block_references, 0, sizeof(block_references));
-    for (uint32_t i = 0; i < INODE_COUNT; i++) {
-        if (inodes[i].links_count > 0 && inodes[i].dtime == 0) {
-            count_block_references(&inodes[i], i);
+
+    metadata_checksums(&superblock_crc, crcs);
+    if (superblock_crc != cache->header.superblock_crc) {
+        free(crcs);
+        free(changed);
+        return -1;
+    }
+    uint32_t bitmaps = ctx->geo.inode_bitmap_blocks + ctx->geo.data_bitmap_blocks;
+    uint32_t bitmaps_changed = 0, tables_changed = 0;
+    for (uint32_t k = 0; k < bitmaps; k++) {
+        if (crcs[k] != cache->crcs[k]) bitmaps_changed++;
+    }
+    for (uint32_t k = 0; k < tables; k++) {
+        if (crcs[bitmaps + k] != cache->crcs[bitmaps + k]) set_bitmap_bit(changed, k, 1);
+    }
+    free(crcs);
+
+    // Pointer blocks of unchanged inode table blocks must be unchanged too
+    for (uint32_t k = 0; k < tables; k++) {
+        if (is_block_marked(changed, k)) {
+            tables_changed++;
+            continue;
+        }
+        for (uint64_t e = cache->tree_offsets[k]; e < cache->tree_offsets[k + 1]; e++) {
+            if (cache->trees[e].flags & CACHE_POINTER_BLOCK) append_ref(&blocks, cache->trees[e].block, k, e);
         }
     }
-    
-    for (uint32_t i = DATA_BLOCK_START; i < TOTAL_BLOCKS; i++) {
-        int marked = is_block_marked(data_bitmap, i);
-        int referenced = block_references[i] > 0;
-        
-        if (marked && !referenced) {
-            printf("Data block %u: Marked in bitmap but not referenced\n", i);
-            errors++;
+    uint32_t trees_changed = hash_cached_trees(cache, &blocks, changed);
+    tables_changed += trees_changed;
+    report_info("Digest cache: %u of %u bitmap blocks, %u of %u inode table blocks changed (%u through indirect blocks)\n",
+           bitmaps_changed, bitmaps, tables_changed, tables, trees_changed);
+    free(blocks.refs);
+
+    int errors = 0, fixes = 0;
+    // Directory blocks are data blocks the digest does not cover, so the
+    // tree pass runs on every re-check
+    FindingLog discard = { 0 };
+    FindingLog *previous = report_log;
+    report_log = &discard;
+    if (bitmaps_changed > 0 || tables_changed > 0) {
+        memset(ctx->block_seen, 0, reference_words() * sizeof(uint64_t));
+        memset(ctx->block_shared, 0, reference_words() * sizeof(uint64_t));
+        for (uint32_t group = 0; group < ctx->geo.inode_count; group += 64) {
+            errors += __builtin_popcountll(inode_bitmap_diff(group));
         }
-        if (referenced && !marked) {
-            printf("Data block %u: Referenced but not marked in bitmap\n", i);
-            errors++;
+        for (uint32_t k = 0; k < tables; k++) {
+            uint32_t first = k * INODES_PER_BLOCK;
+            uint32_t last = first + INODES_PER_BLOCK;
+            if (last > ctx->geo.inode_count) last = ctx->geo.inode_count;
+            if (is_block_marked(changed, k)) {
+                ctx->stats.inodes_visited += last - first;
+                for (uint32_t i = first; i < last; i++) {
+                    errors += check_inode_checksum(i, 0, &fixes);
+                    errors += scan_inode(i, 0, &fixes, NULL);
+                }
+                continue;
+            }
+            for (uint32_t i = first; i < last; i++) {
+                if (!inode_in_use(&ctx->inodes[i])) continue;
+                for (int j = 0; j < INODE_POINTERS; j++) {
+                    uint32_t block = *inode_pointer(&ctx->inodes[i], j);
+                    if (block != 0 && !is_bad_block(block)) is_duplicate_reference(block, NULL);
+                }
+            }
+            for (uint64_t e = cache->tree_offsets[k]; e < cache->tree_offsets[k + 1]; e++) {
+                uint32_t block = cache->trees[e].block;
+                if ((cache->trees[e].flags & CACHE_REFERENCE) && !is_bad_block(block)) is_duplicate_reference(block, NULL);
+            }
         }
+        errors += walk_indirect_blocks(0, &fixes);
+        errors += sweep_data_blocks(ctx->geo.first_data_block, ctx->geo.total_blocks, 0, &fixes);
     }
-    
+    errors += check_directories(0, &fixes);
+    free(discard.records);
+    report_log = previous;
+
+    *changed_out = changed;
     return errors;
 }
 
-// Fix duplicate909 block references
-int fix_duplicates() {
+// Re-check one repaired inode against the repaired reference counts
+int verify_inode(uint32_t i) {
     int fixes = 0;
-    memset(block_references, 0, sizeof(block_references));
-    
-    // Count references and track first inode
-    uint32_t first_inode[TOTAL_BLOCKS];
-    memset(first_inode, 0xFF, sizeof(first_inode)); // Initialize to invalid inode number
-    
-    for (uint32_t i = 0; i < INODE_COUNT; i++) {
-        if (inodes[i].links_count > 0 && inodes[i].dtime == 0) {
-            for (int j = 0; j < 12; j++) {
-                uint32_t block = inodes[i].direct[j];
-                if (block >= DATA_BLOCK_START && block < TOTAL_BLOCKS) {
-                    block_references[block]++;
-                    if (block_references[block] == 1) {
-                        first_inode[block] = i;
-                    }
-                }
-            }
-        }
+    int errors = check_inode_bitmap(i, 0, &fixes);
+    Inode *inode = &ctx->inodes[i];
+    if (!inode_in_use(inode)) return errors;
+    if (ctx->link_counts && ctx->link_counts[i] && inode->links_count != ctx->link_counts[i]) {
+        report(FINDING_LINK_COUNT, i, 0, 0, ctx->link_counts[i], inode->links_count);
+        errors++;
     }
-    
-    // Fix duplicates by clearing references after the first inode
-    for (uint32_t i = 0; i < INODE_COUNT; i++) {
-        if (inodes[i].links_count > 0 && inodes[i].dtime == 0) {
-            for (int j = 0; j < 12; j++) {
-                uint32_t block = inodes[i].direct[j];
-                if (block >= DATA_BLOCK_START && block < TOTAL_BLOCKS && block_references[block] > 1) {
-                    if (i != first_inode[block]) {
-                        printf("Fixing inode %u: Clearing duplicate reference to block %u\n", i, block);
-                        inodes[i].direct[j] = 0;
-                        inodes[i].blocks_count--;
-                        if (inodes[i].size > inodes[i].blocks_count * BLOCK_SIZE) {
-                            inodes[i].size = inodes[i].blocks_count * BLOCK_SIZE;
-                        }
-                        fixes++;
-                    }
-                }
-            }
+
+    for (int j = 0; j < INODE_POINTERS; j++) {
+        uint32_t block = *inode_pointer(inode, j);
+        if (block == 0) continue;
+        if (is_bad_block(block)) {
+            report(FINDING_BAD_POINTER, i, block, 0, 0, block);
+            errors++;
+        } else {
+            errors += check_data_block(block, 0, &fixes);
         }
     }
-    
-    return fixes;
+    return errors;
 }
 
-// Check for duplicate block references
-int check_duplicates() {
+// Re-check the entries left in a repaired directory block
+int verify_directory_block(PointerBlock *repaired) {
     int errors = 0;
-    for (uint32_t i = DATA_BLOCK_START; i < TOTAL_BLOCKS; i++) {
-        if (block_references[i] > 1) {
-            printf("Data block %u: Referenced %u times\n", i, block_references[i]);
+    Dirent *dirents = (Dirent *)repaired->data;
+    for (uint32_t slot = 0; slot < DIRENTS_PER_BLOCK; slot++) {
+        Dirent *d = &dirents[slot];
+        if (d->name_len == 0) continue;
+        if (d->name_len > DIRENT_NAME_MAX || d->inode >= ctx->geo.inode_count ||
+            !inode_in_use(&ctx->inodes[d->inode])) {
+            report(FINDING_DIRENT_INVALID, repaired->inode, repaired->block, 0, 0, d->inode);
             errors++;
         }
     }
     return errors;
 }
 
-// Fix bad blocks
-int fix_bad_blocks() {
-    int fixes = 0;
-    for (uint32_t i = 0; i < INODE_COUNT; i++) {
-        if (inodes[i].links_count > 0 && inodes[i].dtime == 0) {
-            for (int j = 0; j < 12; j++) {
-                if (inodes[i].direct[j] != 0 && 
-                    (inodes[i].direct[j] < DATA_BLOCK_START || inodes[i].direct[j] >= TOTAL_BLOCKS)) {
-                    printf("Fixing inode %u: Clearing bad block pointer %u\n", i, inodes[i].direct[j]);
-                    inodes[i].direct[j] = 0;
-                    inodes[i].blocks_count--;
-                    if (inodes[i].size > inodes[i].blocks_count * BLOCK_SIZE) {
-                        inodes[i].size = inodes[i].blocks_count * BLOCK_SIZE;
-                    }
-                    fixes++;
-                }
-            }
+// Re-check the pointers left in a repaired pointer block
+int verify_pointer_block(PointerBlock *repaired) {
+    int fixes = 0, errors = 0;
+    if (repaired->depth == 0) return verify_directory_block(repaired);
+    uint32_t *pointers = (uint32_t *)repaired->data;
+    for (uint32_t k = 0; k < POINTERS_PER_BLOCK; k++) {
+        if (pointers[k] == 0) continue;
+        if (is_bad_block(pointers[k])) {
+            report(FINDING_BAD_INDIRECT_POINTER, repaired->inode, pointers[k], repaired->block, 0, pointers[k]);
+            errors++;
+        } else {
+            errors += check_data_block(pointers[k], 0, &fixes);
         }
     }
-    return fixes;
+    return errors;
 }
 
-// Check for bad blocks
-int check_bad_blocks() {
-    int errors = 0;
-    for (uint32_t i = 0; i < INODE_COUNT; i++) {
-        if (inodes[i].links_count > 0 && inodes[i].dtime == 0) {
-            for (int j = 0; j < 12; j++) {
-                if (inodes[i].direct[j] != 0 && 
-                    (inodes[i].direct[j] < DATA_BLOCK_START || inodes[i].direct[j] >= TOTAL_BLOCKS)) {
-                    printf("Inode %u: Bad block pointer %u\n", i, inodes[i].direct[j]);
-                    errors++;
+// Re-check only the blocks touched by repairs: read them back, compare them
+// with what was written and re-run the checks that cover them
+int verify_repairs() {
+    int errors = 0, fixes = 0;
+    uint8_t buffer[BLOCK_SIZE];
+
+    for (uint32_t block = next_dirty_block(0); block < ctx->geo.total_blocks; block = next_dirty_block(block + 1)) {
+        uint8_t *cached = cached_block(block);
+        int written = ctx->overlay_fd >= 0
+                          ? transfer_file(ctx->overlay_fd, 0, buffer, BLOCK_SIZE, overlay_offset(&ctx->overlay, block)) == 0
+                          : read_block(block, buffer) == BLOCK_SIZE;
+        if ((!ctx->image_map || ctx->map_private) && (!written || memcmp(buffer, cached, BLOCK_SIZE) != 0)) {
+            report(FINDING_REPAIR_NOT_WRITTEN, 0, block, 0, 0, 0);
+            errors++;
+        }
+
+        if (block == SUPERBLOCK_BLOCK) {
+            errors += validate_superblock(ctx->superblock);
+            errors += check_superblock_checksum(ctx->superblock, 0, &fixes);
+            errors += check_bitmap_checksums(0, &fixes);
+        } else if (block >= ctx->geo.inode_bitmap_block && block - ctx->geo.inode_bitmap_block < ctx->geo.inode_bitmap_blocks) {
+            uint64_t first = (uint64_t)(block - ctx->geo.inode_bitmap_block) * BITS_PER_BLOCK;
+            for (uint64_t group = first; group < first + BITS_PER_BLOCK && group < ctx->geo.inode_count; group += 64) {
+                uint64_t diff = inode_bitmap_diff(group);
+                while (diff) {
+                    errors += check_inode_bitmap(group + __builtin_ctzll(diff), 0, &fixes);
+                    diff &= diff - 1;
                 }
             }
+        } else if (block >= ctx->geo.data_bitmap_block && block - ctx->geo.data_bitmap_block < ctx->geo.data_bitmap_blocks) {
+            uint64_t first = (uint64_t)(block - ctx->geo.data_bitmap_block) * BITS_PER_BLOCK;
+            uint64_t last = first + BITS_PER_BLOCK;
+            if (first < ctx->geo.first_data_block) first = ctx->geo.first_data_block;
+            if (last > ctx->geo.total_blocks) last = ctx->geo.total_blocks;
+            if (first < last) errors += sweep_data_blocks(first, last, 0, &fixes);
+        } else if (block >= ctx->geo.inode_table_start && block - ctx->geo.inode_table_start < ctx->geo.inode_table_blocks) {
+            uint64_t first = (uint64_t)(block - ctx->geo.inode_table_start) * INODES_PER_BLOCK;
+            for (uint64_t i = first; i < first + INODES_PER_BLOCK && i < ctx->geo.inode_count; i++) {
+                errors += check_inode_checksum(i, 0, &fixes);
+                errors += verify_inode(i);
+            }
+        } else if (find_pointer_block(block)) {
+            errors += verify_pointer_block(find_pointer_block(block));
         }
     }
     return errors;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <vsfs.img>\n", argv[0]);
-        return 1;
+// Count one free extent
+void add_free_extent(VsfsAnalysis *analysis, uint64_t start, uint64_t length) {
+    analysis->free_blocks += length;
+    analysis->free_extents++;
+    analysis->free_extent_histogram[63 - __builtin_clzll(length)]++;
+    if (length > analysis->largest_free_length) {
+        analysis->largest_free_start = start;
+        analysis->largest_free_length = length;
+    }
+}
+
+// Find the free extents of the data region in one pass over the data
+// bitmap. Whole words extend or close the current run at once; inside a
+// mixed word, count-trailing-zeros jumps from one run boundary to the next.
+void scan_free_extents(VsfsAnalysis *analysis) {
+    uint64_t first = ctx->geo.first_data_block, last = ctx->geo.total_blocks;
+    uint64_t start = 0, run = 0;
+    for (uint64_t word = first / 64; word * 64 < last; word++) {
+        uint64_t mask = range_mask(word, first, last);
+        uint64_t free = ~bitmap_word(ctx->data_bitmap, word) & mask;
+        if (free == mask && run > 0) {
+            run += __builtin_popcountll(mask);
+            continue;
+        }
+        int bit = __builtin_ctzll(mask), end = 64 - __builtin_clzll(mask);
+        while (bit < end) {
+            uint64_t rest = free >> bit;
+            if (rest & 1) {
+                int n = ~rest ? __builtin_ctzll(~rest) : 64 - bit;
+                if (n > end - bit) n = end - bit;
+                if (run == 0) start = word * 64 + bit;
+                run += n;
+                bit += n;
+            } else {
+                if (run > 0) add_free_extent(analysis, start, run);
+                run = 0;
+                if (rest == 0) break;
+                bit += __builtin_ctzll(rest);
+            }
+        }
+    }
+    if (run > 0) add_free_extent(analysis, start, run);
+}
+
+// Add one data block to the end of a span
+void extend_span(Span *span, uint32_t block) {
+    if (span->blocks == 0) {
+        span->first = block;
+        span->fragments = 1;
+    } else if (block != span->last + 1) {
+        span->fragments++;
+    }
+    span->last = block;
+    span->blocks++;
+}
+
+// Add the blocks of a later span to the end of a span
+void join_span(Span *span, const Span *part) {
+    if (!part || part->blocks == 0) return;
+    if (span->blocks == 0) {
+        span->first = part->first;
+        span->fragments = part->fragments;
+    } else {
+        span->fragments += part->fragments - (part->first == span->last + 1);
+    }
+    span->last = part->last;
+    span->blocks += part->blocks;
+}
+
+// Compare spans by block number
+int compare_spans(const void *a, const void *b) {
+    uint32_t x = ((const Span *)a)->block, y = ((const Span *)b)->block;
+    return x < y ? -1 : x > y;
+}
+
+// Span of a pointer block, or NULL if it was not visited
+Span *find_span(SpanTable *table, uint32_t block) {
+    Span key = { .block = block };
+    if (table->span_count == 0) return NULL;
+    return bsearch(&key, table->spans, table->span_count, sizeof(Span), compare_spans);
+}
+
+// Append a span, growing the table
+int append_span(SpanTable *table, Span *span) {
+    if (table->span_count == table->span_capacity) {
+        size_t capacity = table->span_capacity ? table->span_capacity * 2 : 256;
+        Span *spans = realloc(table->spans, capacity * sizeof(Span));
+        if (!spans) {
+            ctx->out_of_memory = 1;
+            return -1;
+        }
+        table->spans = spans;
+        table->span_capacity = capacity;
+    }
+    table->spans[table->span_count++] = *span;
+    return 0;
+}
+
+// Sum up a leaf pointer block, or keep an upper one and queue its children
+void visit_span_block(IndirectRef *ref, uint8_t *data, void *arg) {
+    SpanWalk *walk = arg;
+    SpanTable *table = walk->table;
+    // A block shared by several trees is only summed up once
+    if (ref > walk->level->refs && ref->block == ref[-1].block) return;
+    PointerBlock *held = find_pointer_block(ref->block);
+    if (held) data = held->data;
+    if (!data) return;
+    ctx->stats.pointer_blocks_visited++;
+
+    uint32_t *pointers = (uint32_t *)data;
+    if (ref->depth == 1) {
+        Span span = { .block = ref->block };
+        for (uint32_t k = 0; k < POINTERS_PER_BLOCK; k++) {
+            if (pointers[k] && !is_bad_block(pointers[k])) extend_span(&span, pointers[k]);
+        }
+        append_span(table, &span);
+        return;
+    }
+
+    if (table->upper_count == table->upper_capacity) {
+        size_t capacity = table->upper_capacity ? table->upper_capacity * 2 : 64;
+        PointerBlock *uppers = realloc(table->uppers, capacity * sizeof(PointerBlock));
+        if (!uppers) {
+            ctx->out_of_memory = 1;
+            return;
+        }
+        table->uppers = uppers;
+        table->upper_capacity = capacity;
+    }
+    PointerBlock *upper = &table->uppers[table->upper_count];
+    *upper = (PointerBlock){ ref->block, ref->inode, ref->depth, malloc(BLOCK_SIZE) };
+    if (!upper->data) {
+        ctx->out_of_memory = 1;
+        return;
+    }
+    memcpy(upper->data, data, BLOCK_SIZE);
+    table->upper_count++;
+    for (uint32_t k = 0; k < POINTERS_PER_BLOCK; k++) {
+        if (pointers[k] && !is_bad_block(pointers[k])) append_ref(walk->next, pointers[k], ref->inode, ref->depth - 1);
     }
+}
+
+// Read every file's pointer blocks level by level, in block order, and
+// work out the span under each of them, deepest trees last
+void collect_spans(SpanTable *table) {
+    RefList level = { 0 };
+    for (uint32_t i = 0; i < ctx->geo.inode_count; i++) {
+        if (!inode_in_use(&ctx->inodes[i])) continue;
+        for (int j = DIRECT_POINTERS; j < INODE_POINTERS; j++) {
+            uint32_t block = *inode_pointer(&ctx->inodes[i], j);
+            if (block && !is_bad_block(block)) append_ref(&level, block, i, slot_depth(j));
+        }
+    }
+    while (level.count > 0 && !ctx->out_of_memory) {
+        RefList next = { 0 };
+        SpanWalk walk = { table, &level, &next };
+        qsort(level.refs, level.count, sizeof(IndirectRef), compare_refs);
+        visit_pointer_blocks(&level, visit_span_block, &walk);
+        free(level.refs);
+        level = next;
+    }
+    free(level.refs);
+    qsort(table->spans, table->span_count, sizeof(Span), compare_spans);
+
+    // Upper blocks one depth at a time, so the spans below are always known
+    for (uint32_t depth = 2; depth <= 3 && !ctx->out_of_memory; depth++) {
+        size_t known = table->span_count;
+        for (size_t k = 0; k < table->upper_count; k++) {
+            PointerBlock *upper = &table->uppers[k];
+            if (upper->depth != depth) continue;
+            Span span = { .block = upper->block };
+            uint32_t *pointers = (uint32_t *)upper->data;
+            for (uint32_t p = 0; p < POINTERS_PER_BLOCK; p++) {
+                if (pointers[p]) join_span(&span, find_span(table, pointers[p]));
+            }
+            if (append_span(table, &span) < 0) break;
+        }
+        if (table->span_count > known) qsort(table->spans, table->span_count, sizeof(Span), compare_spans);
+    }
+}
+
+// Count one file's fragments, keeping the most fragmented files in order
+void add_file(VsfsAnalysis *analysis, uint32_t inode, Span *file) {
+    analysis->files++;
+    analysis->file_blocks += file->blocks;
+    analysis->fragments += file->fragments;
+    if (file->fragments > 1) analysis->fragmented_files++;
+    analysis->fragment_histogram[31 - __builtin_clz(file->fragments)]++;
+
+    int k = analysis->worst_count;
+    if (k == VSFS_WORST_FILES && file->fragments <= analysis->worst[k - 1].fragments) return;
+    if (k == VSFS_WORST_FILES) k--;
+    else analysis->worst_count++;
+    for (; k > 0 && analysis->worst[k - 1].fragments < file->fragments; k--) analysis->worst[k] = analysis->worst[k - 1];
+    analysis->worst[k] = (VsfsFileFragments){ inode, file->blocks, file->fragments };
+}
+
+int vsfsck_analyze(VsfsContext *c, VsfsAnalysis *analysis) {
+    ctx = c;
+    report_log = &ctx->main_log;
+    memset(analysis, 0, sizeof(*analysis));
+    if (!ctx->inodes || !ctx->data_bitmap) {
+        fprintf(stderr, "No checked image to analyze\n");
+        return -1;
+    }
+    double start = now();
+    if (!ctx->image_map) reader_open();
+    scan_free_extents(analysis);
+
+    SpanTable table = { 0 };
+    collect_spans(&table);
+    for (uint32_t i = 0; i < ctx->geo.inode_count && !ctx->out_of_memory; i++) {
+        if (!inode_in_use(&ctx->inodes[i])) continue;
+        Span file = { 0 };
+        for (int j = 0; j < INODE_POINTERS; j++) {
+            uint32_t block = *inode_pointer(&ctx->inodes[i], j);
+            if (block == 0 || is_bad_block(block)) continue;
+            if (slot_depth(j) == 0) extend_span(&file, block);
+            else join_span(&file, find_span(&table, block));
+        }
+        if (file.blocks > 0) add_file(analysis, i, &file);
+    }
+
+    for (size_t k = 0; k < table.upper_count; k++) free(table.uppers[k].data);
+    free(table.uppers);
+    free(table.spans);
+    phase_done(STATS_ANALYZE, &start);
+    if (ctx->out_of_memory) {
+        fprintf(stderr, "Out of memory while analyzing the image\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Map which blocks of a sparse image file hold data by walking its extents
+// with SEEK_DATA and SEEK_HOLE. Reads of blocks in holes are answered with
+// zeros without touching the file. An image without holes, a block device
+// or a file system that cannot tell gets no map: every block holds data.
+void map_extents() {
+    off_t end = (off_t)ctx->image_blocks * BLOCK_SIZE;
+    uint64_t words = (ctx->image_blocks + 63) / 64, data_blocks = 0;
+    ctx->image_data = reserve(&ctx->extent_buffer, words * sizeof(uint64_t));
+    if (!ctx->image_data) return;
+    memset(ctx->image_data, 0, words * sizeof(uint64_t));
+
+    off_t data = 0;
+    while (data < end) {
+        data = lseek(ctx->fd, data, SEEK_DATA);
+        count_syscall();
+        if (data < 0 && errno == ENXIO) break;
+        off_t hole = data < 0 ? -1 : lseek(ctx->fd, data, SEEK_HOLE);
+        count_syscall();
+        if (hole < 0) {
+            ctx->image_data = NULL;
+            return;
+        }
+        if (hole > end) hole = end;
+
+        // Blocks partly covered by data count as data
+        uint64_t first = data / BLOCK_SIZE, last = (hole + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        for (uint64_t word = first / 64; word * 64 < last; word++) ctx->image_data[word] |= range_mask(word, first, last);
+        data_blocks += last - first;
+        data = hole;
+    }
+    if (data_blocks == ctx->image_blocks) ctx->image_data = NULL;
+}
+
+// Forget the previous image before opening the next one
+void reset_image() {
+    ctx->geo = (Geometry){ 0 };
+    ctx->image_blocks = 0;
+    ctx->image_data = NULL;
+    ctx->superblock = NULL;
+    ctx->out_of_memory = 0;
+    ctx->read_failed = 0;
+    ctx->record_trees = 0;
+    ctx->image_in_memory = 0;
+    ctx->map_private = 0;
+    ctx->main_log.count = 0;
+    memset(ctx->main_log.counts, 0, sizeof(ctx->main_log.counts));
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+}
+
+// Refuse images too small to hold a file system
+int check_image_size() {
+    if (ctx->image_blocks >= MIN_TOTAL_BLOCKS) return 0;
+    fprintf(stderr, "Image too small: %llu blocks, need at least %u\n",
+            (unsigned long long)ctx->image_blocks, MIN_TOTAL_BLOCKS);
+    return -1;
+}
+
+void vsfsck_default_options(VsfsOptions *options) {
+    memset(options, 0, sizeof(*options));
+    options->threads = 1;
+    options->io_backend = IO_URING;
+    options->queue_depth = DEFAULT_QUEUE_DEPTH;
+    options->format = REPORT_TEXT;
+}
+
+VsfsContext *vsfsck_new(const VsfsOptions *options) {
+    VsfsContext *c = calloc(1, sizeof(VsfsContext));
+    if (!c) return NULL;
+    c->scan_threads = options->threads < 1 ? 1 : options->threads > MAX_THREADS ? MAX_THREADS : options->threads;
+    c->io_backend = options->io_backend;
+    c->queue_depth = options->queue_depth < 1 ? DEFAULT_QUEUE_DEPTH : options->queue_depth;
+    if (c->queue_depth > MAX_QUEUE_DEPTH) c->queue_depth = MAX_QUEUE_DEPTH;
+    c->use_mmap = options->use_mmap;
+    c->journal_path = options->journal_path;
+    c->cache_path = options->cache_path;
+    c->overlay_path = options->overlay_path;
+    c->clone_duplicates = options->clone_duplicates;
+    c->enable_checksums = options->enable_checksums;
+    c->report_format = options->format;
+    c->report_summary = options->summary;
+    c->out = options->out;
+    c->info_out = options->info;
+    c->fd = -1;
+    c->overlay_fd = -1;
+    return c;
+}
+
+void vsfsck_free(VsfsContext *c) {
+    if (!c) return;
+    ctx = c;
+    if (ctx->fd >= 0 || ctx->image_map || ctx->overlay_fd >= 0) vsfsck_close(c);
+    reader_close();
+    free(ctx->pointer_blocks);
+    free(ctx->clones.refs);
+    free(ctx->tree_records);
+    free(ctx->main_log.records);
+    release(&ctx->seen_buffer);
+    release(&ctx->extent_buffer);
+    release(&ctx->shared_buffer);
+    release(&ctx->claimed_buffer);
+    release(&ctx->dirty_buffer);
+    release(&ctx->inode_bitmap_buffer);
+    release(&ctx->data_bitmap_buffer);
+    release(&ctx->inode_buffer);
+    free(ctx->run_slots);
+    free(ctx->run_buffers);
+    free(c);
+    ctx = NULL;
+}
 
-    fd = open(argv[1], O_RDWR);
-    if (fd < 0) {
+int vsfsck_open(VsfsContext *c, const char *path) {
+    ctx = c;
+    reset_image();
+    if (ctx->overlay_path && ctx->journal_path) {
+        fprintf(stderr, "Repairs sent to an overlay cannot be journaled\n");
+        return -1;
+    }
+    // With an overlay the image is only ever read
+    ctx->fd = open(path, ctx->overlay_path ? O_RDONLY : O_RDWR);
+    if (ctx->fd < 0) {
         perror("Failed to open image");
-        return 1;
+        return -1;
+    }
+    if (get_image_blocks(&ctx->image_blocks) < 0) {
+        perror("Failed to stat image");
+        vsfsck_close(c);
+        return -1;
+    }
+    if (check_image_size() < 0) {
+        vsfsck_close(c);
+        return -1;
+    }
+    map_extents();
+    return 0;
+}
+
+int vsfsck_open_buffer(VsfsContext *c, void *data, size_t len) {
+    ctx = c;
+    reset_image();
+    if (ctx->journal_path || ctx->overlay_path) {
+        fprintf(stderr, "Repairs to a memory image cannot be journaled or sent to an overlay\n");
+        return -1;
+    }
+    ctx->image_map = data;
+    ctx->image_map_len = len;
+    ctx->image_in_memory = 1;
+    ctx->image_blocks = len / BLOCK_SIZE;
+    if (check_image_size() < 0) {
+        vsfsck_close(c);
+        return -1;
+    }
+    return 0;
+}
+
+int vsfsck_replay(VsfsContext *c, const char *journal_path, int undo) {
+    ctx = c;
+    report_log = &ctx->main_log;
+    if (ctx->fd < 0) {
+        fprintf(stderr, "Journals can only be applied to image files\n");
+        return -1;
     }
+    return apply_journal(journal_path, undo) < 0 ? -1 : 0;
+}
+
+int vsfsck_merge_overlay(VsfsContext *c, const char *overlay_path) {
+    ctx = c;
+    report_log = &ctx->main_log;
+    if (ctx->fd < 0 || ctx->overlay_path) {
+        fprintf(stderr, "Overlays can only be merged into image files opened for writing\n");
+        return -1;
+    }
+    return merge_overlay(overlay_path) < 0 ? -1 : 0;
+}
+
+int vsfsck_check(VsfsContext *c, VsfsResult *result) {
+    ctx = c;
+    report_log = &ctx->main_log;
+    memset(result, 0, sizeof(*result));
+    ctx->map_private = ctx->journal_path != NULL || ctx->overlay_path != NULL;
+    struct rusage usage;
+    long faults = getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_majflt : 0;
+    double start = now();
+    // An overlay is laid over a private mapping of the read-only image
+    if ((ctx->use_mmap || ctx->overlay_path) && !ctx->image_map && map_image() < 0) {
+        perror("Failed to map image");
+        return -1;
+    }
+    if (ctx->overlay_path && ctx->overlay_fd < 0 && load_overlay() < 0) return -1;
 
     int errors = 0, fixes = 0;
-    
-    // Read superblock
-    Superblock sb;
-    if (read_block(0, &sb) < 0) {
+    ctx->unrepaired = 0;
+
+    // Read superblock (in place when mapped)
+    ctx->superblock = &ctx->superblock_copy;
+    if (ctx->image_map) {
+        ctx->superblock = (Superblock *)mapped_block(SUPERBLOCK_BLOCK);
+    } else if (read_block(SUPERBLOCK_BLOCK, ctx->superblock) < 0) {
         perror("Failed to read superblock");
-        close(fd);
-        return 1;
+        return -1;
     }
-    
-    // Validate and fix superblock
-    errors += validate_superblock(&sb);
-    fixes += fix_superblock(&sb);
-    if (fixes > 0) {
-        if (write_block(0, &sb) < 0) {
-            perror("Failed to write superblock");
-            close(fd);
-            return 1;
+
+    // Validate and fix superblock, its checksum first since it covers the
+    // superblock as read
+    ctx->verify_checksums = (ctx->superblock->features & FEATURE_CHECKSUMS) != 0;
+    ctx->keep_checksums = ctx->verify_checksums;
+    int sb_fixes = 0;
+    errors += check_superblock_checksum(ctx->superblock, 1, &sb_fixes);
+    errors += validate_superblock(ctx->superblock);
+    sb_fixes += fix_superblock(ctx->superblock);
+    fixes += sb_fixes;
+
+    phase_done(STATS_SUPERBLOCK, &start);
+
+    // Size bitmaps and inode table from the superblock
+    load_geometry(ctx->superblock);
+    if (alloc_tables() < 0) {
+        perror("Failed to allocate tables");
+        return -1;
+    }
+    if (sb_fixes > 0) mark_block_dirty(SUPERBLOCK_BLOCK);
+    add_checksums();
+
+    // Read bitmaps and inode table
+    if (!ctx->image_map) reader_open();
+    if (read_tables() < 0) return -1;
+    errors += check_bitmap_checksums(1, &fixes);
+    phase_done(STATS_LOAD, &start);
+
+    // With a digest cache, first try to confirm the image is still clean
+    // from only the blocks that changed since the last clean run
+    DigestCache cache = { 0 };
+    uint8_t *changed = NULL;
+    int unchanged = 0, status = -1;
+    ctx->record_trees = ctx->cache_path != NULL;
+    if (ctx->cache_path && load_cache(ctx->cache_path, &cache) == 0) {
+        int found = incremental_check(&cache, &changed);
+        unchanged = found == 0;
+        if (found > 0) report_info("Digest cache: changes need a full check\n");
+    }
+    phase_done(STATS_DIGEST, &start);
+
+    // Check and fix consistency in one pass; it times its own phases
+    if (!unchanged) {
+        ctx->tree_record_count = 0;
+        errors += check_filesystem(1, &fixes);
+    }
+    start = now();
+    if (ctx->out_of_memory) {
+        fprintf(stderr, "Out of memory while checking the image\n");
+        goto done;
+    }
+    if (ctx->read_failed) {
+        fprintf(stderr, "Failed to read inode table; no repairs written\n");
+        goto done;
+    }
+
+    update_checksums();
+
+    // Journal the repairs before any of them reaches the image
+    if (ctx->journal_path && next_dirty_block(0) < ctx->geo.total_blocks && write_journal(ctx->journal_path) < 0) {
+        perror("Failed to write journal");
+        goto done;
+    }
+    phase_done(STATS_JOURNAL, &start);
+
+    if (ctx->overlay_fd >= 0) {
+        if (write_overlay() < 0) {
+            perror("Failed to write overlay");
+            goto done;
         }
+    } else if (ctx->image_map && !ctx->map_private) {
+        // Repairs were made in place, flush only what changed
+        if (!ctx->image_in_memory && sync_dirty_blocks() < 0) {
+            perror("Failed to sync repairs");
+            goto done;
+        }
+    } else if (write_dirty_blocks(ctx->fd, 0) < 0) {
+        perror("Failed to write repairs");
+        goto done;
     }
-    
-    // Read bitmaps
-    if (read_block(INODE_BITMAP_BLOCK, inode_bitmap) < 0 ||
-        read_block(DATA_BITMAP_BLOCK, data_bitmap) < 0) {
-        perror("Failed to read bitmaps");
-        close(fd);
-        return 1;
+    phase_done(STATS_WRITE_BACK, &start);
+
+    // Re-check only what the repairs touched; what could not be repaired
+    // is still there
+    report_info("\nRe-checking file system after fixes...\n");
+    errors = verify_repairs() + ctx->unrepaired;
+    phase_done(STATS_RECHECK, &start);
+
+    flush_findings();
+    if (ctx->report_summary && ctx->out) print_summary(ctx->out, ctx->report_format, ctx->main_log.counts);
+    report_info("\nTotal errors found initially: %d\n", errors + fixes);
+    report_info("Total fixes applied: %d\n", fixes);
+    report_info("Total errors after fixes: %d\n", errors);
+
+    // Only a clean image is worth remembering
+    if (ctx->cache_path && errors == 0 && !ctx->out_of_memory &&
+        write_cache(ctx->cache_path, unchanged ? &cache : NULL, changed) < 0) {
+        perror("Failed to write digest cache");
     }
-    
-    // Read inode table
-    for (int i = 0; i < 5; i++) {
-        if (read_block(INODE_TABLE_START + i, &inodes[i * (BLOCK_SIZE / INODE_SIZE)]) < 0) {
-            perror("Failed to read inode table");
-            close(fd);
-            return 1;
+    phase_done(STATS_DIGEST, &start);
+    result->found = errors + fixes;
+    result->fixes = fixes;
+    result->errors = errors;
+    result->unchanged = unchanged;
+    status = 0;
+
+done:
+    free_cache(&cache);
+    free(changed);
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        ctx->stats.peak_rss_kb = usage.ru_maxrss;
+        ctx->stats.major_faults = usage.ru_majflt - faults;
+    }
+    return status;
+}
+
+const Finding *vsfsck_findings(VsfsContext *c, size_t *count) {
+    *count = c->main_log.count;
+    return c->main_log.records;
+}
+
+const uint64_t *vsfsck_finding_counts(VsfsContext *c) {
+    return c->main_log.counts;
+}
+
+const char *vsfsck_finding_name(FindingKind kind) {
+    return kind < FINDING_KIND_COUNT ? finding_formats[kind].name : "unknown";
+}
+
+const VsfsStats *vsfsck_stats(VsfsContext *c) {
+    return &c->stats;
+}
+
+const char *vsfsck_phase_name(StatsPhase phase) {
+    return phase < STATS_PHASE_COUNT ? phase_names[phase] : "unknown";
+}
+
+void vsfsck_write_finding(FILE *out, ReportFormat format, const Finding *f) {
+    write_finding(out, format, f);
+}
+
+void vsfsck_close(VsfsContext *c) {
+    ctx = c;
+    flush_findings();
+    wait_table_reads(ctx->geo.inode_count);
+    free_tables();
+    unmap_image();
+    if (ctx->fd >= 0) close(ctx->fd);
+    if (ctx->overlay_fd >= 0) close(ctx->overlay_fd);
+    free(ctx->overlay_index);
+    ctx->overlay_index = NULL;
+    ctx->fd = -1;
+    ctx->overlay_fd = -1;
+}
+
+#ifndef VSFSCK_LIBRARY
+
+// Images of a batch run, handed out to the workers in list order
+typedef struct {
+    char **paths;
+    size_t count;
+    size_t next;
+    const VsfsOptions *options;
+    pthread_mutex_t lock;
+    size_t done;
+    int failed;
+    int unclean;
+    uint64_t counts[FINDING_KIND_COUNT];
+    VsfsStats stats;
+} Batch;
+
+// Counters of a VsfsStats, by name
+typedef struct {
+    const char *name;
+    size_t offset;
+} StatsCounter;
+
+const StatsCounter stats_counters[] = {
+    { "syscalls", offsetof(VsfsStats, syscalls) },
+    { "blocks_read", offsetof(VsfsStats, blocks_read) },
+    { "blocks_written", offsetof(VsfsStats, blocks_written) },
+    { "bytes_read", offsetof(VsfsStats, bytes_read) },
+    { "bytes_written", offsetof(VsfsStats, bytes_written) },
+    { "hole_blocks", offsetof(VsfsStats, hole_blocks) },
+    { "inodes_visited", offsetof(VsfsStats, inodes_visited) },
+    { "pointer_blocks_visited", offsetof(VsfsStats, pointer_blocks_visited) },
+    { "directory_blocks_visited", offsetof(VsfsStats, directory_blocks_visited) },
+    { "major_faults", offsetof(VsfsStats, major_faults) },
+};
+#define STATS_COUNTERS (sizeof(stats_counters) / sizeof(stats_counters[0]))
+
+// Value of one named counter
+uint64_t stats_counter(const VsfsStats *stats, int k) {
+    return *(const uint64_t *)((const uint8_t *)stats + stats_counters[k].offset);
+}
+
+// Print the --stats table: phase times, counters and findings per kind
+void print_stats(FILE *out, const VsfsStats *stats, const uint64_t *counts) {
+    double total = 0;
+    fprintf(out, "\nPhase times (seconds):\n");
+    for (int phase = 0; phase < STATS_PHASE_COUNT; phase++) {
+        fprintf(out, "  %-26s %12.6f\n", phase_names[phase], stats->phase_seconds[phase]);
+        total += stats->phase_seconds[phase];
+    }
+    fprintf(out, "  %-26s %12.6f\n", "total", total);
+    fprintf(out, "Counters:\n");
+    for (size_t k = 0; k < STATS_COUNTERS; k++) {
+        fprintf(out, "  %-26s %12llu\n", stats_counters[k].name, (unsigned long long)stats_counter(stats, k));
+    }
+    fprintf(out, "  %-26s %12ld\n", "peak_rss_kb", stats->peak_rss_kb);
+    fprintf(out, "Findings:\n");
+    for (int kind = 0; kind < FINDING_KIND_COUNT; kind++) {
+        if (counts[kind]) fprintf(out, "  %-26s %12llu\n", finding_formats[kind].name, (unsigned long long)counts[kind]);
+    }
+}
+
+// Write the statistics as one JSON object
+int write_stats_json(const char *path, const VsfsStats *stats, const uint64_t *counts) {
+    FILE *file = fopen(path, "w");
+    if (!file) return -1;
+    fprintf(file, "{\"phases\":{");
+    for (int phase = 0; phase < STATS_PHASE_COUNT; phase++) {
+        fprintf(file, "%s\"%s\":%.6f", phase ? "," : "", phase_names[phase], stats->phase_seconds[phase]);
+    }
+    fprintf(file, "}");
+    for (size_t k = 0; k < STATS_COUNTERS; k++) {
+        fprintf(file, ",\"%s\":%llu", stats_counters[k].name, (unsigned long long)stats_counter(stats, k));
+    }
+    fprintf(file, ",\"peak_rss_kb\":%ld,\"findings\":{", stats->peak_rss_kb);
+    int first = 1;
+    for (int kind = 0; kind < FINDING_KIND_COUNT; kind++) {
+        if (!counts[kind]) continue;
+        fprintf(file, "%s\"%s\":%llu", first ? "" : ",", finding_formats[kind].name, (unsigned long long)counts[kind]);
+        first = 0;
+    }
+    fprintf(file, "}}\n");
+    return fclose(file) == 0 ? 0 : -1;
+}
+
+// Add one image's statistics to a batch total; peak RSS is the process's
+void add_stats(VsfsStats *total, const VsfsStats *stats) {
+    for (int phase = 0; phase < STATS_PHASE_COUNT; phase++) total->phase_seconds[phase] += stats->phase_seconds[phase];
+    for (size_t k = 0; k < STATS_COUNTERS; k++) {
+        *(uint64_t *)((uint8_t *)total + stats_counters[k].offset) += stats_counter(stats, k);
+    }
+    if (stats->peak_rss_kb > total->peak_rss_kb) total->peak_rss_kb = stats->peak_rss_kb;
+}
+
+// Print one histogram of an analysis, skipping empty buckets
+void print_histogram(FILE *out, const uint64_t *buckets) {
+    for (int k = 0; k < VSFS_HISTOGRAM_BUCKETS; k++) {
+        if (buckets[k] == 0) continue;
+        unsigned long long low = 1ULL << k, high = (1ULL << (k + 1)) - 1;
+        char range[48];
+        if (low == high) snprintf(range, sizeof(range), "%llu", low);
+        else snprintf(range, sizeof(range), "%llu-%llu", low, high);
+        fprintf(out, "  %-26s %12llu\n", range, (unsigned long long)buckets[k]);
+    }
+}
+
+// Print the free space and fragmentation report
+void print_analysis(FILE *out, const VsfsAnalysis *analysis) {
+    fprintf(out, "\nFree space:\n");
+    fprintf(out, "  %-26s %12llu\n", "free_blocks", (unsigned long long)analysis->free_blocks);
+    fprintf(out, "  %-26s %12llu\n", "free_extents", (unsigned long long)analysis->free_extents);
+    fprintf(out, "  %-26s %12llu (at block %llu)\n", "largest_free_extent",
+            (unsigned long long)analysis->largest_free_length, (unsigned long long)analysis->largest_free_start);
+    fprintf(out, "Free extents by length in blocks:\n");
+    print_histogram(out, analysis->free_extent_histogram);
+    fprintf(out, "Files:\n");
+    fprintf(out, "  %-26s %12llu\n", "files", (unsigned long long)analysis->files);
+    fprintf(out, "  %-26s %12llu\n", "file_blocks", (unsigned long long)analysis->file_blocks);
+    fprintf(out, "  %-26s %12llu\n", "fragmented_files", (unsigned long long)analysis->fragmented_files);
+    fprintf(out, "  %-26s %12llu\n", "fragments", (unsigned long long)analysis->fragments);
+    fprintf(out, "Files by number of fragments:\n");
+    print_histogram(out, analysis->fragment_histogram);
+    if (analysis->worst_count > 0) fprintf(out, "Most fragmented files:\n");
+    for (int k = 0; k < analysis->worst_count; k++) {
+        const VsfsFileFragments *file = &analysis->worst[k];
+        fprintf(out, "  inode %-20u %12u fragments in %u blocks\n", file->inode, file->fragments, file->blocks);
+    }
+}
+
+// Print command line usage
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--mmap] [-j N] [--io uring|threads|sync] [--queue-depth N] [--journal FILE]\n", prog);
+    fprintf(stderr, "       [--cache FILE] [--overlay FILE] [--clone-duplicates] [--enable-checksums]\n");
+    fprintf(stderr, "       [--format FORMAT] [--summary] [--analyze] [--stats] [--stats-json FILE] <vsfs.img>\n");
+    fprintf(stderr, "       %s --replay FILE | --undo FILE | --merge-overlay FILE <vsfs.img>\n", prog);
+    fprintf(stderr, "       %s [--mmap] [-j N] [--io BACKEND] [--format text|jsonl] [--summary] [--stats]\n", prog);
+    fprintf(stderr, "       [--stats-json FILE] --batch LIST\n");
+    fprintf(stderr, "  --mmap          check and repair the image in place through a shared mapping\n");
+    fprintf(stderr, "  -j N            scan the inode table with N threads (1-%d)\n", MAX_THREADS);
+    fprintf(stderr, "  --io BACKEND    read the inode table and pointer blocks asynchronously through\n");
+    fprintf(stderr, "                  io_uring (default, falls back to threads), a pread thread pool,\n");
+    fprintf(stderr, "                  or synchronously\n");
+    fprintf(stderr, "  --queue-depth N reads kept in flight (1-%d, default %d)\n", MAX_QUEUE_DEPTH, DEFAULT_QUEUE_DEPTH);
+    fprintf(stderr, "  --journal FILE  record original and repaired blocks in FILE before writing repairs\n");
+    fprintf(stderr, "  --overlay FILE  leave the image untouched and write repairs to the sparse overlay\n");
+    fprintf(stderr, "                  FILE; blocks it already holds are read in place of the image's\n");
+    fprintf(stderr, "  --clone-duplicates\n");
+    fprintf(stderr, "                  give every extra owner of a shared data block its own copy (reflink\n");
+    fprintf(stderr, "                  or copy_file_range) instead of dropping the reference\n");
+    fprintf(stderr, "  --enable-checksums\n");
+    fprintf(stderr, "                  add CRC32C checksums of the superblock, bitmaps and inodes to an\n");
+    fprintf(stderr, "                  image without them; images with checksums are always verified\n");
+    fprintf(stderr, "  --cache FILE    keep block digests in FILE and only re-parse what changed since\n");
+    fprintf(stderr, "                  the last clean run\n");
+    fprintf(stderr, "  --format FORMAT write findings as text, jsonl or binary; other output goes to\n");
+    fprintf(stderr, "                  stderr unless FORMAT is text\n");
+    fprintf(stderr, "  --summary       only print the number of findings of each kind\n");
+    fprintf(stderr, "  --analyze       after the check, report free extents by length, the largest free\n");
+    fprintf(stderr, "                  run and the fragments of each file\n");
+    fprintf(stderr, "  --stats         print time per phase, I/O counters, peak RSS and findings per kind\n");
+    fprintf(stderr, "  --stats-json FILE\n");
+    fprintf(stderr, "                  write the same statistics to FILE as one JSON object\n");
+    fprintf(stderr, "  --replay FILE   re-apply the repairs recorded in a committed journal\n");
+    fprintf(stderr, "  --undo FILE     restore the original blocks recorded in a committed journal\n");
+    fprintf(stderr, "  --merge-overlay FILE\n");
+    fprintf(stderr, "                  write the repairs held in an overlay onto the image; delete the\n");
+    fprintf(stderr, "                  overlay instead to discard them\n");
+    fprintf(stderr, "  --batch LIST    check and repair every image named in LIST, one path per line,\n");
+    fprintf(stderr, "                  N images at a time with -j N\n");
+}
+
+// Read a batch list: one image path per line, blank lines and # comments skipped
+int read_batch_list(const char *path, Batch *batch) {
+    FILE *file = fopen(path, "r");
+    if (!file) return -1;
+    char *line = NULL;
+    size_t len = 0, capacity = 0;
+    ssize_t n;
+    while ((n = getline(&line, &len, file)) >= 0) {
+        while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r')) line[--n] = '\0';
+        if (n == 0 || line[0] == '#') continue;
+        if (batch->count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            char **paths = realloc(batch->paths, capacity * sizeof(char *));
+            if (!paths) break;
+            batch->paths = paths;
         }
+        if (!(batch->paths[batch->count] = strdup(line))) break;
+        batch->count++;
+    }
+    int ok = !ferror(file) && feof(file);
+    free(line);
+    fclose(file);
+    return ok ? 0 : -1;
+}
+
+// Write a string as a JSON string literal
+void write_json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fprintf(out, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20) fprintf(out, "\\u%04x", *s);
+        else fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+// Print one image's outcome followed by its findings; called with the batch lock held
+void print_batch_image(Batch *batch, VsfsContext *c, const char *path, VsfsResult *result) {
+    ReportFormat format = batch->options->format;
+    if (format == REPORT_JSONL) {
+        fputs("{\"image\":", stdout);
+        write_json_string(stdout, path);
+        if (result) printf(",\"found\":%d,\"fixes\":%d,\"errors\":%d}\n", result->found, result->fixes, result->errors);
+        else printf(",\"failed\":true}\n");
+    } else if (result) {
+        printf("%s: %d errors found, %d fixes applied, %d errors after fixes\n", path, result->found, result->fixes,
+               result->errors);
+    } else {
+        printf("%s: check failed\n", path);
+    }
+    if (!result) batch->failed++;
+    else if (result->errors > 0) batch->unclean++;
+
+    size_t count;
+    const Finding *findings = vsfsck_findings(c, &count);
+    for (size_t k = 0; k < count; k++) {
+        if (format == REPORT_TEXT) fputs("  ", stdout);
+        write_finding(stdout, format, &findings[k]);
+    }
+    const uint64_t *counts = vsfsck_finding_counts(c);
+    for (int kind = 0; kind < FINDING_KIND_COUNT; kind++) batch->counts[kind] += counts[kind];
+    add_stats(&batch->stats, vsfsck_stats(c));
+    batch->done++;
+}
+
+// Batch worker: check images with one context, reused from image to image
+void *batch_worker(void *arg) {
+    Batch *batch = arg;
+    VsfsOptions options = *batch->options;
+    options.threads = 1;
+    options.out = NULL;
+    options.info = NULL;
+    VsfsContext *c = vsfsck_new(&options);
+    if (!c) return NULL;
+
+    for (;;) {
+        size_t k = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+        if (k >= batch->count) break;
+        VsfsResult result;
+        int ok = vsfsck_open(c, batch->paths[k]) == 0;
+        if (ok) ok = vsfsck_check(c, &result) == 0;
+        pthread_mutex_lock(&batch->lock);
+        print_batch_image(batch, c, batch->paths[k], ok ? &result : NULL);
+        pthread_mutex_unlock(&batch->lock);
+        vsfsck_close(c);
     }
-    
-    // Check and fix consistency
-    errors += check_bitmaps();
-    errors += check_duplicates();
-    errors += check_bad_blocks();
-    
-    fixes += fix_bitmaps();
-    fixes += fix_duplicates();
-    fixes += fix_bad_blocks();
-    
-    // Write back modified bitmaps
-    if (write_block(INODE_BITMAP_BLOCK, inode_bitmap) < 0 ||
-        write_block(DATA_BITMAP_BLOCK, data_bitmap) < 0) {
-        perror("Failed to write bitmaps");
-        close(fd);
+    vsfsck_free(c);
+    return NULL;
+}
+
+// Check every image of a batch list with threads workers in this process
+int run_batch(const char *list, const VsfsOptions *options, int stats, const char *stats_path) {
+    Batch batch = { 0 };
+    batch.options = options;
+    if (read_batch_list(list, &batch) < 0) {
+        perror("Failed to read batch list");
+        for (size_t k = 0; k < batch.count; k++) free(batch.paths[k]);
+        free(batch.paths);
         return 1;
     }
-    
-    // Write back modified inodes
-    for (int i = 0; i < 5; i++) {
-        if (write_block(INODE_TABLE_START + i, &inodes[i * (BLOCK_SIZE / INODE_SIZE)]) < 0) {
-            perror("Failed to write inode table");
-            close(fd);
+    pthread_mutex_init(&batch.lock, NULL);
+
+    pthread_t threads[MAX_THREADS];
+    int workers = (size_t)options->threads < batch.count ? options->threads : (int)batch.count;
+    int started = 0;
+    for (; started < workers; started++) {
+        if (pthread_create(&threads[started], NULL, batch_worker, &batch) != 0) break;
+    }
+    // With no thread to spare, check the images on this thread
+    if (started == 0) batch_worker(&batch);
+    for (int t = 0; t < started; t++) pthread_join(threads[t], NULL);
+
+    // Images no worker could take count as failed
+    batch.failed += batch.count - batch.done;
+    if (options->summary) print_summary(stdout, options->format, batch.counts);
+    fflush(stdout);
+    fprintf(options->info, "\nImages checked: %zu, failed: %d, with errors after fixes: %d\n", batch.count,
+            batch.failed, batch.unclean);
+    if (stats) print_stats(options->info, &batch.stats, batch.counts);
+    if (stats_path && write_stats_json(stats_path, &batch.stats, batch.counts) < 0) {
+        perror("Failed to write statistics");
+    }
+
+    pthread_mutex_destroy(&batch.lock);
+    for (size_t k = 0; k < batch.count; k++) free(batch.paths[k]);
+    free(batch.paths);
+    return batch.failed || batch.unclean ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    int undo = 0, stats = 0, analyze = 0;
+    const char *path = NULL, *replay_path = NULL, *merge_path = NULL, *batch_path = NULL, *stats_path = NULL;
+    VsfsOptions options;
+    vsfsck_default_options(&options);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--mmap") == 0 || strcmp(argv[i], "-m") == 0) {
+            options.use_mmap = 1;
+        } else if (strncmp(argv[i], "-j", 2) == 0) {
+            const char *value = argv[i][2] ? argv[i] + 2 : (i + 1 < argc ? argv[++i] : "");
+            char *end;
+            long n = strtol(value, &end, 10);
+            if (*value == '\0' || *end != '\0' || n < 1 || n > MAX_THREADS) {
+                usage(argv[0]);
+                return 1;
+            }
+            options.threads = n;
+        } else if (strcmp(argv[i], "--io") == 0 && i + 1 < argc) {
+            const char *backend = argv[++i];
+            if (strcmp(backend, "uring") == 0) {
+                options.io_backend = IO_URING;
+            } else if (strcmp(backend, "threads") == 0) {
+                options.io_backend = IO_THREADS;
+            } else if (strcmp(backend, "sync") == 0) {
+                options.io_backend = IO_SYNC;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--queue-depth") == 0 && i + 1 < argc) {
+            char *end;
+            long n = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || n < 1 || n > MAX_QUEUE_DEPTH) {
+                usage(argv[0]);
+                return 1;
+            }
+            options.queue_depth = n;
+        } else if (strcmp(argv[i], "--summary") == 0) {
+            options.summary = 1;
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            const char *format = argv[++i];
+            if (strcmp(format, "text") == 0) {
+                options.format = REPORT_TEXT;
+            } else if (strcmp(format, "jsonl") == 0) {
+                options.format = REPORT_JSONL;
+            } else if (strcmp(format, "binary") == 0) {
+                options.format = REPORT_BINARY;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            options.cache_path = argv[++i];
+        } else if (strcmp(argv[i], "--journal") == 0 && i + 1 < argc) {
+            options.journal_path = argv[++i];
+        } else if ((strcmp(argv[i], "--replay") == 0 || strcmp(argv[i], "--undo") == 0) && i + 1 < argc) {
+            undo = strcmp(argv[i], "--undo") == 0;
+            replay_path = argv[++i];
+        } else if (strcmp(argv[i], "--overlay") == 0 && i + 1 < argc) {
+            options.overlay_path = argv[++i];
+        } else if (strcmp(argv[i], "--merge-overlay") == 0 && i + 1 < argc) {
+            merge_path = argv[++i];
+        } else if (strcmp(argv[i], "--clone-duplicates") == 0) {
+            options.clone_duplicates = 1;
+        } else if (strcmp(argv[i], "--enable-checksums") == 0) {
+            options.enable_checksums = 1;
+        } else if (strcmp(argv[i], "--analyze") == 0) {
+            analyze = 1;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            stats = 1;
+        } else if (strcmp(argv[i], "--stats-json") == 0 && i + 1 < argc) {
+            stats_path = argv[++i];
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch_path = argv[++i];
+        } else if (argv[i][0] == '-' || path) {
+            usage(argv[0]);
             return 1;
+        } else {
+            path = argv[i];
         }
     }
-    
-    // Re-check file system
-    printf("\nRe-checking file system after fixes...\n");
-    errors = 0;
-    
-    // Re-read superblock
-    if (read_block(0, &sb) < 0) {
-        perror("Failed to re-read superblock");
-        close(fd);
+    // A batch has no single journal, cache, overlay or binary stream to write to
+    if (batch_path ? path || replay_path || merge_path || options.journal_path || options.cache_path ||
+                         options.overlay_path || analyze || options.format == REPORT_BINARY
+                   : !path || (replay_path && merge_path) || (merge_path && options.overlay_path)) {
+        usage(argv[0]);
         return 1;
     }
-    errors += validate_superblock(&sb);
-    
-    // Re-read bitmaps
-    if (read_block(INODE_BITMAP_BLOCK, inode_bitmap) < 0 ||
-        read_block(DATA_BITMAP_BLOCK, data_bitmap) < 0) {
-        perror("Failed to re-read bitmaps");
-        close(fd);
+
+    // Findings go out through one large buffer; with a machine-readable
+    // format, stdout carries only findings and everything else goes to stderr
+    setvbuf(stdout, NULL, _IOFBF, 1 << 20);
+    options.out = stdout;
+    options.info = options.format == REPORT_TEXT ? stdout : stderr;
+    if (batch_path) return run_batch(batch_path, &options, stats, stats_path);
+    if (options.format == REPORT_BINARY) {
+        ReportHeader header = { REPORT_MAGIC, sizeof(Finding), options.summary };
+        fwrite(&header, sizeof(header), 1, stdout);
+    }
+
+    VsfsContext *c = vsfsck_new(&options);
+    if (!c) {
+        perror("Failed to allocate context");
         return 1;
     }
-    
-    // Re-read inode table
-    for (int i = 0; i < 5; i++) {
-        if (read_block(INODE_TABLE_START + i, &inodes[i * (BLOCK_SIZE / INODE_SIZE)]) < 0) {
-            perror("Failed to re-read inode table");
-            close(fd);
-            return 1;
+    VsfsResult result;
+    int status = 1;
+    int checked = !replay_path && !merge_path;
+    if (vsfsck_open(c, path) == 0) {
+        if (replay_path) status = vsfsck_replay(c, replay_path, undo) < 0 ? 1 : 0;
+        else if (merge_path) status = vsfsck_merge_overlay(c, merge_path) < 0 ? 1 : 0;
+        else if (vsfsck_check(c, &result) == 0) {
+            status = result.errors > 0 ? 1 : 0;
+            VsfsAnalysis analysis;
+            if (analyze && vsfsck_analyze(c, &analysis) == 0) print_analysis(options.info, &analysis);
         }
     }
-    
-    // Re-run checks
-    errors += check_bitmaps();
-    errors += check_duplicates();
-    errors += check_bad_blocks();
-    
-    printf("\nTotal errors found initially: %d\n", errors + fixes);
-    printf("Total fixes applied: %d\n", fixes);
-    printf("Total errors after fixes: %d\n", errors);
-    
-    close(fd);
-    return errors > 0 ? 1 : 0;
-}
\ No newline at end of file
+    if (checked && stats) print_stats(options.info, vsfsck_stats(c), vsfsck_finding_counts(c));
+    if (checked && stats_path && write_stats_json(stats_path, vsfsck_stats(c), vsfsck_finding_counts(c)) < 0) {
+        perror("Failed to write statistics");
+    }
+    vsfsck_free(c);
+    return status;
+}
+
+#endif
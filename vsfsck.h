@@ -0,0 +1,270 @@
+#ifndef VSFSCK_H
+#define VSFSCK_H
+
+// libvsfsck: check and repair VSFS images from inside another program.
+// Build the library by compiling vsfsck.c with -DVSFSCK_LIBRARY, which
+// leaves out the command line front end (make libvsfsck.a does this):
+//   gcc -O2 -pthread -DVSFSCK_LIBRARY -c vsfsck.c
+//
+// A context holds everything one check needs. Contexts are independent, so
+// several images can be checked at once on different threads, one context
+// per thread. A context is meant to be reused: its tables, bitsets and read
+// buffers are kept from one image to the next and only grow.
+//
+//   VsfsOptions options;
+//   vsfsck_default_options(&options);
+//   VsfsContext *c = vsfsck_new(&options);
+//   if (vsfsck_open(c, "disk.img") == 0 && vsfsck_check(c, &result) == 0) {
+//       const Finding *findings = vsfsck_findings(c, &count);
+//       ...
+//   }
+//   vsfsck_close(c);
+//   vsfsck_free(c);
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Kinds of finding: problems found and the fixes applied for them
+typedef enum {
+    FINDING_SB_MAGIC,
+    FINDING_SB_BLOCK_SIZE,
+    FINDING_SB_TOTAL_BLOCKS,
+    FINDING_SB_INODE_BITMAP,
+    FINDING_SB_DATA_BITMAP,
+    FINDING_SB_INODE_TABLE,
+    FINDING_SB_FIRST_DATA,
+    FINDING_SB_INODE_SIZE,
+    FINDING_SB_INODE_COUNT,
+    FIX_SB_MAGIC,
+    FIX_SB_BLOCK_SIZE,
+    FIX_SB_TOTAL_BLOCKS,
+    FIX_SB_INODE_SIZE,
+    FIX_SB_INODE_COUNT,
+    FIX_SB_INODE_BITMAP,
+    FIX_SB_DATA_BITMAP,
+    FIX_SB_INODE_TABLE,
+    FIX_SB_FIRST_DATA,
+    FINDING_INODE_MARKED_INVALID,
+    FIX_INODE_BITMAP_CLEAR,
+    FINDING_INODE_NOT_MARKED,
+    FIX_INODE_BITMAP_SET,
+    FINDING_BAD_POINTER,
+    FIX_BAD_POINTER,
+    FIX_DUPLICATE,
+    FINDING_BAD_INDIRECT_POINTER,
+    FIX_BAD_INDIRECT_POINTER,
+    FIX_INDIRECT_DUPLICATE,
+    FINDING_UNREADABLE_INDIRECT,
+    FINDING_GARBAGE_INDIRECT,
+    FIX_GARBAGE_INDIRECT,
+    FINDING_DATA_SHARED,
+    FINDING_DATA_UNREFERENCED,
+    FIX_DATA_BITMAP_CLEAR,
+    FINDING_DATA_UNMARKED,
+    FIX_DATA_BITMAP_SET,
+    FINDING_REPAIR_NOT_WRITTEN,
+    FINDING_ROOT_NOT_DIRECTORY,
+    FINDING_UNREADABLE_DIRECTORY,
+    FINDING_DIRENT_INVALID,
+    FINDING_DIRENT_DUPLICATE,
+    FIX_DIRENT_REMOVE,
+    FINDING_DIR_CYCLE,
+    FINDING_DIR_HARD_LINK,
+    FINDING_ORPHAN,
+    FIX_ORPHAN,
+    FINDING_LINK_COUNT,
+    FIX_LINK_COUNT,
+    FIX_CLONE_DUPLICATE,
+    FINDING_INDIRECT_IN_HOLE,
+    FIX_INDIRECT_IN_HOLE,
+    FINDING_SB_CHECKSUM,
+    FIX_SB_CHECKSUM,
+    FINDING_BITMAP_CHECKSUM,
+    FIX_BITMAP_CHECKSUM,
+    FINDING_INODE_CHECKSUM,
+    FIX_INODE_CHECKSUM,
+    FINDING_KIND_COUNT
+} FindingKind;
+
+// One finding as recorded during the check
+typedef struct {
+    uint32_t kind;
+    uint32_t inode;
+    uint32_t block;
+    uint32_t parent;
+    uint64_t expected;
+    uint64_t actual;
+} Finding;
+
+// Ways of reading the image asynchronously
+typedef enum {
+    IO_SYNC,
+    IO_THREADS,
+    IO_URING
+} IoBackend;
+
+// Output formats for findings
+typedef enum {
+    REPORT_TEXT,
+    REPORT_JSONL,
+    REPORT_BINARY
+} ReportFormat;
+
+// Phases of a check whose time VsfsStats records. The inode table streams in
+// during the inode scan, so waiting for it counts as scan time. analyze is
+// the time spent in vsfsck_analyze.
+typedef enum {
+    STATS_SUPERBLOCK,
+    STATS_LOAD,
+    STATS_DIGEST,
+    STATS_INODE_SCAN,
+    STATS_INDIRECT_WALK,
+    STATS_DATA_SWEEP,
+    STATS_DIRECTORIES,
+    STATS_JOURNAL,
+    STATS_WRITE_BACK,
+    STATS_RECHECK,
+    STATS_ANALYZE,
+    STATS_PHASE_COUNT
+} StatsPhase;
+
+// Cost of the last check. syscalls counts the I/O calls made on the image
+// and journal; blocks count image blocks moved by them, bytes everything
+// they moved. hole_blocks counts blocks of a sparse image file answered
+// with zeros without a read. Mapped images are read through page faults
+// instead. Peak RSS and the major faults taken during the check are the
+// whole process's.
+typedef struct {
+    double phase_seconds[STATS_PHASE_COUNT];
+    uint64_t syscalls;
+    uint64_t blocks_read;
+    uint64_t blocks_written;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t hole_blocks;
+    uint64_t inodes_visited;
+    uint64_t pointer_blocks_visited;
+    uint64_t directory_blocks_visited;
+    uint64_t major_faults;
+    long peak_rss_kb;
+} VsfsStats;
+
+// How a context checks its images. clone_duplicates gives every extra
+// owner of a shared data block its own copy instead of dropping the
+// reference. overlay_path opens images read-only and sends repairs to a
+// sparse copy-on-write overlay file instead. enable_checksums turns on
+// metadata checksums for images that do not keep them yet; images that do
+// always have theirs verified and kept up to date. out receives findings
+// as they are found (NULL keeps them in the context for vsfsck_findings);
+// info receives the progress and total lines (NULL drops them).
+typedef struct {
+    int use_mmap;
+    int threads;
+    IoBackend io_backend;
+    int queue_depth;
+    const char *journal_path;
+    const char *cache_path;
+    const char *overlay_path;
+    int clone_duplicates;
+    int enable_checksums;
+    ReportFormat format;
+    int summary;
+    FILE *out;
+    FILE *info;
+} VsfsOptions;
+
+// Histogram buckets of an analysis: bucket k counts lengths from 2^k up to
+// 2^(k+1) - 1
+#define VSFS_HISTOGRAM_BUCKETS 33
+#define VSFS_WORST_FILES 10
+
+// Fragments of one file: runs of physically adjacent blocks in file order
+typedef struct {
+    uint32_t inode;
+    uint32_t blocks;
+    uint32_t fragments;
+} VsfsFileFragments;
+
+// Free space and fragmentation of a checked image. Free extents are runs
+// of clear bits in the data bitmap; files are the in-use inodes that hold
+// data blocks, and worst the most fragmented of them, most fragments first.
+typedef struct {
+    uint64_t free_blocks;
+    uint64_t free_extents;
+    uint64_t largest_free_start;
+    uint64_t largest_free_length;
+    uint64_t free_extent_histogram[VSFS_HISTOGRAM_BUCKETS];
+    uint64_t files;
+    uint64_t file_blocks;
+    uint64_t fragmented_files;
+    uint64_t fragments;
+    uint64_t fragment_histogram[VSFS_HISTOGRAM_BUCKETS];
+    VsfsFileFragments worst[VSFS_WORST_FILES];
+    int worst_count;
+} VsfsAnalysis;
+
+// Outcome of checking one image
+typedef struct {
+    int found;
+    int fixes;
+    int errors;
+    int unchanged;
+} VsfsResult;
+
+typedef struct VsfsContext VsfsContext;
+
+// Fill in the defaults: no mmap, one thread, io_uring reads, findings kept
+// in the context, no progress lines
+void vsfsck_default_options(VsfsOptions *options);
+
+// New context, or NULL if out of memory
+VsfsContext *vsfsck_new(const VsfsOptions *options);
+
+// Release a context and everything it kept
+void vsfsck_free(VsfsContext *c);
+
+// Open an image file, or use an image held in memory, for the next check.
+// A memory image is checked and repaired in place. Returns 0 or -1.
+int vsfsck_open(VsfsContext *c, const char *path);
+int vsfsck_open_buffer(VsfsContext *c, void *data, size_t len);
+
+// Check the open image and write back the repairs. Returns 0 with the
+// outcome in result, or -1 if the check could not be completed.
+int vsfsck_check(VsfsContext *c, VsfsResult *result);
+
+// Re-apply (undo = 0) or roll back (undo = 1) a committed repair journal
+// onto the open image file. Returns 0 or -1.
+int vsfsck_replay(VsfsContext *c, const char *journal_path, int undo);
+
+// Write the blocks held in a repair overlay onto the open image file in one
+// ascending pass. Returns 0 or -1.
+int vsfsck_merge_overlay(VsfsContext *c, const char *overlay_path);
+
+// Measure free space and fragmentation of the image just checked, from its
+// rebuilt data bitmap and block pointers. Call after vsfsck_check and before
+// vsfsck_close. Returns 0 or -1.
+int vsfsck_analyze(VsfsContext *c, VsfsAnalysis *analysis);
+
+// Findings of the last check still held in the context, and the number of
+// findings of each kind. They stay valid until the next open.
+const Finding *vsfsck_findings(VsfsContext *c, size_t *count);
+const uint64_t *vsfsck_finding_counts(VsfsContext *c);
+
+// Stable name of a kind of finding, as used by the jsonl format
+const char *vsfsck_finding_name(FindingKind kind);
+
+// Timings and counters of the last check, valid until the next open
+const VsfsStats *vsfsck_stats(VsfsContext *c);
+
+// Name of a timed phase
+const char *vsfsck_phase_name(StatsPhase phase);
+
+// Write one finding in a given format
+void vsfsck_write_finding(FILE *out, ReportFormat format, const Finding *f);
+
+// Finish with the open image: write out pending findings, release the image
+// and keep the context's buffers for the next one
+void vsfsck_close(VsfsContext *c);
+
+#endif
@@ -0,0 +1,839 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "vsfsck.h"
+#include "vsfs_format.h"
+
+// Every block of every file in tree order; file i owns
+// blocks[first[i]] up to blocks[first[i + 1]]
+typedef struct {
+    uint32_t *blocks;
+    size_t count;
+    size_t capacity;
+    size_t *first;
+} FileBlocks;
+
+// One regression test; run returns 0 when it passes
+typedef struct {
+    const char *name;
+    int (*run)(void);
+} TestCase;
+
+const char *mkvsfs_path = "./mkvsfs";
+const char *work_dir = "/tmp";
+uint64_t rng_state = 1;
+
+// Next value of a xorshift64* generator, as mkvsfs draws its corruptions
+uint64_t next_random() {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+// Uniform random number in [0, n)
+uint32_t random_below(uint32_t n) {
+    return n ? (uint32_t)(next_random() % n) : 0;
+}
+
+// Run a command with its output discarded; returns its exit status
+int run_command(char **args) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) {
+            dup2(null, STDOUT_FILENO);
+            close(null);
+        }
+        execvp(args[0], args);
+        perror(args[0]);
+        _exit(127);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0) return -1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// Path of a scratch file of this run
+void scratch_path(char *path, size_t size, const char *name) {
+    snprintf(path, size, "%s/vsfstest-%d-%s", work_dir, (int)getpid(), name);
+}
+
+// Read a whole image file into memory
+uint8_t *load_image(const char *path, size_t *len) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    uint8_t *image = malloc(st.st_size);
+    size_t done = 0;
+    while (image && done < (size_t)st.st_size) {
+        ssize_t n = pread(fd, image + done, st.st_size - done, done);
+        if (n <= 0) {
+            free(image);
+            image = NULL;
+            break;
+        }
+        done += n;
+    }
+    close(fd);
+    *len = st.st_size;
+    return image;
+}
+
+// Generate an image file with mkvsfs; extra holds further mkvsfs arguments,
+// NULL-terminated, and may override the defaults. Returns 0 or -1.
+int generate_image(const char *path, char **extra) {
+    char *args[32] = { (char *)mkvsfs_path, "-b", "65536", "-s", "3" };
+    int n = 5;
+    while (extra && *extra && n < 30) args[n++] = *extra++;
+    args[n++] = (char *)path;
+    args[n] = NULL;
+    if (run_command(args) != 0) {
+        fprintf(stderr, "Failed to generate %s\n", path);
+        unlink(path);
+        return -1;
+    }
+    return 0;
+}
+
+// Generate an image with mkvsfs and read it into memory
+uint8_t *make_image(const char *name, char **extra, size_t *len) {
+    char path[4096];
+    scratch_path(path, sizeof(path), name);
+    if (generate_image(path, extra) < 0) return NULL;
+    uint8_t *image = load_image(path, len);
+    unlink(path);
+    return image;
+}
+
+// Write a whole image file
+int save_image(const char *path, uint8_t *image, size_t len) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    size_t done = 0;
+    while (fd >= 0 && done < len) {
+        ssize_t n = pwrite(fd, image + done, len - done, done);
+        if (n <= 0) break;
+        done += n;
+    }
+    if (fd < 0 || done < len) perror(path);
+    if (fd >= 0) close(fd);
+    return fd >= 0 && done == len ? 0 : -1;
+}
+
+// Whether an image file holds exactly the given bytes
+int image_equals(const char *path, uint8_t *expected, size_t len) {
+    size_t actual_len;
+    uint8_t *actual = load_image(path, &actual_len);
+    int equal = actual && actual_len == len && memcmp(actual, expected, len) == 0;
+    free(actual);
+    return equal;
+}
+
+Inode *inode_at(uint8_t *image, uint32_t i) {
+    Superblock *sb = (Superblock *)image;
+    return (Inode *)(image + (size_t)sb->inode_table_start * BLOCK_SIZE) + i;
+}
+
+// Whether an inode is in use, as vsfsck decides it
+int file_in_use(Inode *inode) {
+    return inode->links_count > 0 && inode->dtime == 0;
+}
+
+void add_block(FileBlocks *files, uint32_t block) {
+    if (files->count == files->capacity) {
+        files->capacity = files->capacity ? files->capacity * 2 : 4096;
+        files->blocks = realloc(files->blocks, files->capacity * sizeof(uint32_t));
+        if (!files->blocks) {
+            perror("Failed to allocate block list");
+            exit(1);
+        }
+    }
+    files->blocks[files->count++] = block;
+}
+
+// Add a pointer block and the blocks under it
+void add_tree(FileBlocks *files, uint8_t *image, uint32_t block, uint32_t depth) {
+    Superblock *sb = (Superblock *)image;
+    add_block(files, block);
+    if (depth == 0 || block < sb->first_data_block || block >= sb->total_blocks) return;
+    uint32_t *pointers = (uint32_t *)(image + (size_t)block * BLOCK_SIZE);
+    for (uint32_t k = 0; k < POINTERS_PER_BLOCK; k++) {
+        if (pointers[k]) add_tree(files, image, pointers[k], depth - 1);
+    }
+}
+
+// List the blocks of every file in use
+void collect_files(FileBlocks *files, uint8_t *image) {
+    Superblock *sb = (Superblock *)image;
+    files->count = 0;
+    files->first = realloc(files->first, ((size_t)sb->inode_count + 1) * sizeof(size_t));
+    if (!files->first) {
+        perror("Failed to allocate file table");
+        exit(1);
+    }
+    for (uint32_t i = 0; i < sb->inode_count; i++) {
+        Inode *inode = inode_at(image, i);
+        files->first[i] = files->count;
+        if (!file_in_use(inode)) continue;
+        for (int k = 0; k < DIRECT_POINTERS; k++) {
+            if (inode->direct[k]) add_block(files, inode->direct[k]);
+        }
+        if (inode->single_indirect) add_tree(files, image, inode->single_indirect, 1);
+        if (inode->double_indirect) add_tree(files, image, inode->double_indirect, 2);
+        if (inode->triple_indirect) add_tree(files, image, inode->triple_indirect, 3);
+    }
+    files->first[sb->inode_count] = files->count;
+}
+
+void free_files(FileBlocks *files) {
+    free(files->blocks);
+    free(files->first);
+}
+
+// Check an image held in memory in place; returns the context for its
+// findings, to be released with vsfsck_free, or NULL
+VsfsContext *check_buffer(uint8_t *image, size_t len, VsfsOptions *options, VsfsResult *result) {
+    VsfsContext *c = vsfsck_new(options);
+    if (!c || vsfsck_open_buffer(c, image, len) < 0 || vsfsck_check(c, result) < 0) {
+        if (c) vsfsck_free(c);
+        return NULL;
+    }
+    return c;
+}
+
+// Check an image file; returns the context as check_buffer does
+VsfsContext *check_file(const char *path, VsfsOptions *options, VsfsResult *result) {
+    VsfsContext *c = vsfsck_new(options);
+    if (!c || vsfsck_open(c, path) < 0) {
+        if (c) vsfsck_free(c);
+        return NULL;
+    }
+    if (vsfsck_check(c, result) < 0) {
+        vsfsck_close(c);
+        vsfsck_free(c);
+        return NULL;
+    }
+    return c;
+}
+
+// Check and repair an image file with the given options. Returns the number
+// of fixes applied, or -1.
+int repair_file(const char *path, VsfsOptions *options) {
+    VsfsResult result;
+    VsfsContext *c = check_file(path, options, &result);
+    if (!c) return -1;
+    vsfsck_close(c);
+    vsfsck_free(c);
+    return result.errors == 0 ? result.fixes : -1;
+}
+
+// Write the blocks of a repair overlay onto an image file
+int merge_file(const char *path, const char *overlay) {
+    VsfsOptions options;
+    vsfsck_default_options(&options);
+    VsfsContext *c = vsfsck_new(&options);
+    int status = -1;
+    if (c && vsfsck_open(c, path) == 0) {
+        status = vsfsck_merge_overlay(c, overlay);
+        vsfsck_close(c);
+    }
+    if (c) vsfsck_free(c);
+    return status;
+}
+
+// Roll back (undo = 1) or re-apply a journal onto an image file
+int replay_file(const char *path, const char *journal, int undo) {
+    VsfsOptions options;
+    vsfsck_default_options(&options);
+    VsfsContext *c = vsfsck_new(&options);
+    int status = -1;
+    if (c && vsfsck_open(c, path) == 0) {
+        status = vsfsck_replay(c, journal, undo);
+        vsfsck_close(c);
+    }
+    if (c) vsfsck_free(c);
+    return status;
+}
+
+// Number of findings of one kind in the last check of a context
+uint64_t finding_count(VsfsContext *c, FindingKind kind) {
+    return vsfsck_finding_counts(c)[kind];
+}
+
+// Check and repair an image held in memory with the default options.
+// Returns 0 or -1.
+int check_in_place(uint8_t *image, size_t len, VsfsResult *result) {
+    VsfsOptions options;
+    vsfsck_default_options(&options);
+    VsfsContext *c = check_buffer(image, len, &options, result);
+    if (!c) return -1;
+    vsfsck_close(c);
+    vsfsck_free(c);
+    return 0;
+}
+
+// Findings of one kind in a check of an image held in memory, which is
+// repaired in place; -1 if the check fails
+long long count_findings(uint8_t *image, size_t len, FindingKind kind, VsfsResult *result) {
+    VsfsOptions options;
+    vsfsck_default_options(&options);
+    VsfsContext *c = check_buffer(image, len, &options, result);
+    if (!c) return -1;
+    long long count = finding_count(c, kind);
+    vsfsck_close(c);
+    vsfsck_free(c);
+    return count;
+}
+
+// Overwrite a pointer block the way mkvsfs -c indirect does: some pointers
+// zero, some out of range, some into metadata, some into other files
+void write_garbage(uint8_t *image, uint32_t block) {
+    Superblock *sb = (Superblock *)image;
+    uint32_t data_blocks = sb->total_blocks - sb->first_data_block;
+    uint32_t *pointers = (uint32_t *)(image + (size_t)block * BLOCK_SIZE);
+    for (uint32_t k = 0; k < POINTERS_PER_BLOCK; k++) {
+        uint32_t r = random_below(4);
+        pointers[k] = r == 0 ? 0 : r == 1 ? (uint32_t)next_random()
+                    : r == 2 ? random_below(sb->first_data_block)
+                             : sb->first_data_block + random_below(data_blocks);
+    }
+}
+
+// Whether every file but the one damaged kept all of its blocks
+int files_kept(const char *what, uint8_t *damaged, uint8_t *image, FileBlocks *before, uint32_t victim) {
+    Superblock *sb = (Superblock *)damaged;
+    FileBlocks after = { 0 };
+    int failed = 0;
+    collect_files(&after, image);
+    for (uint32_t i = 0; i < sb->inode_count; i++) {
+        if (i == victim) continue;
+        size_t count = before->first[i + 1] - before->first[i];
+        size_t kept = after.first[i + 1] - after.first[i];
+        if (kept != count || memcmp(before->blocks + before->first[i], after.blocks + after.first[i],
+                                    count * sizeof(uint32_t)) != 0) {
+            fprintf(stderr, "%s: inode %u lost blocks (%zu of %zu kept)\n", what, i, kept, count);
+            failed = 1;
+        } else if (inode_at(image, i)->blocks_count != inode_at(damaged, i)->blocks_count) {
+            fprintf(stderr, "%s: inode %u blocks count changed\n", what, i);
+            failed = 1;
+        }
+    }
+    free_files(&after);
+    return failed ? -1 : 0;
+}
+
+// Repair a copy of the damaged image with one thread count and check that
+// the garbage was reported once and no other file lost blocks
+int repair_garbage(uint8_t *damaged, size_t len, FileBlocks *before, uint32_t victim, int threads) {
+    char what[32];
+    snprintf(what, sizeof(what), "-j %d", threads);
+    uint8_t *image = malloc(len);
+    if (!image) {
+        perror("Failed to allocate image");
+        return -1;
+    }
+    memcpy(image, damaged, len);
+
+    VsfsOptions options;
+    vsfsck_default_options(&options);
+    options.threads = threads;
+    VsfsResult result;
+    VsfsContext *c = check_buffer(image, len, &options, &result);
+    if (!c) {
+        fprintf(stderr, "%s: check failed\n", what);
+        free(image);
+        return -1;
+    }
+    int failed = 0;
+    if (finding_count(c, FINDING_GARBAGE_INDIRECT) != 1) {
+        fprintf(stderr, "%s: garbage indirect block of inode %u not reported\n", what, victim);
+        failed = 1;
+    }
+    vsfsck_close(c);
+    vsfsck_free(c);
+    if (files_kept(what, damaged, image, before, victim) < 0) failed = 1;
+    free(image);
+    return failed ? -1 : 0;
+}
+
+// A pointer block overwritten with garbage is emptied whole; none of its
+// entries may take blocks from other files
+int test_garbage_indirect() {
+    char *extra[] = { "-d", "large", NULL };
+    size_t len;
+    uint8_t *image = make_image("garbage.img", extra, &len);
+    if (!image) return -1;
+
+    // The first file with an indirect block has the lowest pointer block, so
+    // its garbage is met before any other tree
+    Superblock *sb = (Superblock *)image;
+    FileBlocks before = { 0 };
+    collect_files(&before, image);
+    uint32_t victim = 0;
+    while (victim < sb->inode_count &&
+           !(file_in_use(inode_at(image, victim)) && inode_at(image, victim)->single_indirect)) {
+        victim++;
+    }
+    int failed = 0;
+    if (victim == sb->inode_count) {
+        fprintf(stderr, "No file with an indirect block\n");
+        failed = 1;
+    } else {
+        write_garbage(image, inode_at(image, victim)->single_indirect);
+        int threads[] = { 1, 4 };
+        for (int k = 0; k < 2; k++) {
+            if (repair_garbage(image, len, &before, victim, threads[k]) < 0) failed = 1;
+        }
+    }
+    free_files(&before);
+    free(image);
+    return failed ? -1 : 0;
+}
+
+// Repair a copy of an image with a block claimed by two pointer blocks and
+// check that owner kept it and victim alone lost it
+int repair_shared(uint8_t *damaged, size_t len, FileBlocks *before, uint32_t owner, uint32_t victim,
+                  uint32_t block, int threads) {
+    char what[32];
+    snprintf(what, sizeof(what), "-j %d", threads);
+    uint8_t *image = malloc(len);
+    if (!image) {
+        perror("Failed to allocate image");
+        return -1;
+    }
+    memcpy(image, damaged, len);
+
+    VsfsOptions options;
+    vsfsck_default_options(&options);
+    options.threads = threads;
+    VsfsResult result;
+    VsfsContext *c = check_buffer(image, len, &options, &result);
+    if (!c) {
+        fprintf(stderr, "%s: check failed\n", what);
+        free(image);
+        return -1;
+    }
+    int failed = 0;
+    if (finding_count(c, FIX_INDIRECT_DUPLICATE) != 1) {
+        fprintf(stderr, "%s: %llu duplicate references dropped, expected 1\n", what,
+                (unsigned long long)finding_count(c, FIX_INDIRECT_DUPLICATE));
+        failed = 1;
+    }
+    vsfsck_close(c);
+    vsfsck_free(c);
+    if (files_kept(what, damaged, image, before, victim) < 0) failed = 1;
+    Inode *inode = inode_at(image, victim);
+    uint32_t *pointers = (uint32_t *)(image + (size_t)inode->single_indirect * BLOCK_SIZE);
+    if (pointers[0] != 0 || inode->blocks_count + 1 != inode_at(damaged, victim)->blocks_count) {
+        fprintf(stderr, "%s: inode %u still claims block %u held by inode %u\n", what, victim, block, owner);
+        failed = 1;
+    }
+    free(image);
+    return failed ? -1 : 0;
+}
+
+// Two single indirect blocks claiming the same data block: the lower inode
+// keeps it even when its pointer block lies after the other one
+int test_shared_indirect() {
+    char *extra[] = { "-d", "large", NULL };
+    size_t len;
+    uint8_t *image = make_image("shared.img", extra, &len);
+    if (!image) return -1;
+
+    Superblock *sb = (Superblock *)image;
+    uint32_t found[2], count = 0;
+    for (uint32_t i = 0; i < sb->inode_count && count < 2; i++) {
+        Inode *inode = inode_at(image, i);
+        if (file_in_use(inode) && inode->single_indirect) found[count++] = i;
+    }
+    if (count < 2) {
+        fprintf(stderr, "Fewer than two files with an indirect block\n");
+        free(image);
+        return -1;
+    }
+
+    // Swap the two pointer blocks so the owner's comes later in block order
+    uint32_t owner = found[0], victim = found[1];
+    Inode *a = inode_at(image, owner), *b = inode_at(image, victim);
+    uint8_t *block_a = image + (size_t)a->single_indirect * BLOCK_SIZE;
+    uint8_t *block_b = image + (size_t)b->single_indirect * BLOCK_SIZE;
+    uint8_t swap[BLOCK_SIZE];
+    memcpy(swap, block_a, BLOCK_SIZE);
+    memcpy(block_a, block_b, BLOCK_SIZE);
+    memcpy(block_b, swap, BLOCK_SIZE);
+    uint32_t first = a->single_indirect;
+    a->single_indirect = b->single_indirect;
+    b->single_indirect = first;
+
+    FileBlocks before = { 0 };
+    collect_files(&before, image);
+    // The victim's own block stays marked in the bitmap, unreferenced
+    uint32_t block = ((uint32_t *)(image + (size_t)a->single_indirect * BLOCK_SIZE))[0];
+    ((uint32_t *)(image + (size_t)b->single_indirect * BLOCK_SIZE))[0] = block;
+
+    int failed = 0;
+    int threads[] = { 1, 4 };
+    for (int k = 0; k < 2; k++) {
+        if (repair_shared(image, len, &before, owner, victim, block, threads[k]) < 0) failed = 1;
+    }
+    free_files(&before);
+    free(image);
+    return failed ? -1 : 0;
+}
+
+// A journaled repair can be rolled back to the damaged image and re-applied
+// to the repaired one, and is refused by images it was not written for
+int test_journal() {
+    char path[4096], journal[4096], other[4096];
+    char *extra[] = { "-c", "dup=4", "-c", "links=4", NULL };
+    char *smaller[] = { "-b", "32768", NULL };
+    char *reseeded[] = { "-s", "4", NULL };
+    scratch_path(path, sizeof(path), "journal.img");
+    scratch_path(journal, sizeof(journal), "journal.log");
+    scratch_path(other, sizeof(other), "other.img");
+    size_t len, repaired_len, other_len;
+    uint8_t *damaged = NULL, *repaired = NULL, *untouched = NULL;
+    int failed = 1;
+
+    if (generate_image(path, extra) < 0 || !(damaged = load_image(path, &len))) goto done;
+    VsfsOptions options;
+    vsfsck_default_options(&options);
+    options.journal_path = journal;
+    if (repair_file(path, &options) <= 0) {
+        fprintf(stderr, "Journaled repair failed\n");
+        goto done;
+    }
+    if (!(repaired = load_image(path, &repaired_len))) goto done;
+    if (replay_file(path, journal, 1) < 0 || !image_equals(path, damaged, len)) {
+        fprintf(stderr, "Undo did not restore the damaged image\n");
+        goto done;
+    }
+    if (replay_file(path, journal, 0) < 0 || !image_equals(path, repaired, repaired_len)) {
+        fprintf(stderr, "Replay did not restore the repaired image\n");
+        goto done;
+    }
+
+    // Another image of another size, then of the same size
+    char **others[] = { smaller, reseeded };
+    for (int k = 0; k < 2; k++) {
+        if (generate_image(other, others[k]) < 0 || !(untouched = load_image(other, &other_len))) goto done;
+        if (replay_file(other, journal, 0) == 0 || !image_equals(other, untouched, other_len)) {
+            fprintf(stderr, "Journal applied to an image it was not written for\n");
+            goto done;
+        }
+        free(untouched);
+        untouched = NULL;
+    }
+    failed = 0;
+
+done:
+    free(damaged);
+    free(repaired);
+    free(untouched);
+    unlink(path);
+    unlink(journal);
+    unlink(other);
+    return failed ? -1 : 0;
+}
+
+// Repairs sent to an overlay leave the image alone, and merging the overlay
+// gives the image a repair in place would have
+int test_overlay() {
+    char path[4096], overlay[4096];
+    char *extra[] = { "-D", "20", "-c", "dup=4", "-c", "orphan=2", NULL };
+    scratch_path(path, sizeof(path), "overlay.img");
+    scratch_path(overlay, sizeof(overlay), "overlay.cow");
+    size_t len;
+    uint8_t *damaged = NULL, *expected = NULL;
+    int failed = 1;
+
+    if (generate_image(path, extra) < 0 || !(damaged = load_image(path, &len)) || !(expected = malloc(len))) goto done;
+    memcpy(expected, damaged, len);
+    VsfsResult result;
+    if (check_in_place(expected, len, &result) < 0) goto done;
+
+    VsfsOptions options;
+    vsfsck_default_options(&options);
+    options.overlay_path = overlay;
+    if (repair_file(path, &options) <= 0) {
+        fprintf(stderr, "Repair into the overlay failed\n");
+        goto done;
+    }
+    if (!image_equals(path, damaged, len)) {
+        fprintf(stderr, "Repair into the overlay changed the image\n");
+        goto done;
+    }
+    if (merge_file(path, overlay) < 0 || !image_equals(path, expected, len)) {
+        fprintf(stderr, "Merged overlay differs from a repair in place\n");
+        goto done;
+    }
+    failed = 0;
+
+done:
+    free(damaged);
+    free(expected);
+    unlink(path);
+    unlink(overlay);
+    return failed ? -1 : 0;
+}
+
+// Damage to an image whose clean state is in the digest cache
+typedef enum {
+    DAMAGE_INODE,
+    DAMAGE_INDIRECT,
+    DAMAGE_BITMAP,
+    DAMAGE_KINDS
+} Damage;
+
+// Damage one metadata block of a clean image without touching the
+// superblock; returns the finding the check should report
+FindingKind damage_image(uint8_t *image, Damage damage) {
+    Superblock *sb = (Superblock *)image;
+    uint32_t i = 0;
+    while (i < sb->inode_count && !(file_in_use(inode_at(image, i)) && inode_at(image, i)->single_indirect)) i++;
+    Inode *inode = inode_at(image, i);
+    if (damage == DAMAGE_INODE) {
+        inode->direct[0] = sb->total_blocks + 5;
+        return FINDING_BAD_POINTER;
+    }
+    if (damage == DAMAGE_INDIRECT) {
+        ((uint32_t *)(image + (size_t)inode->single_indirect * BLOCK_SIZE))[0] = sb->total_blocks + 5;
+        return FINDING_BAD_INDIRECT_POINTER;
+    }
+    uint8_t *bitmap = image + (size_t)sb->data_bitmap_block * BLOCK_SIZE;
+    bitmap[inode->direct[0] / 8] &= ~(1 << (inode->direct[0] % 8));
+    return FINDING_DATA_UNMARKED;
+}
+
+// A clean image re-checked with its digest cache is confirmed unchanged; a
+// changed inode table, pointer block or bitmap invalidates the cache
+int test_digest_cache() {
+    char path[4096], cache[4096];
+    char *extra[] = { "-d", "large", NULL };
+    const char *names[DAMAGE_KINDS] = { "inode table", "indirect block", "data bitmap" };
+    scratch_path(path, sizeof(path), "cache.img");
+    scratch_path(cache, sizeof(cache), "cache.dat");
+    size_t len;
+    uint8_t *clean = NULL, *damaged = NULL;
+    int failed = 1;
+
+    if (generate_image(path, extra) < 0 || !(clean = load_image(path, &len)) || !(damaged = malloc(len))) goto done;
+    VsfsOptions options;
+    vsfsck_default_options(&options);
+    options.cache_path = cache;
+    VsfsResult result;
+    for (int run = 0; run < 2; run++) {
+        VsfsContext *c = check_file(path, &options, &result);
+        if (!c) goto done;
+        vsfsck_close(c);
+        vsfsck_free(c);
+        if (result.found != 0 || result.unchanged != run) {
+            fprintf(stderr, "Run %d of a clean image: %d findings, unchanged %d\n", run + 1, result.found, result.unchanged);
+            goto done;
+        }
+    }
+
+    failed = 0;
+    for (int d = 0; d < DAMAGE_KINDS; d++) {
+        memcpy(damaged, clean, len);
+        FindingKind kind = damage_image(damaged, (Damage)d);
+        if (save_image(path, damaged, len) < 0) {
+            failed = 1;
+            break;
+        }
+        VsfsContext *c = check_file(path, &options, &result);
+        if (!c) {
+            failed = 1;
+            break;
+        }
+        if (result.unchanged || finding_count(c, kind) != 1) {
+            fprintf(stderr, "Changed %s: unchanged %d, %llu %s findings\n", names[d], result.unchanged,
+                    (unsigned long long)finding_count(c, kind), vsfsck_finding_name(kind));
+            failed = 1;
+        }
+        vsfsck_close(c);
+        vsfsck_free(c);
+    }
+
+done:
+    free(clean);
+    free(damaged);
+    unlink(path);
+    unlink(cache);
+    return failed ? -1 : 0;
+}
+
+// An mtime change behind the checksums' back is caught only on an image
+// that keeps checksums, and repaired
+int test_silent_checksums() {
+    char *clean_args[] = { "-C", NULL };
+    char *checked_args[] = { "-C", "-c", "silent=5", NULL };
+    char *unchecked_args[] = { "-c", "silent=5", NULL };
+    size_t len;
+    VsfsResult result;
+    int failed = 0;
+
+    uint8_t *image = make_image("silent.img", clean_args, &len);
+    if (!image || count_findings(image, len, FINDING_INODE_CHECKSUM, &result) != 0 || result.found != 0) {
+        fprintf(stderr, "Clean image with checksums has findings\n");
+        failed = 1;
+    }
+    free(image);
+
+    image = make_image("silent.img", checked_args, &len);
+    if (!image || count_findings(image, len, FINDING_INODE_CHECKSUM, &result) != 5) {
+        fprintf(stderr, "Silent corruption of 5 inodes not caught by their checksums\n");
+        failed = 1;
+    } else if (count_findings(image, len, FINDING_INODE_CHECKSUM, &result) != 0 || result.found != 0) {
+        fprintf(stderr, "Checksums not repaired\n");
+        failed = 1;
+    }
+    free(image);
+
+    image = make_image("silent.img", unchecked_args, &len);
+    if (!image || count_findings(image, len, FINDING_INODE_CHECKSUM, &result) != 0 || result.found != 0) {
+        fprintf(stderr, "Silent corruption found without checksums\n");
+        failed = 1;
+    }
+    free(image);
+    return failed ? -1 : 0;
+}
+
+// A corruption mkvsfs injects, and whether its repair gives back the
+// clean image byte for byte
+typedef struct {
+    const char *spec;
+    int restores;
+} Corruption;
+
+Corruption corruptions[] = {
+    { "magic", 1 },   { "bitmap=20", 1 }, { "dup=10", 0 },   { "range=10", 0 },
+    { "indirect=2", 0 }, { "links=10", 1 }, { "orphan=5", 0 }, { "cycle=2", 1 },
+};
+
+// Every kind of injected corruption is repaired to the same image by a
+// serial in-memory check and a parallel mapped check of the file, leaves
+// nothing for a second check, and where nothing was lost gives back the
+// clean image
+int test_repairs() {
+    char path[4096];
+    char *clean_args[] = { "-D", "20", NULL };
+    scratch_path(path, sizeof(path), "repair.img");
+    size_t clean_len;
+    uint8_t *clean = make_image("clean.img", clean_args, &clean_len);
+    if (!clean) return -1;
+    int failed = 0;
+
+    for (size_t k = 0; k < sizeof(corruptions) / sizeof(corruptions[0]); k++) {
+        Corruption *corruption = &corruptions[k];
+        char *extra[] = { "-D", "20", "-c", (char *)corruption->spec, NULL };
+        size_t len;
+        uint8_t *image = NULL;
+        if (generate_image(path, extra) < 0 || !(image = load_image(path, &len))) {
+            failed = 1;
+            continue;
+        }
+        VsfsResult result;
+        VsfsOptions options;
+        vsfsck_default_options(&options);
+        options.threads = 4;
+        options.use_mmap = 1;
+        if (check_in_place(image, len, &result) < 0 || result.found == 0 || result.errors != 0) {
+            fprintf(stderr, "%s: %d findings, %d left after repair\n", corruption->spec, result.found, result.errors);
+            failed = 1;
+        } else if (repair_file(path, &options) <= 0 || !image_equals(path, image, len)) {
+            fprintf(stderr, "%s: parallel mapped repair differs from serial repair\n", corruption->spec);
+            failed = 1;
+        } else if (check_in_place(image, len, &result) < 0 || result.found != 0) {
+            fprintf(stderr, "%s: %d findings after repair\n", corruption->spec, result.found);
+            failed = 1;
+        } else if (corruption->restores && (len != clean_len || memcmp(image, clean, len) != 0)) {
+            fprintf(stderr, "%s: repair did not restore the clean image\n", corruption->spec);
+            failed = 1;
+        }
+        free(image);
+    }
+    unlink(path);
+    free(clean);
+    return failed ? -1 : 0;
+}
+
+TestCase tests[] = {
+    { "garbage_indirect", test_garbage_indirect },
+    { "shared_indirect", test_shared_indirect },
+    { "journal", test_journal },
+    { "overlay", test_overlay },
+    { "digest_cache", test_digest_cache },
+    { "silent_checksums", test_silent_checksums },
+    { "repairs", test_repairs },
+};
+
+// Print usage
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--mkvsfs PATH] [--dir DIR] [TEST]...\n", prog);
+    fprintf(stderr, "Generate damaged images with mkvsfs, check and repair them through\n");
+    fprintf(stderr, "libvsfsck and compare the results with what the damage should leave.\n");
+    fprintf(stderr, "Runs every test, or the ones named. Tests:");
+    for (size_t k = 0; k < sizeof(tests) / sizeof(tests[0]); k++) fprintf(stderr, " %s", tests[k].name);
+    fprintf(stderr, "\nBuild: make vsfstest\n");
+}
+
+int main(int argc, char *argv[]) {
+    char **names = calloc(argc, sizeof(char *));
+    int name_count = 0;
+    if (!names) {
+        perror("Failed to allocate test list");
+        return 1;
+    }
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--mkvsfs") == 0 || strcmp(argv[i], "--dir") == 0) {
+            if (i + 1 >= argc) {
+                usage(argv[0]);
+                return 1;
+            }
+            if (strcmp(argv[i], "--mkvsfs") == 0) mkvsfs_path = argv[i + 1];
+            else work_dir = argv[i + 1];
+            i++;
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            names[name_count++] = argv[i];
+        }
+    }
+
+    int failed = 0, ran = 0;
+    for (size_t k = 0; k < sizeof(tests) / sizeof(tests[0]); k++) {
+        int wanted = name_count == 0;
+        for (int n = 0; n < name_count; n++) {
+            if (strcmp(names[n], tests[k].name) == 0) wanted = 1;
+        }
+        if (!wanted) continue;
+        int status = tests[k].run();
+        printf("%s: %s\n", status == 0 ? "ok" : "FAIL", tests[k].name);
+        fflush(stdout);
+        if (status != 0) failed++;
+        ran++;
+    }
+    free(names);
+    if (ran == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    printf("%d of %d tests passed\n", ran - failed, ran);
+    return failed ? 1 : 0;
+}